@@ -0,0 +1,367 @@
+# Streaming decompression of HTTP bodies.
+#
+# All codings of a response are decoded by a single child process,
+# which runs them as a chain of stages: each stage pushes its output
+# directly into the next one, and the last one writes to the output
+# stream.
+
+{.push raises: [].}
+
+import std/posix
+
+import io/chafile
+import io/dynstream
+import types/opt
+import utils/sandbox
+
+# tinfl bindings, see tinfl.h for details
+const
+  TINFL_MAX_HUFF_TABLES = 3
+  TINFL_MAX_HUFF_SYMBOLS_0 = 288
+  TINFL_MAX_HUFF_SYMBOLS_1 = 32
+  TINFL_FAST_LOOKUP_BITS = 10
+  TINFL_FAST_LOOKUP_SIZE = 1 shl TINFL_FAST_LOOKUP_BITS
+
+const TINFL_LZ_DICT_SIZE = 32768
+
+const
+  TINFL_FLAG_PARSE_ZLIB_HEADER = 0x01u32
+  TINFL_FLAG_PARSE_GZIP_HEADER = 0x02u32
+  TINFL_FLAG_HAS_MORE_INPUT = 0x04u32
+
+type tinfl_status {.size: sizeof(cint).} = enum
+  TINFL_STATUS_FAILED_CANNOT_MAKE_PROGRESS = -5
+  TINFL_STATUS_BAD_PARAM = -4
+  TINFL_STATUS_ISIZE_OR_CRC32_MISMATCH = -3
+  TINFL_STATUS_ADLER32_MISMATCH = -2
+  TINFL_STATUS_FAILED = -1
+  TINFL_STATUS_DONE = 0
+  TINFL_STATUS_NEEDS_MORE_INPUT = 1
+  TINFL_STATUS_HAS_MORE_OUTPUT = 2
+
+type tinfl_huff_table {.importc, header: "tinfl.h", completeStruct.} = object
+  m_code_size: array[TINFL_MAX_HUFF_SYMBOLS_0, uint8]
+  m_look_up: array[TINFL_FAST_LOOKUP_SIZE, uint16]
+  m_tree: array[TINFL_MAX_HUFF_SYMBOLS_0 * 2, uint16]
+
+type tinfl_decompressor {.importc, header: "tinfl.h", completeStruct.} = object
+  m_state, m_num_bits, m_zhdr0, m_zhdr1, m_g_isize: uint32
+  m_checksum, m_checksum_current: uint32
+  m_final, m_type, m_check_adler32, m_dist, m_counter, m_num_extra: uint32
+  m_table_sizes: array[TINFL_MAX_HUFF_TABLES, uint32]
+
+  m_bit_buf: uint64
+  m_dist_from_out_buf_start: csize_t
+  m_tables: array[TINFL_MAX_HUFF_TABLES, tinfl_huff_table]
+
+  m_raw_header: array[4, uint8]
+  m_len_codes: array[TINFL_MAX_HUFF_SYMBOLS_0 + TINFL_MAX_HUFF_SYMBOLS_1 + 137,
+    uint8]
+  m_gz_header: array[10, uint8]
+
+{.push importc, cdecl, header: """
+#define TINFL_IMPLEMENTATION
+#include "tinfl.h"
+""".}
+proc tinfl_decompress(r: var tinfl_decompressor; pIn_buf_next: ptr uint8;
+  pIn_buf_size: var csize_t; pOut_buf_start, pOut_buf_next: ptr uint8;
+  pOut_buf_size: var csize_t; decomp_flags: uint32): tinfl_status
+{.pop.} # importc, cdecl, header: "tinfl.h"
+
+# libbrotli bindings
+type BrotliDecoderState {.importc, header: "<brotli/decode.h>",
+  incompleteStruct.} = object
+
+type
+  uint8PConstPImpl {.importc: "const uint8_t**".} = cstring
+  uint8PConstP = distinct uint8PConstPImpl
+
+type BrotliDecoderResult {.size: sizeof(cint).} = enum
+  BROTLI_DECODER_RESULT_ERROR = 0
+  BROTLI_DECODER_RESULT_SUCCESS = 1
+  BROTLI_DECODER_RESULT_NEEDS_MORE_INPUT = 2
+  BROTLI_DECODER_RESULT_NEEDS_MORE_OUTPUT = 3
+
+type
+  brotli_alloc_func {.importc, header: "<brotli/types.h>".} =
+    proc(opaque: pointer; size: csize_t): pointer {.cdecl.}
+  brotli_free_func {.importc, header: "<brotli/types.h>".} =
+    proc(opaque: pointer; address: pointer): pointer {.cdecl.}
+
+  BrotliDecoderErrorCode = cint
+
+{.push importc, cdecl, header: "<brotli/decode.h>".}
+proc BrotliDecoderCreateInstance(alloc_func: brotli_alloc_func;
+  free_func: brotli_free_func; opaque: pointer): ptr BrotliDecoderState
+proc BrotliDecoderDestroyInstance(state: ptr BrotliDecoderState)
+proc BrotliDecoderDecompressStream(state: ptr BrotliDecoderState;
+  available_in: var csize_t; next_in: uint8PConstP;
+  available_out: var csize_t; next_out: var ptr uint8; total_out: ptr csize_t):
+  BrotliDecoderResult
+proc BrotliDecoderGetErrorCode(state: ptr BrotliDecoderState):
+  BrotliDecoderErrorCode
+proc BrotliDecoderErrorString(c: BrotliDecoderErrorCode): cstring
+{.pop.}
+
+# libzstd bindings; only built with -d:enableZstd (see ENABLE_ZSTD in
+# the Makefile).
+const enableZstd* {.booldefine.} = false
+
+when enableZstd:
+  type
+    ZSTD_DStream {.importc, header: "<zstd.h>", incompleteStruct.} = object
+
+    ZSTD_inBuffer {.importc, header: "<zstd.h>".} = object
+      src: pointer
+      size: csize_t
+      pos: csize_t
+
+    ZSTD_outBuffer {.importc, header: "<zstd.h>".} = object
+      dst: pointer
+      size: csize_t
+      pos: csize_t
+
+  {.push importc, cdecl, header: "<zstd.h>".}
+  proc ZSTD_createDStream(): ptr ZSTD_DStream
+  proc ZSTD_freeDStream(zds: ptr ZSTD_DStream): csize_t
+  proc ZSTD_decompressStream(zds: ptr ZSTD_DStream; output: var ZSTD_outBuffer;
+    input: var ZSTD_inBuffer): csize_t
+  proc ZSTD_isError(code: csize_t): cuint
+  proc ZSTD_getErrorName(code: csize_t): cstring
+  {.pop.}
+
+type
+  CompressionType* = enum
+    ctBr = "br"
+    ctDeflate = "deflate"
+    ctGzip = "gzip"
+    ctZstd = "zstd"
+
+  DecodeStage = ref object
+    done: bool
+    obuf: seq[uint8] # output buffer of br and zstd
+    case t: CompressionType
+    of ctDeflate, ctGzip:
+      tinfl: tinfl_decompressor
+      flags: uint32
+      ring: seq[uint8] # output; tinfl refers back to it as the dictionary
+      ringOff: int # where tinfl writes next
+      flushOff: int # start of the output not yet passed on
+    of ctBr:
+      br: ptr BrotliDecoderState
+    of ctZstd:
+      when enableZstd:
+        zstd: ptr ZSTD_DStream
+
+  Decompressor = object
+    stages: seq[DecodeStage] # in decoding order
+    os: PosixStream
+
+# Buffers start small, and double in size whenever they fill up, up to
+# MaxBufferSize.  Small responses stay cheap, while large ones go
+# through with fewer syscalls.
+const InitialBufferSize = 16384
+const MaxBufferSize = 262144
+
+proc die(s: string) {.noreturn.} =
+  let stderr = cast[ChaFile](stderr)
+  discard stderr.writeLine("decompress: " & s)
+  quit(1)
+
+proc newDecodeStage(t: CompressionType): DecodeStage =
+  case t
+  of ctDeflate, ctGzip:
+    let flags = if t == ctGzip:
+      TINFL_FLAG_PARSE_GZIP_HEADER
+    else:
+      TINFL_FLAG_PARSE_ZLIB_HEADER
+    return DecodeStage(
+      t: t,
+      flags: flags or TINFL_FLAG_HAS_MORE_INPUT,
+      ring: newSeqUninit[uint8](TINFL_LZ_DICT_SIZE)
+    )
+  of ctBr:
+    let br = BrotliDecoderCreateInstance(nil, nil, nil)
+    if br == nil:
+      die("failed to create brotli decoder")
+    return DecodeStage(
+      t: t,
+      br: br,
+      obuf: newSeqUninit[uint8](InitialBufferSize)
+    )
+  of ctZstd:
+    when enableZstd:
+      let zstd = ZSTD_createDStream()
+      if zstd == nil:
+        die("failed to create zstd decoder")
+      return DecodeStage(
+        t: t,
+        zstd: zstd,
+        obuf: newSeqUninit[uint8](InitialBufferSize)
+      )
+    else:
+      die("built without zstd support")
+
+proc grow(buf: var seq[uint8]) =
+  if buf.len < MaxBufferSize:
+    buf = newSeqUninit[uint8](buf.len * 2)
+
+# Pointer to iq[n], or nil if iq is exhausted.
+proc inPtr(iq: openArray[uint8]; n: int): ptr uint8 =
+  if n >= iq.len:
+    return nil
+  return unsafeAddr iq[n]
+
+proc feed(d: Decompressor; i: int; iq: openArray[uint8]): Opt[void]
+
+proc flushRing(d: Decompressor; i: int; stage: DecodeStage): Opt[void] =
+  if stage.flushOff < stage.ringOff:
+    let j = stage.flushOff
+    stage.flushOff = stage.ringOff
+    ?d.feed(i + 1, stage.ring.toOpenArray(j, stage.ringOff - 1))
+  if stage.ringOff == stage.ring.len:
+    stage.ringOff = 0
+    stage.flushOff = 0
+  ok()
+
+# Output is passed on once per lap of the ring buffer (or once per
+# input chunk), not after every call to tinfl.
+proc feedTinfl(d: Decompressor; i: int; stage: DecodeStage;
+    iq: openArray[uint8]): Opt[void] =
+  var n = 0
+  while true:
+    var iqn = csize_t(iq.len - n)
+    var oqn = csize_t(stage.ring.len - stage.ringOff)
+    let status = stage.tinfl.tinfl_decompress(iq.inPtr(n), iqn,
+      addr stage.ring[0], addr stage.ring[stage.ringOff], oqn, stage.flags)
+    n += int(iqn)
+    stage.ringOff += int(oqn)
+    if stage.ringOff == stage.ring.len:
+      ?d.flushRing(i, stage)
+    case status
+    of TINFL_STATUS_HAS_MORE_OUTPUT:
+      discard
+    of TINFL_STATUS_NEEDS_MORE_INPUT:
+      break
+    of TINFL_STATUS_DONE:
+      stage.done = true
+      break
+    of TINFL_STATUS_BAD_PARAM: assert false
+    of TINFL_STATUS_ADLER32_MISMATCH, TINFL_STATUS_FAILED,
+        TINFL_STATUS_FAILED_CANNOT_MAKE_PROGRESS,
+        TINFL_STATUS_ISIZE_OR_CRC32_MISMATCH:
+      die($status)
+  d.flushRing(i, stage)
+
+proc feedBrotli(d: Decompressor; i: int; stage: DecodeStage;
+    iq: openArray[uint8]): Opt[void] =
+  var iqn = csize_t(iq.len)
+  var nextIn = iq.inPtr(0)
+  while true:
+    var oqn = csize_t(stage.obuf.len)
+    var nextOut = addr stage.obuf[0]
+    let status = stage.br.BrotliDecoderDecompressStream(iqn,
+      cast[uint8PConstP](addr nextIn), oqn, nextOut, nil)
+    let m = stage.obuf.len - int(oqn)
+    if m > 0:
+      ?d.feed(i + 1, stage.obuf.toOpenArray(0, m - 1))
+    case status
+    of BROTLI_DECODER_RESULT_NEEDS_MORE_INPUT:
+      break
+    of BROTLI_DECODER_RESULT_NEEDS_MORE_OUTPUT:
+      stage.obuf.grow()
+    of BROTLI_DECODER_RESULT_SUCCESS:
+      stage.done = true
+      stage.br.BrotliDecoderDestroyInstance()
+      stage.br = nil
+      break
+    of BROTLI_DECODER_RESULT_ERROR:
+      let c = stage.br.BrotliDecoderGetErrorCode()
+      die($BrotliDecoderErrorString(c))
+  ok()
+
+when enableZstd:
+  proc feedZstd(d: Decompressor; i: int; stage: DecodeStage;
+      iq: openArray[uint8]): Opt[void] =
+    var input = ZSTD_inBuffer(src: iq.inPtr(0), size: csize_t(iq.len), pos: 0)
+    while true:
+      var output = ZSTD_outBuffer(
+        dst: addr stage.obuf[0],
+        size: csize_t(stage.obuf.len),
+        pos: 0
+      )
+      let res = stage.zstd.ZSTD_decompressStream(output, input)
+      if ZSTD_isError(res) != 0:
+        die($ZSTD_getErrorName(res))
+      let m = int(output.pos)
+      if m > 0:
+        ?d.feed(i + 1, stage.obuf.toOpenArray(0, m - 1))
+      # 0 means that a frame has been fully decoded; more may follow.
+      stage.done = res == 0
+      if output.pos == output.size:
+        # the decoder may be holding back more output
+        stage.obuf.grow()
+      elif input.pos == input.size:
+        break
+    ok()
+
+proc feed(d: Decompressor; i: int; iq: openArray[uint8]): Opt[void] =
+  if i == d.stages.len:
+    return d.os.writeLoop(iq)
+  let stage = d.stages[i]
+  if stage.done and stage.t != ctZstd:
+    return ok() # trailing garbage
+  case stage.t
+  of ctDeflate, ctGzip: return d.feedTinfl(i, stage, iq)
+  of ctBr: return d.feedBrotli(i, stage, iq)
+  of ctZstd:
+    when enableZstd:
+      return d.feedZstd(i, stage, iq)
+    else:
+      die("built without zstd support")
+
+proc run(d: Decompressor; ps: PosixStream) =
+  var iq = newSeqUninit[uint8](InitialBufferSize)
+  while true:
+    let n = ps.read(iq)
+    if n <= 0:
+      break
+    if d.feed(0, iq.toOpenArray(0, n - 1)).isErr:
+      quit(1)
+    if n == iq.len:
+      iq.grow()
+  for stage in d.stages:
+    if not stage.done and stage.t in {ctBr, ctZstd}:
+      die("unexpected end of " & $stage.t & " stream")
+  quit(0)
+
+# Fork a process that decodes codings (given in decoding order) from
+# the returned stream, and writes the result to os.
+# If codings is empty, os itself is returned; if the fork fails, nil.
+proc startDecompressor*(os: PosixStream; codings: openArray[CompressionType]):
+    PosixStream =
+  if codings.len == 0:
+    return os
+  var pipefd {.noinit.}: array[2, cint]
+  if pipe(pipefd) != 0:
+    return nil
+  let pins = newPosixStream(pipefd[0])
+  let pouts = newPosixStream(pipefd[1])
+  case fork()
+  of -1:
+    pins.sclose()
+    pouts.sclose()
+    return nil
+  of 0: # child
+    enterNetworkSandbox()
+    pouts.sclose()
+    var d = Decompressor(os: os)
+    for t in codings:
+      d.stages.add(newDecodeStage(t))
+    d.run(pins)
+    quit(0)
+  else: # parent
+    pins.sclose()
+    return pouts
+
+{.pop.} # raises: []
@@ -105,6 +105,6 @@ proc main() =
   else:
     discard os.writeLoop("Cha-Control: ConnectionError FileNotFound")
 
-main()
+cgiMain(main)
 
 {.pop.} # raises: []
@@ -6,103 +6,17 @@ import std/os
 import std/posix
 
 import io/dynstream
+import io/packetreader
+import io/packetwriter
 import types/opt
-import utils/sandbox
+import utils/myposix
 
+import adapter/protocol/decompress
+import adapter/protocol/httpcache
 import adapter/protocol/lcgi_ssl
 
-# tinfl bindings, see tinfl.h for details
-const
-  TINFL_MAX_HUFF_TABLES = 3
-  TINFL_MAX_HUFF_SYMBOLS_0 = 288
-  TINFL_MAX_HUFF_SYMBOLS_1 = 32
-  TINFL_FAST_LOOKUP_BITS = 10
-  TINFL_FAST_LOOKUP_SIZE = 1 shl TINFL_FAST_LOOKUP_BITS
-
-const TINFL_LZ_DICT_SIZE = 32768
-
-const
-  TINFL_FLAG_PARSE_ZLIB_HEADER = 0x01u32
-  TINFL_FLAG_PARSE_GZIP_HEADER = 0x02u32
-  TINFL_FLAG_HAS_MORE_INPUT = 0x04u32
-  TINFL_FLAG_USING_NON_WRAPPING_OUTPUT_BUF* = 0x08u32
-
-type tinfl_status {.size: sizeof(cint).} = enum
-  TINFL_STATUS_FAILED_CANNOT_MAKE_PROGRESS = -5
-  TINFL_STATUS_BAD_PARAM = -4
-  TINFL_STATUS_ISIZE_OR_CRC32_MISMATCH = -3
-  TINFL_STATUS_ADLER32_MISMATCH = -2
-  TINFL_STATUS_FAILED = -1
-  TINFL_STATUS_DONE = 0
-  TINFL_STATUS_NEEDS_MORE_INPUT = 1
-  TINFL_STATUS_HAS_MORE_OUTPUT = 2
-
-type tinfl_huff_table {.importc, header: "tinfl.h", completeStruct.} = object
-  m_code_size: array[TINFL_MAX_HUFF_SYMBOLS_0, uint8]
-  m_look_up: array[TINFL_FAST_LOOKUP_SIZE, uint16]
-  m_tree: array[TINFL_MAX_HUFF_SYMBOLS_0 * 2, uint16]
-
-type tinfl_decompressor {.importc, header: "tinfl.h", completeStruct.} = object
-  m_state, m_num_bits, m_zhdr0, m_zhdr1, m_g_isize: uint32
-  m_checksum, m_checksum_current: uint32
-  m_final, m_type, m_check_adler32, m_dist, m_counter, m_num_extra: uint32
-  m_table_sizes: array[TINFL_MAX_HUFF_TABLES, uint32]
-
-  m_bit_buf: uint64
-  m_dist_from_out_buf_start: csize_t
-  m_tables: array[TINFL_MAX_HUFF_TABLES, tinfl_huff_table]
-
-  m_raw_header: array[4, uint8]
-  m_len_codes: array[TINFL_MAX_HUFF_SYMBOLS_0 + TINFL_MAX_HUFF_SYMBOLS_1 + 137,
-    uint8]
-  m_gz_header: array[10, uint8]
-
-{.push importc, cdecl, header: """
-#define TINFL_IMPLEMENTATION
-#include "tinfl.h"
-""".}
-proc tinfl_decompress(r: var tinfl_decompressor; pIn_buf_next: ptr uint8;
-  pIn_buf_size: var csize_t; pOut_buf_start, pOut_buf_next: ptr uint8;
-  pOut_buf_size: var csize_t; decomp_flags: uint32): tinfl_status
-{.pop.} # importc, cdecl, header: "tinfl.h"
-
 const InputBufferSize = 16384
 
-# libbrotli bindings
-type BrotliDecoderState {.importc, header: "<brotli/decode.h>",
-  incompleteStruct.} = object
-
-type
-  uint8PConstPImpl {.importc: "const uint8_t**".} = cstring
-  uint8PConstP = distinct uint8PConstPImpl
-
-type BrotliDecoderResult {.size: sizeof(cint).} = enum
-  BROTLI_DECODER_RESULT_ERROR = 0
-  BROTLI_DECODER_RESULT_SUCCESS = 1
-  BROTLI_DECODER_RESULT_NEEDS_MORE_INPUT = 2
-  BROTLI_DECODER_RESULT_NEEDS_MORE_OUTPUT = 3
-
-type
-  brotli_alloc_func {.importc, header: "<brotli/types.h>".} =
-    proc(opaque: pointer; size: csize_t): pointer {.cdecl.}
-  brotli_free_func {.importc, header: "<brotli/types.h>".} =
-    proc(opaque: pointer; address: pointer): pointer {.cdecl.}
-
-  BrotliDecoderErrorCode = cint
-
-{.push importc, cdecl, header: "<brotli/decode.h>".}
-proc BrotliDecoderCreateInstance(alloc_func: brotli_alloc_func;
-  free_func: brotli_free_func; opaque: pointer): ptr BrotliDecoderState
-proc BrotliDecoderDestroyInstance(state: ptr BrotliDecoderState)
-proc BrotliDecoderDecompressStream(state: ptr BrotliDecoderState;
-  available_in: var csize_t; next_in: uint8PConstP;
-  available_out: var csize_t; next_out: var ptr uint8; total_out: ptr csize_t):
-  BrotliDecoderResult
-proc BrotliDecoderGetErrorCode(state: ptr BrotliDecoderState):
-  BrotliDecoderErrorCode
-proc BrotliDecoderErrorString(c: BrotliDecoderErrorCode): cstring
-{.pop.}
-
 type
   HTTPHandle = ref object
     state: HTTPState
@@ -112,133 +26,36 @@ type
     httpStream: PosixStream # used in HTTP
     os: PosixStream
     line: string
-    contentEncodings: seq[ContentEncoding]
+    contentEncodings: seq[CompressionType]
     transferEncodings: seq[TransferEncoding]
     headersBuf: string # buffer of all headers to be printed on stdout
+    status: uint16
+    headOnly: bool # request method was HEAD, so the response has no body
+    reused: bool # httpStream was an idle connection handed to us by loader
+    reusable: bool # the server allows us to keep the connection alive
+    cache: HTTPCache # nil if the response must not be cached
+    cacheKey: string
+    reqHeaders: string
+    cacheEntry: CacheEntry # the copy we are revalidating, if any
+    cacheWriter: CacheWriter
+    headers: seq[HTTPHeader] # received headers; only kept for the cache
 
   HTTPState = enum
     hsStatus, hsHeaders, hsChunkSize, hsChunkSizeCr, hsAfterChunk,
     hsAfterChunkCr, hsBody, hsTrailers, hsDone
 
-  ContentEncoding = enum
-    ceBr = "br"
-    ceDeflate = "deflate"
-    ceGzip = "gzip"
-
   TransferEncoding = enum
     teBr = "br"
     teChunked = "chunked"
     teGzip = "gzip"
     teDeflate = "deflate"
+    teZstd = "zstd"
 
 proc die(s: string) {.noreturn.} =
   let stderr = cast[ChaFile](stderr)
   discard stderr.writeLine("newhttp: " & s)
   quit(1)
 
-proc inflate(op: HTTPHandle; flag: uint32) =
-  var pipefd {.noinit.}: array[2, cint]
-  if pipe(pipefd) != 0:
-    return
-  let pins = newPosixStream(pipefd[0])
-  let pouts = newPosixStream(pipefd[1])
-  case fork()
-  of -1:
-    pins.sclose()
-    pouts.sclose()
-  of 0: # child
-    enterNetworkSandbox()
-    pouts.sclose()
-    let os = op.os
-    var flags = flag or TINFL_FLAG_HAS_MORE_INPUT
-    var decomp = tinfl_decompressor()
-    var iq {.noinit.}: array[InputBufferSize, uint8]
-    var oq {.noinit.}: array[TINFL_LZ_DICT_SIZE, uint8]
-    var oqoff = 0
-    while true:
-      let len0 = pins.read(iq)
-      if len0 <= 0:
-        break
-      let len = csize_t(len0)
-      var n = csize_t(0)
-      while n < len:
-        var iqn = csize_t(len) - n
-        var oqn = csize_t(oq.len - oqoff)
-        let status = decomp.tinfl_decompress(addr iq[n], iqn, addr oq[0],
-          addr oq[oqoff], oqn, flags)
-        if os.writeLoop(oq.toOpenArray(oqoff, oqoff + int(oqn) - 1)).isErr:
-          quit(1)
-        oqoff = int((csize_t(oqoff) + oqn) and csize_t(oq.len) - 1)
-        n += iqn
-        case status
-        of TINFL_STATUS_HAS_MORE_OUTPUT:
-          discard
-        of TINFL_STATUS_NEEDS_MORE_INPUT:
-          assert len == n
-        of TINFL_STATUS_DONE:
-          quit(0)
-        of TINFL_STATUS_BAD_PARAM: assert false
-        of TINFL_STATUS_ADLER32_MISMATCH, TINFL_STATUS_FAILED,
-            TINFL_STATUS_FAILED_CANNOT_MAKE_PROGRESS,
-            TINFL_STATUS_ISIZE_OR_CRC32_MISMATCH:
-          die($status)
-    quit(0)
-  else: # parent
-    pins.sclose()
-    op.os = pouts
-
-proc unbrotli(op: HTTPHandle) =
-  var pipefd {.noinit.}: array[2, cint]
-  if pipe(pipefd) != 0:
-    return
-  let pins = newPosixStream(pipefd[0])
-  let pouts = newPosixStream(pipefd[1])
-  case fork()
-  of -1:
-    pins.sclose()
-    pouts.sclose()
-  of 0: # child
-    enterNetworkSandbox()
-    pouts.sclose()
-    let os = op.os
-    let decomp = BrotliDecoderCreateInstance(nil, nil, nil)
-    var iq {.noinit.}: array[InputBufferSize, uint8]
-    var oq {.noinit.}: array[InputBufferSize * 2, uint8]
-    while true:
-      let len0 = pins.read(iq)
-      if len0 <= 0:
-        break
-      let len = csize_t(len0)
-      var n = csize_t(0)
-      while true:
-        var iqn = csize_t(len) - n
-        var oqn = csize_t(oq.len)
-        var next_in = addr iq[n]
-        var next_out = addr oq[0]
-        let next_inP = cast[uint8PConstP](addr next_in)
-        let status = decomp.BrotliDecoderDecompressStream(iqn, next_inP, oqn,
-          next_out, nil)
-        if os.writeLoop(oq.toOpenArray(0, oq.len - int(oqn) - 1)).isErr:
-          quit(1)
-        n = csize_t(len) - iqn
-        case status
-        of BROTLI_DECODER_RESULT_NEEDS_MORE_INPUT:
-          assert len == n
-          break
-        of BROTLI_DECODER_RESULT_NEEDS_MORE_OUTPUT:
-          discard
-        of BROTLI_DECODER_RESULT_SUCCESS:
-          decomp.BrotliDecoderDestroyInstance()
-          quit(0)
-        of BROTLI_DECODER_RESULT_ERROR:
-          let c = decomp.BrotliDecoderGetErrorCode()
-          die($BrotliDecoderErrorString(c))
-    # should be unreachable I think
-    die("unexpected end of brotli stream")
-  else: # parent
-    pins.sclose()
-    op.os = pouts
-
 proc flushStatus(op: HTTPHandle; line: openArray[char]) =
   const HttpStart = "HTTP/1.0 "
   if not line.startsWithIgnoreCase("HTTP/1.1 ") and
@@ -251,6 +68,8 @@ proc flushStatus(op: HTTPHandle; line: openArray[char]) =
     cgiDie(ceInvalidResponse)
   let code = parseUInt16(line.toOpenArray(HttpStart.len, codeIdx - 1))
     .orDie(ceInvalidResponse)
+  op.status = code
+  op.reusable = line.startsWithIgnoreCase("HTTP/1.1 ")
   op.headersBuf = "Status: " & $code & "\r\nCha-Control: ControlDone\r\n"
   op.state = hsHeaders
 
@@ -273,6 +92,25 @@ proc handleStatus(op: HTTPHandle; iq: openArray[char]): int =
     op.line = ""
   i + 1
 
+proc addHeader(op: HTTPHandle; name, value: string) =
+  if name.equalsIgnoreCase("Content-Encoding"):
+    for it in value.split(','):
+      if ce := parseEnumNoCase[CompressionType](it):
+        if enableZstd or ce != ctZstd:
+          op.contentEncodings.add(ce)
+  elif name.equalsIgnoreCase("Transfer-Encoding"):
+    for it in value.split(','):
+      if te := parseEnumNoCase[TransferEncoding](it):
+        if enableZstd or te != teZstd:
+          op.transferEncodings.add(te)
+  elif name.equalsIgnoreCase("Content-Length"):
+    op.chunkSize = parseUInt64(value).get(uint64.high)
+  elif name.equalsIgnoreCase("Connection"):
+    for it in value.split(','):
+      if it.strip().equalsIgnoreCase("close"):
+        op.reusable = false
+  op.headersBuf &= name & ": " & value & "\r\n"
+
 proc addHeader(op: HTTPHandle) =
   var name = move(op.line)
   let i = name.find(':')
@@ -286,38 +124,81 @@ proc addHeader(op: HTTPHandle) =
     let value = name.substr(valueIdx)
     name.setLen(j + 1)
     if '\r' notin name and '\r' notin value:
-      if name.equalsIgnoreCase("Content-Encoding"):
-        for it in value.split(','):
-          if ce := parseEnumNoCase[ContentEncoding](it):
-            op.contentEncodings.add(ce)
-      elif name.equalsIgnoreCase("Transfer-Encoding"):
-        for it in value.split(','):
-          if te := parseEnumNoCase[TransferEncoding](it):
-            op.transferEncodings.add(te)
-      elif name.equalsIgnoreCase("Content-Length"):
-        op.chunkSize = parseUInt64(value).get(uint64.high)
-      op.headersBuf &= name & ": " & value & "\r\n"
-
-proc flushHeaders(op: HTTPHandle) =
-  op.headersBuf &= "\r\n"
-  if op.os.writeLoop(op.headersBuf).isErr:
+      if op.cache != nil:
+        op.headers.add((name, value))
+      op.addHeader(name, value)
+
+# Replace the received status and headers with those of the cached
+# response.
+proc loadCachedHeaders(op: HTTPHandle) =
+  let entry = op.cacheEntry
+  op.headersBuf = "Status: " & $entry.status &
+    "\r\nCha-Control: ControlDone\r\n"
+  op.contentEncodings.setLen(0)
+  op.transferEncodings.setLen(0)
+  for it in entry.headers:
+    op.addHeader(it.name, it.value)
+
+proc copyCachedBody(op: HTTPHandle) =
+  let ps = op.cacheEntry.openBody()
+  if ps == nil:
     quit(1)
-  for ce in op.contentEncodings.ritems:
-    case ce
-    of ceBr: op.unbrotli()
-    of ceGzip: op.inflate(TINFL_FLAG_PARSE_GZIP_HEADER)
-    of ceDeflate: op.inflate(TINFL_FLAG_PARSE_ZLIB_HEADER)
+  var buffer {.noinit.}: array[InputBufferSize, char]
+  while (let n = ps.read(buffer); n > 0):
+    if op.os.writeLoop(buffer.toOpenArray(0, n - 1)).isErr:
+      quit(1)
+  ps.sclose()
+
+proc writeHeaders(op: HTTPHandle) =
+  # Codings are listed in the order they were applied, so we undo them
+  # backwards: transfer codings first, then content codings.
+  var codings: seq[CompressionType] = @[]
   op.bodyState = hsBody
   for i in countdown(op.transferEncodings.high, 0):
     case op.transferEncodings[i]
-    of teBr: op.unbrotli()
+    of teBr: codings.add(ctBr)
     of teChunked:
       if i == 0:
         op.bodyState = hsChunkSize
         op.chunkSize = 0
-    of teGzip: op.inflate(TINFL_FLAG_PARSE_GZIP_HEADER)
-    of teDeflate: op.inflate(TINFL_FLAG_PARSE_ZLIB_HEADER)
+    of teGzip: codings.add(ctGzip)
+    of teDeflate: codings.add(ctDeflate)
+    of teZstd: codings.add(ctZstd)
+  for ce in op.contentEncodings.ritems:
+    codings.add(ce)
+  # Start the decompressor before sending the headers, so that we can
+  # still report an error if that fails.  (It only writes once we pass
+  # it the body.)
+  let os = op.os.startDecompressor(codings)
+  if os == nil:
+    cgiDie(ceInternalError, "failed to start decompressor")
+  op.headersBuf &= "\r\n"
+  if op.os.writeLoop(op.headersBuf).isErr:
+    quit(1)
+  op.os = os
+
+proc flushHeaders(op: HTTPHandle) =
+  if op.status == 304 and op.cacheEntry != nil:
+    # our copy is still valid; send that instead
+    op.cache.update(op.cacheEntry, op.headers)
+    op.loadCachedHeaders()
+    # we do not store cookies, but must still pass on the new ones
+    for it in op.headers:
+      if it.name.equalsIgnoreCase("Set-Cookie"):
+        op.headersBuf &= it.name & ": " & it.value & "\r\n"
+    op.writeHeaders()
+    op.copyCachedBody()
+    op.state = hsDone
+    return
+  if op.cache != nil and op.transferEncodings.len <= 1 and
+      (op.transferEncodings.len == 0 or op.transferEncodings[0] == teChunked):
+    op.cacheWriter = op.cache.store(op.cacheKey, op.reqHeaders, op.status,
+      op.headers)
+  op.writeHeaders()
   op.state = op.bodyState
+  if op.headOnly or op.status in {204u16, 304u16} or
+      op.bodyState == hsBody and op.chunkSize == 0:
+    op.state = hsDone
 
 proc handleHeaders(op: HTTPHandle; iq: openArray[char]): int =
   let i = iq.find('\n')
@@ -367,9 +248,11 @@ proc handleBody(op: HTTPHandle; iq: openArray[char]): int =
   let n = int(L)
   if op.os.writeLoop(iq.toOpenArray(0, n - 1)).isErr:
     quit(1)
+  if op.cacheWriter != nil:
+    op.cacheWriter.write(iq.toOpenArray(0, n - 1))
   op.chunkSize -= L
   if op.bodyState == hsBody and op.chunkSize == 0:
-    return -1 # we're done
+    op.state = hsDone
   return n
 
 proc handleAfterChunk(op: HTTPHandle; iq: openArray[char]): int =
@@ -445,6 +328,45 @@ proc close(op: HTTPHandle) =
   else:
     op.httpStream.sclose()
 
+# Receive an idle connection to our host from the loader, if it has one.
+proc recvConnection(keepAlive: PosixStream): PosixStream =
+  var ps: PosixStream = nil
+  keepAlive.withPacketReader r:
+    var hasConn: bool
+    r.sread(hasConn)
+    if hasConn:
+      ps = newPosixStream(r.recvFd())
+  do:
+    discard
+  ps
+
+# Hand the connection back to the loader, so that the next request to
+# the same host can skip the handshake.
+proc returnConnection(op: HTTPHandle; keepAlive: PosixStream) =
+  keepAlive.withPacketWriterFire w:
+    w.sendFd(op.httpStream.fd) # closed by the writer
+
+# The server closed the idle connection we got before we could use it;
+# retry on a fresh one.
+proc reconnect(op: HTTPHandle; host, port, buf: string) =
+  op.httpStream.sclose()
+  op.httpStream = connectSocket(host, port).orDie()
+  op.reused = false
+  op.writeLoop(buf).orDie(ceConnectionRefused, "error sending request header")
+
+# Answer the request from the cache, without contacting the server.
+proc loadFromCache(op: HTTPHandle; keepAlive: PosixStream) =
+  if keepAlive != nil:
+    # give back the idle connection we received, if any
+    op.httpStream = keepAlive.recvConnection()
+    if op.httpStream != nil:
+      op.returnConnection(keepAlive)
+  if op.os.writeLoop("Cha-Control: Connected\r\n").isErr:
+    quit(1)
+  op.loadCachedHeaders()
+  op.writeHeaders()
+  op.copyCachedBody()
+
 proc main*(scheme: string) =
   if paramCount() != 4:
     cgiDie(ceInternalError, "usage: http [host] [port] [path] [query]")
@@ -456,28 +378,62 @@ proc main*(scheme: string) =
   if port == "":
     port = if secure: "443" else: "80"
   let os = newPosixStream(STDOUT_FILENO)
-  let op = HTTPHandle(os: os, chunkSize: uint64.high)
+  let requestMethod = getEnvEmpty("REQUEST_METHOD")
+  let op = HTTPHandle(
+    os: os,
+    chunkSize: uint64.high,
+    headOnly: requestMethod == "HEAD"
+  )
+  var keepAlive: PosixStream = nil
+  if not secure:
+    if fd := parseInt32(getEnvEmpty("CHA_KEEPALIVE_FD")):
+      keepAlive = newPosixStream(cint(fd))
+  let reqHeaders = getEnvEmpty("REQUEST_HEADERS")
+  if requestMethod == "GET":
+    let mode = getRequestCacheMode(reqHeaders)
+    let cache = if mode != rcmNoStore: openHTTPCache() else: nil
+    if cache != nil:
+      op.cache = cache
+      op.cacheKey = cacheKey(scheme, host, port, path, query)
+      op.reqHeaders = reqHeaders
+      op.cacheEntry = cache.lookup(op.cacheKey, reqHeaders)
+      if op.cacheEntry != nil and mode == rcmDefault and
+          op.cacheEntry.isFresh():
+        op.loadFromCache(keepAlive)
+        return
   if secure:
     let ssl = connectSSLSocket(host, port, useDefaultCA = true).orDie()
     if getEnvEmpty("CHA_INSECURE_SSL_NO_VERIFY", "0") != "1":
       checkCert(ssl)
     op.ssl = ssl
   else:
-    op.httpStream = connectSocket(host, port).orDie()
-  let requestMethod = getEnvEmpty("REQUEST_METHOD")
+    if keepAlive != nil:
+      op.httpStream = keepAlive.recvConnection()
+    if op.httpStream != nil:
+      op.reused = true
+      # the server may have closed it; get EPIPE instead of dying
+      discard myposix.signal(SIGPIPE, myposix.SIG_IGN)
+    else:
+      op.httpStream = connectSocket(host, port).orDie()
   var buf = requestMethod & ' ' & path & query
   buf &= " HTTP/1.1\r\n"
   buf &= "Host: " & host
   if secure and port != "443" or not secure and port != "80":
     buf &= ':' & port
   buf &= "\r\n"
-  buf &= "Connection: close\r\n"
+  if keepAlive == nil:
+    buf &= "Connection: close\r\n"
   let contentLength = getEnvEmpty("CONTENT_LENGTH")
   if n := parseUInt64(contentLength):
     buf &= "Content-Length: " & $n & "\r\n"
-  buf &= getEnvEmpty("REQUEST_HEADERS")
+  buf &= reqHeaders
+  if op.cacheEntry != nil:
+    buf &= op.cacheEntry.conditionalHeaders()
   buf &= "\r\n"
-  op.writeLoop(buf).orDie(ceConnectionRefused, "error sending request header")
+  if op.writeLoop(buf).isErr:
+    if not op.reused:
+      cgiDie(ceConnectionRefused, "error sending request header")
+    op.reconnect(host, port, buf)
   var iq {.noinit.}: array[InputBufferSize, char]
   if requestMethod == "POST":
     let ps = newPosixStream(STDIN_FILENO)
@@ -486,14 +442,28 @@ proc main*(scheme: string) =
         .orDie(ceConnectionRefused, "error sending request body")
   if os.writeLoop("Cha-Control: Connected\r\n").isErr:
     quit(1)
-  block readResponse:
-    while (let n = op.read(iq); n > 0):
-      var m = 0
-      while m < n:
-        let k = op.handleBuffer(iq.toOpenArray(m, n - 1))
-        if k == -1: # hsDone
-          break readResponse
-        m += k
-  op.close()
+  var n = op.read(iq)
+  if n <= 0 and op.reused:
+    op.reconnect(host, port, buf)
+    n = op.read(iq)
+  var m = 0
+  while n > 0:
+    m = 0
+    while m < n and op.state != hsDone:
+      m += op.handleBuffer(iq.toOpenArray(m, n - 1))
+    if op.state == hsDone:
+      break
+    n = op.read(iq)
+  # Only return the connection if the response ended exactly where the
+  # server said it would.
+  if keepAlive != nil and op.reusable and op.state == hsDone and m == n:
+    op.returnConnection(keepAlive)
+  else:
+    op.close()
+  if op.cacheWriter != nil:
+    if op.state == hsDone:
+      op.cacheWriter.finish()
+    else: # truncated, or delimited by closing the connection
+      op.cacheWriter.abort()
 
 {.pop.} # raises: []
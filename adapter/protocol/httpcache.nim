@@ -0,0 +1,452 @@
+# Persistent HTTP cache, shared by all HTTP adapter processes.
+#
+# Entries live in $CHA_DATA_DIR/http-cache, named after a hash of the
+# request URL.  Each consists of a ".h" file with the key, the response
+# status, headers and freshness information, and a ".{id}.b" file with
+# the response body as we received it (i.e. still content-encoded).
+# Each stored response gets a new body id, which is recorded in its
+# header file.  Both are written to temporary files first and then
+# renamed, the header last, so readers never see partial entries or pair
+# a header with another response's body.
+#
+# Least recently used entries are deleted when the cache grows larger
+# than CHA_HTTP_CACHE_SIZE megabytes.  To avoid scanning the directory
+# on every store, the ".size" file holds an estimate of the total size,
+# which is only corrected when it exceeds the limit.
+
+{.push raises: [].}
+
+import std/algorithm
+import std/posix
+import std/times
+
+import io/chafile
+import io/dynstream
+import types/opt
+import utils/httpdate
+import utils/twtstr
+
+type
+  HTTPHeader* = tuple[name, value: string]
+
+  HTTPCache* = ref object
+    dir: string
+    maxSize: int64
+
+  RequestCacheMode* = enum
+    rcmDefault # may use fresh responses without asking the server
+    rcmNoCache # must revalidate, e.g. on reload
+    rcmNoStore # must not touch the cache
+
+  CacheEntry* = ref object
+    path: string # without extension
+    key: string
+    status*: uint16
+    freshUntil: int64 # unix time
+    bodyLen: int64
+    bodyId: string
+    body: PosixStream # opened by lookup
+    vary: seq[HTTPHeader] # request headers the response depends on
+    headers*: seq[HTTPHeader]
+
+  PruneItem = object
+    key: string # the hashed key all files of an entry start with
+    mtime: int64 # of the header file
+    size: int64
+    files: seq[string]
+
+  CacheWriter* = ref object
+    cache: HTTPCache
+    entry: CacheEntry
+    body: PosixStream
+    tmp: string # path of the temporary files, without extension
+
+# Headers that only concern the connection they were received on, and
+# ones that would do harm if replayed.
+const UnstoredHeaders = [
+  "Connection", "Keep-Alive", "Proxy-Authenticate", "Proxy-Connection",
+  "Set-Cookie", "TE", "Trailer", "Transfer-Encoding", "Upgrade"
+]
+
+# Headers of a 304 response that must not replace the stored ones.
+const KeptHeaders = [
+  "Content-Encoding", "Content-Length", "Content-Range", "Content-Type"
+]
+
+# Statuses that may be cached without explicit freshness information.
+const HeuristicStatus = [
+  200u16, 203, 204, 300, 301, 308, 404, 405, 410, 414, 501
+]
+
+proc isIn(name: string; list: openArray[string]): bool =
+  for it in list:
+    if name.equalsIgnoreCase(it):
+      return true
+  false
+
+iterator headerLines(s: string): HTTPHeader =
+  for line in s.split('\n'):
+    let i = line.find(':')
+    if i > 0:
+      yield (line.substr(0, i - 1).strip(), line.substr(i + 1).strip())
+
+proc getFirst(headers: openArray[HTTPHeader]; name: string): string =
+  for it in headers:
+    if it.name.equalsIgnoreCase(name):
+      return it.value
+  ""
+
+proc getFirst(s: string; name: string): string =
+  for it in s.headerLines:
+    if it.name.equalsIgnoreCase(name):
+      return it.value
+  ""
+
+iterator directives(headers: openArray[HTTPHeader]; name: string):
+    tuple[name, value: string] =
+  for it in headers:
+    if it.name.equalsIgnoreCase(name):
+      for dir in it.value.split(','):
+        let dir = dir.strip()
+        let i = dir.find('=')
+        if i == -1:
+          yield (dir.toLowerAscii(), "")
+        else:
+          var value = dir.substr(i + 1).strip()
+          if value.len >= 2 and value[0] == '"' and value[^1] == '"':
+            value = value.substr(1, value.len - 2)
+          yield (dir.substr(0, i - 1).strip().toLowerAscii(), value)
+
+proc openHTTPCache*(): HTTPCache =
+  let dataDir = getEnvEmpty("CHA_DATA_DIR")
+  let size = parseInt64(getEnvEmpty("CHA_HTTP_CACHE_SIZE")).get(0)
+  if dataDir == "" or size <= 0:
+    return nil
+  let dir = dataDir & "/http-cache"
+  if mkdir(cstring(dir), 0o700) != 0 and errno != EEXIST:
+    return nil
+  HTTPCache(dir: dir, maxSize: size * 1024 * 1024)
+
+proc getRequestCacheMode*(reqHeaders: string): RequestCacheMode =
+  var headers: seq[HTTPHeader] = @[]
+  for it in reqHeaders.headerLines:
+    # let the client handle validation and partial content itself
+    if it.name.isIn(["If-None-Match", "If-Modified-Since", "If-Match",
+        "If-Unmodified-Since", "If-Range", "Range"]):
+      return rcmNoStore
+    headers.add(it)
+  result = rcmDefault
+  for it in headers.directives("Cache-Control"):
+    if it.name == "no-store":
+      return rcmNoStore
+    if it.name == "no-cache" or it.name == "max-age" and it.value == "0":
+      result = rcmNoCache
+  if result == rcmDefault and headers.getFirst("Cache-Control") == "" and
+      headers.getFirst("Pragma").equalsIgnoreCase("no-cache"):
+    result = rcmNoCache
+
+proc cacheKey*(scheme, host, port, path, query: string): string =
+  scheme & "://" & host & ':' & port & path & query
+
+# FNV-1a; only used to name files, the key itself is checked on lookup.
+proc hashKey(key: string): string =
+  var h = 0xCBF29CE484222325u64
+  for c in key:
+    h = (h xor uint64(c)) * 0x100000001B3u64
+  result = newStringOfCap(16)
+  for i in countdown(15, 0):
+    result &= "0123456789abcdef"[int((h shr (i * 4)) and 0xF)]
+
+proc getVary(headers: openArray[HTTPHeader]; reqHeaders: string;
+    vary: var seq[HTTPHeader]): bool =
+  for it in headers:
+    if it.name.equalsIgnoreCase("Vary"):
+      for name in it.value.split(','):
+        let name = name.strip()
+        if name == "*":
+          return false
+        if name != "":
+          vary.add((name, reqHeaders.getFirst(name)))
+  true
+
+# Compute the time until which a response received at `now' may be used
+# without revalidation.
+proc getFreshUntil(status: uint16; headers: openArray[HTTPHeader];
+    now: int64): int64 =
+  let age = parseInt64(headers.getFirst("Age")).get(0)
+  for it in headers.directives("Cache-Control"):
+    if it.name == "no-cache":
+      return 0
+  for it in headers.directives("Cache-Control"):
+    if it.name == "max-age":
+      let maxAge = parseInt64(it.value).get(0)
+      return now + maxAge - age
+  let expires = headers.getFirst("Expires")
+  if expires != "":
+    let e = parseHTTPDate(expires).get(0)
+    if date := parseHTTPDate(headers.getFirst("Date")):
+      return now + e - date - age
+    return e
+  if status in HeuristicStatus:
+    # RFC 9111 suggests 10% of the time since the last modification.
+    if lastModified := parseHTTPDate(headers.getFirst("Last-Modified")):
+      let date = parseHTTPDate(headers.getFirst("Date")).get(now)
+      if date > lastModified:
+        return now + (date - lastModified) div 10 - age
+  0
+
+proc hasValidator(headers: openArray[HTTPHeader]): bool =
+  headers.getFirst("ETag") != "" or headers.getFirst("Last-Modified") != ""
+
+proc serialize(entry: CacheEntry): string =
+  result = entry.key & '\n' & $entry.status & ' ' & $entry.freshUntil & ' ' &
+    $entry.bodyLen & ' ' & $entry.vary.len & ' ' & entry.bodyId & '\n'
+  for it in entry.vary:
+    result &= it.name & ": " & it.value & '\n'
+  for it in entry.headers:
+    result &= it.name & ": " & it.value & '\n'
+
+proc parseEntry(entry: CacheEntry; s: string): Opt[void] =
+  var i = 0
+  var nvary = 0
+  var vary: seq[HTTPHeader] = @[]
+  for line in s.split('\n'):
+    case i
+    of 0:
+      if line != entry.key:
+        return err()
+    of 1:
+      var fields: seq[string] = @[]
+      for it in line.split(' '):
+        fields.add(it)
+      if fields.len != 5 or fields[4] == "" or '/' in fields[4]:
+        return err()
+      entry.status = ?parseUInt16(fields[0])
+      entry.freshUntil = ?parseInt64(fields[1])
+      entry.bodyLen = ?parseInt64(fields[2])
+      nvary = int(?parseInt32(fields[3]))
+      entry.bodyId = fields[4]
+    else:
+      let j = line.find(": ")
+      if j > 0:
+        let it = (line.substr(0, j - 1), line.substr(j + 2))
+        if vary.len < nvary:
+          vary.add(it)
+        else:
+          entry.headers.add(it)
+    inc i
+  if i < 2 or vary.len < nvary:
+    return err()
+  entry.vary = move(vary)
+  ok()
+
+proc bodyPath(entry: CacheEntry): string =
+  entry.path & '.' & entry.bodyId & ".b"
+
+# Find a stored response for `key' that matches the request headers.
+proc lookup*(cache: HTTPCache; key, reqHeaders: string): CacheEntry =
+  let entry = CacheEntry(path: cache.dir & '/' & key.hashKey(), key: key)
+  var s: string
+  if readFile(entry.path & ".h", s).isErr or entry.parseEntry(s).isErr:
+    return nil
+  for it in entry.vary:
+    if reqHeaders.getFirst(it.name) != it.value:
+      return nil
+  # Open the body right away, so that it stays readable even if another
+  # adapter replaces the entry in the meantime.
+  let body = newPosixStream(entry.bodyPath)
+  if body == nil:
+    return nil
+  var stats: Stat
+  if fstat(body.fd, stats) != 0 or int64(stats.st_size) != entry.bodyLen:
+    body.sclose()
+    return nil
+  entry.body = body
+  # mark as recently used
+  discard utimes(cstring(entry.path & ".h"), nil)
+  entry
+
+proc isFresh*(entry: CacheEntry): bool =
+  getTime().toUnix() < entry.freshUntil
+
+# Headers to add to the request so that the server may answer with 304
+# if our copy is still valid.
+proc conditionalHeaders*(entry: CacheEntry): string =
+  result = ""
+  let etag = entry.headers.getFirst("ETag")
+  if etag != "":
+    result &= "If-None-Match: " & etag & "\r\n"
+  let lastModified = entry.headers.getFirst("Last-Modified")
+  if lastModified != "":
+    result &= "If-Modified-Since: " & lastModified & "\r\n"
+
+proc openBody*(entry: CacheEntry): PosixStream =
+  result = entry.body
+  entry.body = nil
+
+proc sizePath(cache: HTTPCache): string =
+  cache.dir & "/.size"
+
+# Delete temporary files of adapters that died while writing them, and
+# the least recently used entries if we exceed maxSize.  Then reset the
+# size estimate to what is left.
+proc prune(cache: HTTPCache) =
+  let d = opendir(cstring(cache.dir))
+  if d == nil:
+    return
+  let now = getTime().toUnix()
+  var items: seq[PruneItem] = @[]
+  var total = 0i64
+  while (let x = readdir(d); x != nil):
+    let name = $cast[cstring](addr x.d_name)
+    let path = cache.dir & '/' & name
+    var stats: Stat
+    if name[0] == '.' or lstat(cstring(path), stats) != 0:
+      continue
+    if name.endsWith(".tmp"):
+      if now - int64(stats.st_mtime) > 3600:
+        discard unlink(cstring(path))
+      continue
+    let size = int64(stats.st_size)
+    total += size
+    # bodies count towards the entry of their header
+    let mtime = if name.endsWith(".h"): int64(stats.st_mtime) else: int64.high
+    items.add(PruneItem(
+      key: name.until('.'),
+      mtime: mtime,
+      size: size,
+      files: @[name]
+    ))
+  discard closedir(d)
+  if total > cache.maxSize:
+    items.sort(proc(a, b: PruneItem): int = cmp(a.key, b.key))
+    var merged: seq[PruneItem] = @[]
+    for it in items.mitems:
+      if merged.len > 0 and merged[^1].key == it.key:
+        merged[^1].mtime = min(merged[^1].mtime, it.mtime)
+        merged[^1].size += it.size
+        merged[^1].files.add(move(it.files))
+      else:
+        merged.add(move(it))
+    merged.sort(proc(a, b: PruneItem): int = cmp(a.mtime, b.mtime))
+    for it in merged:
+      if total <= cache.maxSize:
+        break
+      for name in it.files:
+        discard unlink(cstring(cache.dir & '/' & name))
+      total -= it.size
+  discard writeFile(cache.sizePath, $total, 0o600)
+
+# Add size to the estimated size of the cache, and prune it if that
+# exceeds maxSize.
+proc addSize(cache: HTTPCache; size: int64) =
+  var s: string
+  var total = size
+  if readFile(cache.sizePath, s).isOk:
+    total += parseInt64(s).get(0)
+  if total > cache.maxSize:
+    cache.prune()
+  else:
+    discard writeFile(cache.sizePath, $total, 0o600)
+
+proc storedHeaders(headers: openArray[HTTPHeader]): seq[HTTPHeader] =
+  result = @[]
+  for it in headers:
+    if not it.name.isIn(UnstoredHeaders):
+      result.add(it)
+
+# Start storing a response.  Returns nil if the response may not be
+# stored.
+proc store*(cache: HTTPCache; key, reqHeaders: string; status: uint16;
+    headers: openArray[HTTPHeader]): CacheWriter =
+  for it in headers.directives("Cache-Control"):
+    if it.name == "no-store":
+      return nil
+  let t = getTime()
+  let now = t.toUnix()
+  let freshUntil = getFreshUntil(status, headers, now)
+  if freshUntil <= now and (status != 200 or not headers.hasValidator()):
+    return nil
+  var vary: seq[HTTPHeader] = @[]
+  if not headers.getVary(reqHeaders, vary):
+    return nil
+  let path = cache.dir & '/' & key.hashKey()
+  let pid = $getCurrentProcessId()
+  let tmp = path & '.' & pid
+  let body = newPosixStream(tmp & ".b.tmp", O_CREAT or O_WRONLY or O_TRUNC,
+    0o600)
+  if body == nil:
+    return nil
+  let entry = CacheEntry(
+    path: path,
+    key: key,
+    status: status,
+    freshUntil: freshUntil,
+    bodyId: pid & '-' & $now & '-' & $t.nanosecond,
+    vary: move(vary),
+    headers: headers.storedHeaders()
+  )
+  CacheWriter(cache: cache, entry: entry, body: body, tmp: tmp)
+
+proc write*(writer: CacheWriter; data: openArray[char]) =
+  if writer.body != nil:
+    if writer.body.writeLoop(data).isErr:
+      writer.body.sclose()
+      writer.body = nil
+      discard unlink(cstring(writer.tmp & ".b.tmp"))
+    else:
+      writer.entry.bodyLen += data.len
+
+proc abort*(writer: CacheWriter) =
+  if writer.body != nil:
+    writer.body.sclose()
+    writer.body = nil
+    discard unlink(cstring(writer.tmp & ".b.tmp"))
+
+# Commit a completely received response.
+proc finish*(writer: CacheWriter) =
+  if writer.body == nil:
+    return
+  writer.body.sclose()
+  writer.body = nil
+  let entry = writer.entry
+  let header = entry.serialize()
+  if writeFile(writer.tmp & ".h.tmp", header, 0o600).isErr or
+      chafile.rename(writer.tmp & ".b.tmp", entry.bodyPath).isErr:
+    discard unlink(cstring(writer.tmp & ".b.tmp"))
+    discard unlink(cstring(writer.tmp & ".h.tmp"))
+    return
+  let old = CacheEntry(path: entry.path, key: entry.key)
+  var s: string
+  let hasOld = readFile(entry.path & ".h", s).isOk and
+    old.parseEntry(s).isOk
+  if chafile.rename(writer.tmp & ".h.tmp", entry.path & ".h").isErr:
+    discard unlink(cstring(entry.bodyPath))
+    discard unlink(cstring(writer.tmp & ".h.tmp"))
+    return
+  var size = entry.bodyLen + header.len
+  if hasOld:
+    discard unlink(cstring(old.bodyPath))
+    size -= old.bodyLen + s.len
+  writer.cache.addSize(size)
+
+# The server confirmed that our copy is still valid: update the stored
+# headers and freshness with those of the 304 response.
+proc update*(cache: HTTPCache; entry: CacheEntry;
+    headers: openArray[HTTPHeader]) =
+  var merged: seq[HTTPHeader] = @[]
+  for it in entry.headers:
+    if it.name.isIn(KeptHeaders) or headers.getFirst(it.name) == "":
+      merged.add(it)
+  for it in headers.storedHeaders():
+    if not it.name.isIn(KeptHeaders):
+      merged.add(it)
+  entry.headers = move(merged)
+  let now = getTime().toUnix()
+  entry.freshUntil = getFreshUntil(entry.status, entry.headers, now)
+  let tmp = entry.path & '.' & $getCurrentProcessId() & ".h.tmp"
+  if writeFile(tmp, entry.serialize(), 0o600).isErr or
+      chafile.rename(tmp, entry.path & ".h").isErr:
+    discard unlink(cstring(tmp))
+
+{.pop.} # raises: []
@@ -4,6 +4,8 @@ import std/posix
 
 import io/chafile
 import io/dynstream
+import io/packetreader
+import io/packetwriter
 import server/connectionerror
 import types/opt
 import utils/myposix
@@ -323,4 +325,99 @@ proc cgiAuthorization*(): tuple[user, pass: string] =
       return (val.until(':'), val.after(':'))
   return ("", "")
 
+# Resident mode.
+#
+# If the loader starts an adapter with CHA_RESIDENT_FD set, the adapter
+# does not handle a request itself; instead, it reads requests from
+# that socket (in the same format as the fork server does), and forks
+# a child that runs main for each.  This way, we only pay for exec and
+# dynamic linking once per adapter, not once per request.
+var cmdCount {.importc.}: cint
+var cmdLine {.importc.}: cstringArray
+
+type CGIMain = proc() {.nimcall, raises: [].}
+
+proc forkResident(control: PosixStream; r: var PacketReader; main: CGIMain):
+    int =
+  var hasIstream: bool
+  r.sread(hasIstream)
+  let istream = if hasIstream: newPosixStream(r.recvFd()) else: nil
+  let ostream = newPosixStream(r.recvFd())
+  var hasOstreamOut2: bool
+  r.sread(hasOstreamOut2)
+  let ostreamOut2 = if hasOstreamOut2: newPosixStream(r.recvFd()) else: nil
+  var fdEnv: seq[string]
+  r.sread(fdEnv)
+  var fds: seq[PosixStream] = @[]
+  for it in fdEnv:
+    fds.add(newPosixStream(r.recvFd()))
+  var env: seq[tuple[name, value: string]]
+  var argv: seq[string]
+  var cmd: string
+  r.sread(env)
+  r.sread(argv)
+  r.sread(cmd)
+  let pid = fork()
+  if pid == 0: # child
+    control.sclose()
+    if istream != nil:
+      istream.moveFd(STDIN_FILENO)
+    else:
+      closeStdin()
+    ostream.moveFd(STDOUT_FILENO)
+    discard myposix.signal(SIGCHLD, myposix.SIG_DFL)
+    discard myposix.signal(SIGPIPE, myposix.SIG_DFL)
+    env.add(("SCRIPT_FILENAME", cmd))
+    for i, it in fdEnv:
+      env.add((it, $fds[i].fd))
+    for it in env:
+      if twtstr.setEnv(it.name, it.value).isErr:
+        cgiDie(ceInternalError, "failed to set env vars")
+    let i = cmd.rfind('/')
+    if chdir(cstring(cmd.substr(0, i - 1))) != 0:
+      cgiDie(ceInternalError, "failed to set working directory")
+    # paramStr and paramCount read these, so main sees the arguments of
+    # this request as if we had been executed with them.
+    let name = cmd.substr(i + 1)
+    var cargv = newSeq[cstring](argv.len + 2)
+    cargv[0] = cstring(name)
+    for i in 0 ..< argv.len:
+      cargv[i + 1] = cstring(argv[i])
+    cmdLine = cast[cstringArray](addr cargv[0])
+    cmdCount = cint(argv.len + 1)
+    main()
+    quit(0)
+  # parent or error
+  if istream != nil:
+    istream.sclose()
+  ostream.sclose()
+  if ostreamOut2 != nil:
+    ostreamOut2.sclose()
+  for it in fds:
+    it.sclose()
+  return pid
+
+# Run main, either directly or in resident mode.
+proc cgiMain*(main: CGIMain) =
+  let fd = parseInt32(getEnvEmpty("CHA_RESIDENT_FD")).get(-1)
+  if fd < 0:
+    main()
+    return
+  unsetEnv("CHA_RESIDENT_FD")
+  let control = newPosixStream(fd)
+  # children are reaped automatically
+  discard myposix.signal(SIGCHLD, myposix.SIG_IGN)
+  discard myposix.signal(SIGPIPE, myposix.SIG_IGN)
+  block mainLoop:
+    while true:
+      control.withPacketReader r:
+        let pid = control.forkResident(r, main)
+        control.withPacketWriter w:
+          w.swrite(pid)
+        do:
+          break mainLoop
+      do: # the loader has let us go
+        break mainLoop
+  quit(0)
+
 {.pop.} # raises: []
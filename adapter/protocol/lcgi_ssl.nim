@@ -2,6 +2,8 @@
 
 import std/posix
 
+import io/packetreader
+import io/packetwriter
 import lcgi
 
 export lcgi, dynstream, twtstr, sandbox
@@ -19,6 +21,12 @@ type
   BIO* {.importc, header: "<openssl/bio.h>", incompleteStruct.} = object
   SSL* {.importc, header: "<openssl/ssl.h>", incompleteStruct.} = object
   X509* {.importc, header: "<openssl/x509.h>", incompleteStruct.} = object
+  SSL_SESSION* {.importc, header: "<openssl/ssl.h>", incompleteStruct.} =
+    object
+
+type
+  ucharPConstPImpl {.importc: "const unsigned char**".} = cstring
+  ucharPConstP = distinct ucharPConstPImpl
 
 const
   SSL_VERIFY_NONE* = cint(0x00)
@@ -81,6 +89,13 @@ type SSL_verify_cb* = proc(preverify_ok: cint; x509_ctx: X509_STORE_CTX): cint
 
 const X509_V_OK* = clong(0)
 
+const
+  SSL_SESS_CACHE_CLIENT = clong(0x0001)
+  SSL_SESS_CACHE_NO_INTERNAL_STORE = clong(0x0200)
+
+type SSL_new_session_cb = proc(ssl: ptr SSL; sess: ptr SSL_SESSION): cint
+  {.cdecl.}
+
 proc SSL_CTX_new(m: ptr SSL_METHOD): ptr SSL_CTX
 proc SSL_CTX_free(ctx: ptr SSL_CTX)
 proc SSL_get_SSL_CTX(ssl: ptr SSL): ptr SSL_CTX
@@ -102,6 +117,15 @@ proc SSL_write*(ssl: ptr SSL; buf: pointer; num: cint): cint
 proc SSL_set_fd(ssl: ptr SSL; fd: cint): cint
 proc SSL_shutdown(ssl: ptr SSL): cint
 proc SSL_free(ssl: ptr SSL)
+proc SSL_CTX_set_session_cache_mode(ctx: ptr SSL_CTX; mode: clong): clong
+proc SSL_CTX_sess_set_new_cb(ctx: ptr SSL_CTX;
+  new_session_cb: SSL_new_session_cb)
+proc SSL_set_session(ssl: ptr SSL; session: ptr SSL_SESSION): cint
+proc SSL_session_reused(ssl: ptr SSL): cint
+proc SSL_SESSION_free(session: ptr SSL_SESSION)
+proc d2i_SSL_SESSION(a: ptr ptr SSL_SESSION; pp: ucharPConstP; length: clong):
+  ptr SSL_SESSION
+proc i2d_SSL_SESSION(session: ptr SSL_SESSION; pp: ptr ptr uint8): cint
 
 {.pop.} # <openssl/ssl.h>
 
@@ -109,6 +133,57 @@ proc SSL_free(ssl: ptr SSL)
 
 {.pop.} # importc
 
+# TLS session resumption.
+# The loader passes us a socket in CHA_TLS_SESSION_FD, on which it sends
+# the last session it has seen for our host (or an empty string).  We
+# report whether we could resume it, and send back any new sessions the
+# server gives us for the next adapter to use.
+var tlsSessionStream: PosixStream = nil
+
+proc newSessionCallback(ssl: ptr SSL; sess: ptr SSL_SESSION): cint {.cdecl.} =
+  let n = i2d_SSL_SESSION(sess, nil)
+  if n > 0:
+    var s = newString(n)
+    var p = cast[ptr uint8](addr s[0])
+    if i2d_SSL_SESSION(sess, addr p) == n:
+      tlsSessionStream.withPacketWriter w:
+        w.swrite(true)
+        w.swrite(s)
+      do:
+        discard
+  0 # we did not keep a reference to sess
+
+proc setupSessionResumption(ctx: ptr SSL_CTX; ssl: ptr SSL) =
+  let fd = parseInt32(getEnvEmpty("CHA_TLS_SESSION_FD")).get(-1)
+  if fd < 0:
+    return
+  let ps = newPosixStream(fd)
+  var session = ""
+  ps.withPacketReader r:
+    r.sread(session)
+  do:
+    ps.sclose()
+    return
+  tlsSessionStream = ps
+  discard SSL_CTX_set_session_cache_mode(ctx,
+    SSL_SESS_CACHE_CLIENT or SSL_SESS_CACHE_NO_INTERNAL_STORE)
+  SSL_CTX_sess_set_new_cb(ctx, newSessionCallback)
+  if session.len > 0:
+    var p = cast[ptr uint8](addr session[0])
+    let sess = d2i_SSL_SESSION(nil, cast[ucharPConstP](addr p),
+      clong(session.len))
+    if sess != nil:
+      discard SSL_set_session(ssl, sess)
+      SSL_SESSION_free(sess)
+
+proc reportSessionResumption(ssl: ptr SSL) =
+  if tlsSessionStream != nil:
+    tlsSessionStream.withPacketWriter w:
+      w.swrite(false)
+      w.swrite(SSL_session_reused(ssl) == 1)
+    do:
+      discard
+
 # WARNING: you must call SSL_get_verify_result on the returned SSL
 # yourself.
 proc connectSSLSocket*(host, port: string; useDefaultCA: bool):
@@ -131,12 +206,14 @@ proc connectSSLSocket*(host, port: string; useDefaultCA: bool):
     return errCGIError(ceInternalError, "failed to set host")
   if SSL_set_tlsext_host_name(ssl, cstring(host)) == 0:
     return errCGIError(ceInternalError, "failed to set tlsext host name")
+  setupSessionResumption(ctx, ssl)
   if SSL_connect(ssl) <= 0:
     let e = ERR_get_error()
     return errCGIError(ceConnectionRefused, ERR_reason_error_string(e))
   if SSL_do_handshake(ssl) <= 0:
     let e = ERR_get_error()
     return errCGIError(ceConnectionRefused, ERR_reason_error_string(e))
+  reportSessionResumption(ssl)
   ok(ssl)
 
 proc closeSSLSocket*(ssl: ptr SSL) =
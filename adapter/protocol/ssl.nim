@@ -24,6 +24,6 @@ proc main() =
   else:
     http.main(scheme)
 
-main()
+cgiMain(main)
 
 {.pop.} # raises: []
@@ -193,8 +193,10 @@ type
     coOsc52Copy = "osc52Copy"
     coOsc52Primary = "osc52Primary"
     coRefererFrom = "refererFrom"
+    coResidentAdapters = "residentAdapters"
     coScripting = "scripting"
     coSetTitle = "setTitle"
+    coSharedMemoryTransport = "sharedMemoryTransport"
     coShowCursorPosition = "showCursorPosition"
     coShowDownloadPanel = "showDownloadPanel"
     coShowHoverLink = "showHoverLink"
@@ -207,13 +209,18 @@ type
     # 4 bytes
     coColumns = "columns"
     coFormatModeDisplay = "display.formatMode"
+    coDownloadSegments = "downloadSegments"
     coHistorySize = "historySize"
+    coHttpCacheSize = "httpCacheSize"
+    coKeepAliveTimeout = "keepAliveTimeout"
     coLines = "lines"
+    coMaxKeepAlivePerHost = "maxKeepAlivePerHost"
     coMaxNetConnections = "maxNetConnections"
     coMaxRedirect = "maxRedirect"
     coMinimumContrast = "minimumContrast"
     coPixelsPerColumn = "pixelsPerColumn"
     coPixelsPerLine = "pixelsPerLine"
+    coPreforkBuffers = "preforkBuffers"
     coSideWheelScroll = "sideWheelScroll"
     coSixelColors = "sixelColors"
     coWheelScroll = "wheelScroll"
@@ -347,8 +354,10 @@ const OptionMap = [
   coOsc52Copy: (cotBoolAuto, csInput),
   coOsc52Primary: (cotBoolAuto, csInput),
   coRefererFrom: (cotBool, csBuffer),
+  coResidentAdapters: (cotBool, csNetwork),
   coScripting: (cotScriptingMode, csBuffer),
   coSetTitle: (cotBoolAuto, csDisplay),
+  coSharedMemoryTransport: (cotBool, csStart),
   coShowCursorPosition: (cotBool, csStatus),
   coShowDownloadPanel: (cotBool, csExternal),
   coShowHoverLink: (cotBool, csStatus),
@@ -360,13 +369,18 @@ const OptionMap = [
 
   coColumns: (cotInt32, csDisplay),
   coFormatModeDisplay: (cotFormatModeAuto, csDisplay),
+  coDownloadSegments: (cotInt32, csNetwork),
   coHistorySize: (cotInt32, csExternal),
+  coHttpCacheSize: (cotInt32, csNetwork),
+  coKeepAliveTimeout: (cotInt32, csNetwork),
   coLines: (cotInt32, csDisplay),
+  coMaxKeepAlivePerHost: (cotInt32, csNetwork),
   coMaxNetConnections: (cotInt32, csNetwork),
   coMaxRedirect: (cotInt32, csNetwork),
   coMinimumContrast: (cotInt32, csDisplay),
   coPixelsPerColumn: (cotInt32, csDisplay),
   coPixelsPerLine: (cotInt32, csDisplay),
+  coPreforkBuffers: (cotInt32, csStart),
   coSideWheelScroll: (cotInt32, csInput),
   coSixelColors: (cotInt32Auto, csDisplay),
   coWheelScroll: (cotInt32, csInput),
@@ -2290,13 +2304,18 @@ const ConfigInitInt32 = {
   coHistorySize: 100'i32,
   coMaxRedirect: 10'i32,
   coMaxNetConnections: 12'i32,
+  coMaxKeepAlivePerHost: 4'i32,
+  coKeepAliveTimeout: 30'i32,
+  coHttpCacheSize: 64'i32,
+  coDownloadSegments: 1'i32,
   coWheelScroll: 5'i32,
   coSideWheelScroll: 5'i32,
   coMinimumContrast: 100'i32,
   coColumns: 80'i32,
   coLines: 24'i32,
   coPixelsPerColumn: 9'i32,
-  coPixelsPerLine: 18'i32
+  coPixelsPerLine: 18'i32,
+  coPreforkBuffers: 1'i32
 }
 
 const ConfigInitStr = {
@@ -2434,6 +2453,13 @@ proc addConfigSections(ctx: JSContext; config: Config): Opt[void] =
   JS_FreeValue(ctx, configObj)
   ok()
 
+# Must match the codings the HTTP adapter can decode.
+const enableZstd {.booldefine.} = false
+const DefaultAcceptEncoding = when enableZstd:
+  "gzip, deflate, br, zstd"
+else:
+  "gzip, deflate, br"
+
 proc newConfig*(ctx: JSContext; dir, dataDir: string): Config =
   let page = newActionMap(ctx, PageCommands, "")
   let line = newActionMap(ctx, LineCommands, "writeInputBuffer")
@@ -2452,10 +2478,8 @@ proc newConfig*(ctx: JSContext; dir, dataDir: string): Config =
     defaultHeaders: newHeaders(hgRequest, {
       "User-Agent": "chawan",
       "Accept": "text/html, text/*;q=0.5, */*;q=0.4",
-      "Accept-Encoding": "gzip, deflate, br",
-      "Accept-Language": "en;q=1.0",
-      "Pragma": "no-cache",
-      "Cache-Control": "no-cache"
+      "Accept-Encoding": DefaultAcceptEncoding,
+      "Accept-Language": "en;q=1.0"
     }),
   )
   for it in ConfigInitTrue:
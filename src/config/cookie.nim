@@ -11,6 +11,7 @@ import io/packetwriter
 import monoucha/jsref
 import types/opt
 import types/url
+import utils/httpdate
 import utils/tabutil
 import utils/twtstr
 
@@ -79,70 +80,6 @@ proc getOrDefault*(map: CookieJarMap; name: string): CookieJar =
 proc getMapKey(cookie: Cookie): string =
   return cookie.domain & cookie.path & '\t' & cookie.name
 
-proc parseCookieDate(val: string): Opt[int64] =
-  # cookie-date
-  const Delimiters = {'\t', ' '..'/', ';'..'@', '['..'`', '{'..'~'}
-  var foundTime = false
-  # date-token-list
-  var time = array[3, int].default
-  var dayOfMonth = 0
-  var month = 0
-  var year = -1
-  for dateToken in val.split(Delimiters):
-    if dateToken == "": continue # *delimiter
-    if not foundTime: # test for time
-      let hmsTime = dateToken.until(NonDigit - {':'})
-      var i = 0
-      for timeField in hmsTime.split(':'):
-        if i > 2:
-          i = 0
-          break # too many time fields
-        # 1*2DIGIT
-        if timeField.len != 1 and timeField.len != 2:
-          i = 0
-          break
-        time[i] = parseInt32(timeField).get
-        inc i
-      if i == 3:
-        foundTime = true
-        continue
-    if dayOfMonth == 0: # test for day-of-month
-      let digits = dateToken.until(NonDigit)
-      if digits.len in 1..2:
-        dayOfMonth = parseInt32(digits).get
-        continue
-    if month == 0: # test for month
-      if dateToken.len >= 3:
-        case dateToken.toOpenArray(0, 2).toLowerAscii()
-        of "jan": month = 1
-        of "feb": month = 2
-        of "mar": month = 3
-        of "apr": month = 4
-        of "may": month = 5
-        of "jun": month = 6
-        of "jul": month = 7
-        of "aug": month = 8
-        of "sep": month = 9
-        of "oct": month = 10
-        of "nov": month = 11
-        of "dec": month = 12
-        else: discard
-        if month != 0:
-          continue
-    if year == -1: # test for year
-      let digits = dateToken.until(NonDigit)
-      if digits.len == 4:
-        year = parseInt32(digits).get
-        continue
-  if month == 0 or dayOfMonth notin 1..getDaysInMonth(Month(month), year) or
-      year < 1601 or not foundTime or
-      time[0] > 23 or time[1] > 59 or time[2] > 59:
-    return err()
-  let dt = dateTime(year, Month(month), MonthdayRange(dayOfMonth),
-    HourRange(time[0]), MinuteRange(time[1]), SecondRange(time[2]),
-    zone = utc())
-  ok(dt.toTime().toUnix())
-
 # For debugging
 proc `$`*(cookieJar: CookieJar): string =
   result = ""
@@ -256,7 +193,7 @@ proc parseSetCookie(str: string; t: int64; url: URL; persist, http: bool):
     case key
     of "expires":
       if cookie.expires == -1:
-        if date := parseCookieDate(val):
+        if date := parseHTTPDate(val):
           cookie.expires = date
     of "max-age":
       let x = parseInt32(val).get(-1)
@@ -0,0 +1,69 @@
+# Counting Bloom filter of the tag names, IDs and classes of an element's
+# ancestors.
+#
+# Each complex selector stores the hashes of some names that must be
+# present on an ancestor for it to match (see ancestorHashes in
+# cssparser).  If the filter lacks any of them, the selector cannot match,
+# and we can skip walking up the tree in match.
+#
+# Names are hashed in ASCII lower case, so that the same filter works for
+# quirks mode, where classes and IDs are case-insensitive.
+
+{.push raises: [].}
+
+import utils/twtstr
+
+type
+  AncestorHashType* = enum
+    ahtTag, ahtId, ahtClass
+
+  AncestorFilter* = object
+    counters: array[4096, uint8]
+
+const FilterMask = 0xFFF
+
+proc ancestorHash*(t: AncestorHashType; s: openArray[char]): uint32 =
+  ## Hash `s` for the filter.  The result is never 0, so that it can be
+  ## used to mark unused hashes.
+  var h = 2166136261u32 xor uint32(t) # FNV-1a
+  for c in s:
+    h = (h xor uint32(c.toLowerAscii())) * 16777619u32
+  if h == 0:
+    return 1
+  return h
+
+template slots(h: uint32): array[2, int] =
+  [int(h and FilterMask), int((h shr 12) and FilterMask)]
+
+proc insert*(filter: var AncestorFilter; h: uint32) =
+  for i in slots(h):
+    if filter.counters[i] < uint8.high:
+      inc filter.counters[i]
+
+proc remove*(filter: var AncestorFilter; h: uint32) =
+  for i in slots(h):
+    # A saturated counter stays that way, because we no longer know how
+    # many hashes it has.
+    if filter.counters[i] < uint8.high:
+      assert filter.counters[i] > 0
+      dec filter.counters[i]
+
+proc clear*(filter: var AncestorFilter) =
+  zeroMem(addr filter.counters[0], sizeof(filter.counters))
+
+proc mayContain*(filter: AncestorFilter; h: uint32): bool =
+  for i in slots(h):
+    if filter.counters[i] == 0:
+      return false
+  true
+
+proc mayMatch*(filter: AncestorFilter; hashes: openArray[uint32]): bool =
+  ## Return false if an ancestor hash in `hashes` is not in the filter.
+  for h in hashes:
+    if h == 0:
+      break
+    if not filter.mayContain(h):
+      return false
+  true
+
+{.pop.} # raises: []
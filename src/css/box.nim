@@ -114,6 +114,18 @@ type
     offset*: Offset
     clipBox*: ClipBox
 
+  # Render input and output of the box in the previous render.  If the
+  # input has not changed, then the box (and its descendants) painted
+  # the same lines the same way, so those need not be repainted.
+  BoxPaintState* = object
+    offset*: Offset
+    clipBox*: ClipBox
+    size*: Size # BlockBox only
+    # Lines painted by the box and its descendants, including positioned
+    # ones.
+    starty*: int
+    endy*: int
+
   # min-content: box width is longest word's width
   # max-content: box width is content width without wrapping
   # stretch: box width is n px wide
@@ -165,8 +177,11 @@ type
     pseudo*: PseudoElement
     t*: CSSBoxType
     keepLayout*: bool
+    keepRender*: bool # set if paint is valid; reset on re-layout
+    deferred*: bool # skipped by a partial layout; see layout.nim
     positioned*: bool # set if we participate in positioned layout
     render*: BoxRenderState # render output
+    paint*: BoxPaintState # previous render state
     computed*: CSSValues
     elementPtr*: ptr ElementObj
 
@@ -317,8 +332,19 @@ iterator children*(box: CSSBox): CSSBox =
     yield it
     it = it.next
 
+# Returns true if box has not been laid out, because it (or one of its
+# ancestors) was below the limit of a partial layout.
+proc isDeferred*(box: CSSBox): bool =
+  var it = box
+  while it != nil:
+    if it.deferred:
+      return true
+    it = it.parent
+  false
+
 proc resetState(box: CSSBox) =
   box.render = BoxRenderState()
+  box.keepRender = false
 
 proc resetState*(ibox: InlineBox) =
   CSSBox(ibox).resetState()
@@ -2,10 +2,10 @@
 
 import std/algorithm
 import std/math
-import std/sets
 
 import chame/tags
 import config/conftypes
+import css/ancestorfilter
 import css/cssparser
 import css/cssvalues
 import css/match
@@ -37,14 +37,19 @@ type
     specificity: uint
     rule: CSSRuleDef
 
-  AncestorCache = object
-    last: Element
-    quirks: bool
-    classes: HashSet[CAtom]
+  # The elements whose names are in filter, from the root down.  While
+  # csstree builds the box tree, these are the ancestors of the elements
+  # it styles.
+  AncestorStack = object
+    filter: AncestorFilter
+    elements: seq[ptr ElementObj]
+    starts: seq[int] # index of each element's first hash
+    hashes: seq[uint32]
 
   ToSorts = object
     map: array[PseudoElement, seq[RulePair]]
-    cache: AncestorCache
+    filter: ptr AncestorFilter
+    siblingDependent: bool
 
   RevertType = enum
     rtUnset, rtUser, rtUserAgent, rtSet
@@ -63,40 +68,97 @@ type
 proc applyValues(ctx: var ApplyValueContext;
   entries: openArray[CSSComputedEntry]; revertType: RevertType)
 
-proc hasClass(ancestors: var AncestorCache; class: CAtom): bool =
-  if class in ancestors.classes:
-    return true
-  var found = false
-  if ancestors.last != nil:
-    var ancestor = ancestors.last
-    let quirks = ancestors.quirks
-    while true:
-      if quirks:
-        for it in ancestor.classList:
-          found = found or it.equalsIgnoreCase(class)
-          ancestors.classes.incl(it.toLowerAscii())
-      else:
-        for it in ancestor.classList:
-          found = found or it == class
-          ancestors.classes.incl(it)
-      ancestor = ancestor.asNode.parentElement
-      if ancestor == nil or found:
-        break
-    ancestors.last = ancestor
-  found
+var ancestorStack {.global.}: AncestorStack
+# Used for elements styled outside the tree walk.
+var scratchFilter {.global.}: AncestorFilter
+# Elements styled in the tree walk whose style a sibling with the same
+# tag and attributes may reuse, most recently used first.
+var styleSharingCache {.global.}: array[16, ptr ElementObj]
+
+proc addHashes(hashes: var seq[uint32]; element: Element) =
+  hashes.add(ancestorHash(ahtTag, $element.localName))
+  if element.id != satUempty:
+    hashes.add(ancestorHash(ahtId, $element.id))
+  for it in element.classList:
+    hashes.add(ancestorHash(ahtClass, $it))
+
+proc add(stack: var AncestorStack; element: Element) =
+  let start = stack.hashes.len
+  stack.elements.add(cast[ptr ElementObj](element))
+  stack.starts.add(start)
+  stack.hashes.addHashes(element)
+  for i in start ..< stack.hashes.len:
+    stack.filter.insert(stack.hashes[i])
+
+proc clearAncestors*() =
+  ## Empty the ancestor stack.  This must be called after a tree walk, so
+  ## that we do not keep pointers to elements that may be freed.
+  ancestorStack.filter.clear()
+  ancestorStack.elements.setLen(0)
+  ancestorStack.starts.setLen(0)
+  ancestorStack.hashes.setLen(0)
+  zeroMem(addr styleSharingCache, sizeof(styleSharingCache))
+
+proc pushAncestor*(element: Element) =
+  ## Add `element` to the ancestor filter before styling its children.
+  ## If its parent is not the last element pushed, then the stack is
+  ## rebuilt from its ancestors.
+  let parent = element.asNode.parentElement
+  let top = if ancestorStack.elements.len > 0:
+    ancestorStack.elements[^1]
+  else:
+    nil
+  if cast[ptr ElementObj](parent) != top:
+    clearAncestors()
+    var chain: seq[Element] = @[]
+    if parent != nil:
+      for it in parent.branchElems:
+        chain.add(it)
+    for i in countdown(chain.high, 0):
+      ancestorStack.add(chain[i])
+  ancestorStack.add(element)
+
+proc popAncestor*(element: Element) =
+  ## Remove `element` from the ancestor filter, if it is the last element
+  ## pushed.
+  template stack: untyped = ancestorStack
+  if stack.elements.len > 0 and
+      stack.elements[^1] == cast[ptr ElementObj](element):
+    let start = stack.starts.pop()
+    for i in start ..< stack.hashes.len:
+      stack.filter.remove(stack.hashes[i])
+    stack.hashes.setLen(start)
+    stack.elements.setLen(stack.elements.len - 1)
+
+proc isTopAncestor(element: Element): bool =
+  template stack: untyped = ancestorStack
+  return stack.elements.len > 0 and
+    stack.elements[^1] == cast[ptr ElementObj](element)
+
+# Get a filter with the ancestors of an element whose parent is
+# parentElement.
+proc getAncestorFilter(parentElement: Element): ptr AncestorFilter =
+  if parentElement.isTopAncestor():
+    return addr ancestorStack.filter
+  scratchFilter.clear()
+  var hashes: seq[uint32] = @[]
+  for it in parentElement.branchElems:
+    hashes.addHashes(it)
+  for h in hashes:
+    scratchFilter.insert(h)
+  return addr scratchFilter
 
 proc calcRule(tosorts: var ToSorts; element: Element;
     depends: var DependencyInfo; rule: CSSRuleDef) =
   var seen: set[PseudoElement] = {}
-  for sel in rule.sels:
+  for sel in rule.body.sels:
     if sel.pseudo in seen:
       continue
-    # skip an arbitrary class from the selector ancestors as an
-    # optimization
-    let ancestorClass = sel.ancestorClass
-    if ancestorClass != CAtomNull and
-        not tosorts.cache.hasClass(ancestorClass):
+    # skip selectors whose ancestors cannot be there
+    if not tosorts.filter[].mayMatch(sel.ancestorHashes):
       continue
+    tosorts.siblingDependent = tosorts.siblingDependent or
+      sel.siblingDependent
     if element.matches(sel, depends):
       tosorts.map[sel.pseudo].add((sel.specificity, rule))
       seen.incl(sel.pseudo)
@@ -111,13 +173,13 @@ proc calcRules(tosorts: var ToSorts; element: Element;
   for rule in rules:
     tosorts.calcRule(element, depends, rule)
 
+# Returns true if the result may differ for a sibling with the same tag
+# and attributes, or if it depends on the state of some element.
 proc calcRules(map: var RuleListMap; element: Element; sheet: CSSRuleMap;
-    depends: var DependencyInfo) =
+    depends: var DependencyInfo): bool =
   let parentElement = element.asNode.parentElement
   let quirks = sheet.quirks
-  var tosorts = ToSorts(
-    cache: AncestorCache(last: parentElement, quirks: quirks)
-  )
+  var tosorts = ToSorts(filter: getAncestorFilter(parentElement))
   tosorts.calcRules(element, depends, sheet.tagTable, element.localName)
   if element.id != satUempty:
     let id = if quirks: element.id.toLowerAscii() else: element.id
@@ -146,7 +208,8 @@ proc calcRules(map: var RuleListMap; element: Element; sheet: CSSRuleMap;
       let rule = item.rule
       let origin = rule.origin
       let layerId = rule.layerId
-      if rule.vals[cifNormal].len > 0 or rule.vals[cifImportant].len > 0:
+      if rule.body.vals[cifNormal].len > 0 or
+          rule.body.vals[cifImportant].len > 0:
         map[pseudo].hasValues = true
       if layerId == 0:
         map[pseudo].a[origin].unlayered.add(rule)
@@ -155,6 +218,10 @@ proc calcRules(map: var RuleListMap; element: Element; sheet: CSSRuleMap;
         if n > map[pseudo].a[origin].layers.len:
           map[pseudo].a[origin].layers.setLen(n)
         map[pseudo].a[origin].layers[n - 1].add(rule)
+  for it in depends:
+    if it.len > 0:
+      return true
+  tosorts.siblingDependent
 
 proc addItems(ctx: var ApplyValueContext; toks: var seq[CSSToken];
     vars: CSSVariableMap; items: openArray[CSSVarItem]): Opt[void] =
@@ -254,7 +321,7 @@ proc applyValues(ctx: var ApplyValueContext;
 proc applyValues(ctx: var ApplyValueContext; defs: openArray[CSSRuleDef];
     flag: CSSImportantFlag; revertType: RevertType) =
   for def in defs.ritems:
-    ctx.applyValues(def.vals[flag], revertType)
+    ctx.applyValues(def.body.vals[flag], revertType)
 
 proc applyNormalValues(ctx: var ApplyValueContext;
     list: LayeredRuleList; revertType: RevertType) =
@@ -407,7 +474,7 @@ proc applyVars(ctx: var ApplyValueContext; defs: openArray[CSSRuleDef];
     flag: CSSImportantFlag; parentVars: CSSVariableMap) =
   var vars = move(ctx.vals.vars)
   for def in defs.ritems:
-    for cvar in def.vars[flag].ritems:
+    for cvar in def.body.vars[flag].ritems:
       if vars == nil:
         vars = newCSSVariableMap(parentVars)
       vars.putIfAbsent(cvar)
@@ -480,21 +547,69 @@ proc applyDeclarations(map: RuleListMap; pseudo: PseudoElement;
     parent, element: Element; window: Window; old: CSSValues): CSSValues =
   map[pseudo].applyDeclarations(pseudo, parent, element, window, old)
 
+# Style sharing: while csstree builds the box tree, an element may reuse
+# the style of a sibling with the same tag and attributes, if no selector
+# that could tell them apart was tried on the sibling.
+proc canShareStyle(element: Element): bool =
+  # IDs are unique, and form controls have state that is not in their
+  # attributes.
+  return element.id == satUempty and element.cachedStyle == nil and
+    element.tagType notin {ttInput, ttOption, ttProgress, ttSelect,
+      ttTextarea} and
+    element.getBitmap() == nil
+
+proc findSharedStyle(element: Element): CSSValues =
+  let parent = element.asNode.parentNode
+  for i in 0 ..< styleSharingCache.len:
+    let it = styleSharingCache[i]
+    if it == nil:
+      break
+    let other = cast[Element](it)
+    if other != element and other.asNode.parentNode == parent and
+        other.localName == element.localName and
+        other.namespaceURI == element.namespaceURI and
+        other.hint == element.hint and other.attrs == element.attrs:
+      for j in countdown(i, 1):
+        styleSharingCache[j] = styleSharingCache[j - 1]
+      styleSharingCache[0] = it
+      return other.computed
+  nil
+
+proc addSharedStyle(element: Element) =
+  for j in countdown(styleSharingCache.high, 1):
+    styleSharingCache[j] = styleSharingCache[j - 1]
+  styleSharingCache[0] = cast[ptr ElementObj](element)
+
 proc applyStyle(element: Element) =
   let document = element.asNode.document
   let window = document.window
+  let share = element.asNode.parentElement.isTopAncestor() and
+    element.canShareStyle()
+  if share:
+    let computed = element.findSharedStyle()
+    if computed != nil:
+      document.applyStyleDependencies(element, DependencyInfo.default)
+      let old = element.computed
+      if old != nil and old != computed:
+        for t in LayoutProperties:
+          if not computed.equals(old, t):
+            element.relayout.incl(peNone)
+            break
+      element.computed = computed
+      return
   var depends = DependencyInfo.default
   var map = RuleListMap.default
-  map.calcRules(element, document.getRuleMap(), depends)
+  let siblingDependent = map.calcRules(element, document.getRuleMap(),
+    depends)
   let style = element.cachedStyle
   if window.settings.styling and style != nil:
     #TODO store this in CSSStyleDeclaration
-    let def = CSSRuleDef(origin: coAuthor)
+    let def = CSSRuleDef(body: CSSRuleBody(), origin: coAuthor)
     for decl in style.decls:
       let f = decl.f
       case decl.t
       of cdtVariable:
-        def.vars[f].add(CSSVariable(
+        def.body.vars[f].add(CSSVariable(
           name: decl.v,
           items: parseDeclWithVar1(decl.value)
         ))
@@ -502,9 +617,9 @@ proc applyStyle(element: Element) =
       of cdtProperty:
         if decl.hasVar:
           if entry := parseDeclWithVar(decl.p, decl.value):
-            def.vals[f].add(entry)
+            def.body.vals[f].add(entry)
         else:
-          def.vals[f].parseComputedValues(decl.p, decl.value,
+          def.body.vals[f].parseComputedValues(decl.p, decl.value,
             window.settings.attrsp[])
     map[peNone].a[coAuthor].unlayered.add(def)
   document.applyStyleDependencies(element, depends)
@@ -522,6 +637,8 @@ proc applyStyle(element: Element) =
       computed.next = pcomputed
       computed = pcomputed
   element.computed = element.computed.atomize()
+  if share and not siblingDependent:
+    element.addSharedStyle()
 
 # Forward declaration hack
 applyStyleImpl = applyStyle
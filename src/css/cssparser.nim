@@ -2,6 +2,7 @@
 
 import std/algorithm
 
+import css/ancestorfilter
 import html/catom
 import monoucha/jstypes
 import types/opt
@@ -440,8 +441,12 @@ type
   ComplexSelector* = object
     specificity*: uint
     pseudo*: PseudoElement
-    # simple optimization: an ancestor must have this as the first class
-    ancestorClass*: CAtom
+    # Hashes of names that ancestors must have for this to match, for
+    # AncestorFilter.  Unused entries are 0.
+    ancestorHashes*: array[4, uint32]
+    # True if this may match an element, but not its sibling with the same
+    # tag and attributes.  Used for style sharing in cascade.
+    siblingDependent*: bool
     csels: seq[CompoundSelector]
 
   SelectorList* = seq[ComplexSelector]
@@ -468,8 +473,7 @@ proc parseSelectorsConsume(toks: var seq[CSSToken]): SelectorList
 proc parseSelectorList(state: var SelectorParser; forgiving: bool): SelectorList
 proc parseComplexSelector(state: var SelectorParser): ComplexSelector
 proc parseCompoundSelector(state: var SelectorParser;
-  pseudoElement: var PseudoElement; specificityOut: var uint;
-  classOut: var CAtom): Selector
+  pseudoElement: var PseudoElement; specificityOut: var uint): Selector
 proc seek*(ctx: var CSSParser)
 proc `$`*(tok: CSSToken): string
 proc `$`*(c: CSSRule): string
@@ -1615,8 +1619,7 @@ proc parseHost(state: var SelectorParser): Selector =
   state.nested = true
   var pseudo = peNone
   var specificity: uint
-  var classOut: CAtom
-  let head = state.parseCompoundSelector(pseudo, specificity, classOut)
+  let head = state.parseCompoundSelector(pseudo, specificity)
   state.skipFunction()
   state.nested = onested
   if head == nil or pseudo != peNone: fail
@@ -1802,8 +1805,7 @@ proc parseClassSelector(state: var SelectorParser): Selector =
 
 # returns head
 proc parseCompoundSelector(state: var SelectorParser;
-    pseudoElement: var PseudoElement; specificityOut: var uint;
-    classOut: var CAtom): Selector =
+    pseudoElement: var PseudoElement; specificityOut: var uint): Selector =
   var head: Selector = nil
   var tail: Selector = nil
   var specificity = 0u
@@ -1825,8 +1827,6 @@ proc parseCompoundSelector(state: var SelectorParser;
     of cttDot:
       state.seekToken()
       sel = state.parseClassSelector()
-      if sel != nil:
-        classOut = sel.atom.view()
     of cttStar:
       state.seekToken()
       sel = Selector(t: stUniversal)
@@ -1849,15 +1849,69 @@ proc parseCompoundSelector(state: var SelectorParser;
   specificityOut = specificity
   head
 
+# Collect the names that must be present on the ancestors of the element
+# matched by csel.  Compounds reached through a sibling combinator match
+# siblings of ancestors, so we skip those.
+proc setAncestorHashes(csel: var ComplexSelector) =
+  var n = 0
+  var sibling = false
+  for i in countdown(csel.csels.high - 1, 0):
+    case csel.csels[i].ct
+    of ctDescendant, ctChild: sibling = false
+    of ctNextSibling, ctSubsequentSibling: sibling = true
+    of ctNone: discard
+    if sibling:
+      continue
+    var sel = csel.csels[i].head
+    while sel != nil and n < csel.ancestorHashes.len:
+      case sel.t
+      of stType:
+        csel.ancestorHashes[n] = ancestorHash(ahtTag, $sel.atom)
+        inc n
+      of stId:
+        csel.ancestorHashes[n] = ancestorHash(ahtId, $sel.atom)
+        inc n
+      of stClass:
+        csel.ancestorHashes[n] = ancestorHash(ahtClass, $sel.atom)
+        inc n
+      else: discard
+      sel = sel.next
+
+proc isSiblingDependent(sel: Selector): bool =
+  case sel.t
+  of stPseudoClass:
+    return sel.pc notin {pcRoot, pcLink, pcVisited, pcHost, pcBorderNonzero}
+  of stNthChild, stNthLastChild:
+    return true
+  of stIs, stWhere, stNot:
+    for it in sel.fsels:
+      if it.siblingDependent:
+        return true
+    return false
+  else:
+    return false
+
+proc setSiblingDependent(csel: var ComplexSelector) =
+  # Past the first descendant or child combinator, we only look at
+  # ancestors and their siblings, which are the same for siblings.
+  if csel.csels.len > 1 and
+      csel.csels[^2].ct in {ctNextSibling, ctSubsequentSibling}:
+    csel.siblingDependent = true
+    return
+  var sel = csel.csels[^1].head
+  while sel != nil:
+    if sel.isSiblingDependent():
+      csel.siblingDependent = true
+      break
+    sel = sel.next
+
 proc parseComplexSelector(state: var SelectorParser): ComplexSelector =
   var pseudo = peNone
   result = ComplexSelector()
-  var prevClass = CAtomNull
   while true:
     state.skipBlanks()
     var specificity: uint
-    var class = CAtomNull
-    let head = state.parseCompoundSelector(pseudo, specificity, class)
+    let head = state.parseCompoundSelector(pseudo, specificity)
     if state.failed:
       break
     if head == nil and pseudo == peNone: fail
@@ -1885,23 +1939,12 @@ proc parseComplexSelector(state: var SelectorParser): ComplexSelector =
     of cttComma:
       break # finish
     else: fail
-    # save a necessary ancestor class, in the hope that we can use it to
-    # skip some backwards tree traversals.
-    # a) limit the scope of the query, so that different descendants in the
-    #    same tree are caught
-    # b) stick to descendant combinators as they are very slow, but also
-    #    cache child when we only have that
-    if ct == ctDescendant:
-      if class != CAtomNull:
-        prevClass = class
-    elif ct == ctChild:
-      if prevClass == CAtomNull:
-        prevClass = class
     result[^1].ct = ct
   if result.len == 0 or result[^1].ct != ctNone:
     fail
   result.pseudo = pseudo
-  result.ancestorClass = prevClass
+  result.setAncestorHashes()
+  result.setSiblingDependent()
   if pseudo != peNone: # pseudo-elements have a specificity of 1
     inc result.specificity
 
@@ -153,9 +153,12 @@ proc counter(ctx: TreeContext; name: CAtom): int32 =
   return 0
 
 proc inheritFor(computed: CSSValues; display: CSSDisplay): CSSValues =
-  let inherited = computed.inheritProperties()
-  inherited{"display"} = display
-  inherited.atomize()
+  let inherited = computed.inheritedValues()
+  if inherited{"display"} == display:
+    return inherited
+  let res = inherited.copyProperties()
+  res{"display"} = display
+  res.atomize()
 
 proc inheritFor(frame: TreeFrame; display: CSSDisplay): CSSValues =
   frame.computed.inheritFor(display)
@@ -174,8 +177,7 @@ proc getAnonInlineComputed(frame: var TreeFrame): CSSValues =
     if frame.computed{"display"} in DisplayInlineLike:
       frame.anonInlineComputed = frame.computed
     else:
-      let computed = frame.computed.inheritProperties()
-      frame.anonInlineComputed = computed.atomize()
+      frame.anonInlineComputed = frame.computed.inheritedValues()
   return frame.anonInlineComputed
 
 proc displayed(frame: TreeFrame; text: RefString): bool =
@@ -580,6 +582,8 @@ proc matchCache(node: StyledNode; box: CSSBox): bool =
         node.computed{"display"} == box.computed{"display"}:
       if node.pseudo in node.element.relayout:
         box.keepLayout = false
+      if box.computed != node.computed:
+        box.keepRender = false
       box.computed = node.computed
       box.absolute = nil
       return true
@@ -593,6 +597,8 @@ proc matchCache(node: StyledNode; box: CSSBox): bool =
         node.computed{"display"} == box.computed{"display"}:
       if node.pseudo in node.element.relayout:
         box.keepLayout = false
+      if box.computed != node.computed:
+        box.keepRender = false
       box.computed = node.computed
       box.absolute = nil
       return true
@@ -608,6 +614,8 @@ proc matchCache(node: StyledNode; box: CSSBox): bool =
         # text boxes at at all.  I really don't know...)
         box.keepLayout = box.len == node.text.len and
           (box.text == node.text or box.text.s == node.text.s)
+        if box.computed != node.computed:
+          box.keepRender = false
         box.len = node.text.len
         box.computed = node.computed
         box.text = node.text
@@ -619,11 +627,15 @@ proc matchCache(node: StyledNode; box: CSSBox): bool =
         if box.computed{"clear"} != node.computed{"clear"} or
             box.computed{"white-space"} != node.computed{"white-space"}:
           box.keepLayout = false
+        if box.computed != node.computed:
+          box.keepRender = false
         box.computed = node.computed
         return true
       return false
     of stCounter:
       if box of InlineTextBox:
+        if box.computed != node.computed:
+          box.keepRender = false
         box.computed = node.computed
         return true
       return false
@@ -726,6 +738,10 @@ proc buildOuterBox(ctx: TreeContext; cached: CSSBox; styledNode: StyledNode;
   var firstSetCounterIdx: int
   ctx.applyCounters(styledNode, firstSetCounterIdx)
   let countersLen = ctx.counters.len
+  # anonymous boxes and pseudo-elements share their parent's element
+  let ancestor = styledNode.pseudo == peNone and not styledNode.skipChildren
+  if ancestor:
+    pushAncestor(styledNode.element)
   var frame = ctx.initTreeFrame(styledNode.element, styledNode.computed)
   var stackItem: StackItem = nil
   let display = frame.computed{"display"}
@@ -751,6 +767,8 @@ proc buildOuterBox(ctx: TreeContext; cached: CSSBox; styledNode: StyledNode;
     box.element.box = box
   ctx.resetCounters(styledNode.element, countersLen, oldCountersLen,
     firstSetCounterIdx)
+  if ancestor:
+    popAncestor(styledNode.element)
   box.positioned = stackItem != nil and position != PositionStatic
   if stackItem != nil:
     stackItem.box = box
@@ -831,6 +849,7 @@ proc buildTree*(element: Element; cached: CSSBox; markLinks: bool; nhints: int;
   ctx.resetCounter(satDashChaHintCounter.toAtom(), int32(hintOffset), element)
   let root = BlockBox(ctx.build(cached, styledNode, forceZ = false,
     root = true))
+  clearAncestors()
   stack.box = root
   root.absolute = ctx.absoluteHead
   ctx.popStackItem(nil)
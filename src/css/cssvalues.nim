@@ -376,6 +376,8 @@ type
     objs*: array[FirstObjPropType..CSSPropertyType.high, CSSValue]
     vars*: CSSVariableMap
     next*: CSSValues
+    # Interned result of inheritProperties; see inheritedValues.
+    inheritedCache: CSSValues
 
   CSSValues* = ref CSSValuesObj
 
@@ -2702,9 +2704,22 @@ proc inheritProperties*(parent: CSSValues): CSSValues =
     else:
       result.setInitial(t)
 
+proc inheritedValues*(parent: CSSValues): CSSValues =
+  ## Return the interned result of inheritProperties for `parent`.
+  ## `parent` must not be modified after this, and neither may the
+  ## result.
+  var res = parent.inheritedCache
+  if res == nil:
+    res = parent.inheritProperties().atomize()
+    if res != parent: # do not create a cycle
+      parent.inheritedCache = res
+  return res
+
 proc copyProperties*(props: CSSValues): CSSValues =
   result = CSSValues()
   result[] = props[]
+  # the copy is likely to be modified, which would make this stale
+  result.inheritedCache = nil
 
 proc rootProperties*(): CSSValues =
   result = CSSValues()
@@ -2735,7 +2750,8 @@ proc splitTable*(computed: CSSValues): tuple[outer, innner: CSSValues] =
       outer.setInitial(t)
   outer{"display"} = computed{"display"}
   inner{"display"} = DisplayTableWrapper
-  return (outer, inner)
+  # interned, so that csstree can compare them with the old box's values
+  return (outer.atomize(), inner.atomize())
 
 proc borderChar*(style: CSSBorderStyle; c: BoxDrawingChar): string =
   return case style
@@ -21,6 +21,9 @@ type
     cellSize: Size # size(w = attrs.ppc, h = attrs.ppl)
     canvasSize: Size # size of canvas
     luctx: LUContext
+    # Block children starting below this offset are not laid out.
+    limit: LUnit
+    partial: bool # set if we have skipped some children due to limit
 
 const DefaultSpan = Span(start: 0'lu, send: LUnit.high)
 
@@ -2094,14 +2097,65 @@ proc layoutInline(fstate: var FlowState; ibox: InlineBox) =
       ))
   fstate.textAlign = oldTextAlign
 
+# Returns true if the children after the current offset may be skipped,
+# i.e. they are below the limit and nothing above them depends on their
+# layout.
+proc canDefer(fstate: FlowState): bool =
+  let lctx = fstate.lctx
+  let y = fstate.bfcOffset.y + fstate.offset.y
+  if y <= lctx.limit or fstate.space.w.t != scStretch or
+      fstate.lbstate.realAtomsTail != nil or
+      fstate.pendingFloatsHead != nil:
+    return false
+  for ex in fstate.exclusions:
+    if ex.offset.y + ex.size.h > y:
+      return false
+  true
+
+# Skip the layout of child and its next siblings, and use an estimate of
+# their height instead.  The average height of the children laid out so
+# far (n, totaling h) is used for boxes that have not been laid out yet.
+proc deferChildren(fstate: var FlowState; child: CSSBox; n: int; h: LUnit) =
+  let avg = if n > 0: h div n.toLUnit() else: fstate.cellSize.h
+  var h = 0'lu
+  var it = child
+  while it != nil:
+    if it of BlockBox and it.computed{"position"} in PositionAbsoluteFixed:
+      # still laid out by popPositioned; just give it a static position
+      BlockBox(it).input.bfcOffset = fstate.offset
+    else:
+      it.deferred = true
+      it.keepRender = false
+      if it.keepLayout and it of BlockBox:
+        h += BlockBox(it).state.size.h
+      else:
+        h += avg
+    it = it.next
+  fstate.offset.y += h
+  fstate.intr.h += h
+  # ancestors must be laid out again once the limit changes
+  var parent = CSSBox(fstate.box)
+  while parent != nil:
+    parent.keepLayout = false
+    parent = parent.parent
+  fstate.lctx.partial = true
+
 proc layoutFlow0(fstate: var FlowState) =
   fstate.lbstate = fstate.initLineBoxState()
   let box = fstate.box
+  let starty = fstate.offset.y
+  var n = 0
   for child in box.children:
     if child of InlineBox:
+      child.deferred = false
       fstate.layoutInline(InlineBox(child))
     else:
+      if fstate.canDefer():
+        fstate.deferChildren(child, n, fstate.offset.y - starty)
+        break
+      child.deferred = false
       fstate.layoutOuterBlock(BlockBox(child))
+    inc n
   fstate.finishLine(fstate.lastTextBox, wrap = false)
   fstate.totalFloatWidth = max(fstate.totalFloatWidth,
     fstate.lbstate.totalFloatWidth)
@@ -3300,12 +3354,21 @@ proc layout(lctx: LayoutContext; box: BlockBox; offset: Offset;
     let size = if root == irfRoot: lctx.canvasSize else: box.state.size
     lctx.popPositioned(box.absolute, size)
 
+# Lay out the box tree starting at box.  Block children that start below
+# limit are skipped, and replaced by an estimate of their height; such
+# boxes are flagged as deferred.
+# Returns true if some boxes have been deferred.
 proc layout*(box: BlockBox; attrs: WindowAttributes; fixedHead: CSSAbsolute;
-    luctx: LUContext) =
+    luctx: LUContext; limit = LUnit.high): bool =
   var size = size(w = attrs.widthPx.toLUnit(), h = attrs.heightPx.toLUnit())
   let space = initSpace(w = stretch(size.w), h = stretch(size.h))
   let cellSize = size(w = attrs.ppc.toLUnit(), h = attrs.ppl.toLUnit())
-  let lctx = LayoutContext(cellSize: cellSize, luctx: luctx, canvasSize: size)
+  let lctx = LayoutContext(
+    cellSize: cellSize,
+    luctx: luctx,
+    canvasSize: size,
+    limit: limit
+  )
   let input = lctx.resolveBlockSizes(space, box)
   # the bottom margin is unused.
   lctx.layout(box, input.margin.topLeft, input, irfRoot)
@@ -3318,5 +3381,6 @@ proc layout*(box: BlockBox; attrs: WindowAttributes; fixedHead: CSSAbsolute;
   size.w = max(size.w, box.state.size.w)
   size.h = max(size.h, box.state.size.h)
   lctx.popPositioned(fixedHead, size)
+  return lctx.partial
 
 {.pop.} # raises: []
@@ -39,7 +39,8 @@ proc toLUnit*(a: int32): LUnit =
   satlu(b)
 
 proc toLUnit*(a: int): LUnit =
-  let b = int64(a) shl 6
+  # clamp first, or the shift overflows for values outside int32
+  let b = int64(clamp(a, int(int32.low), int(int32.high))) shl 6
   satlu(b)
 
 proc `-`*(a: LUnit): LUnit {.inline.} =
@@ -1,5 +1,7 @@
 {.push raises: [].}
 
+import std/algorithm
+
 import css/box
 import css/cssvalues
 import css/lunit
@@ -38,15 +40,35 @@ type
     height*: int
     bmp*: NetworkBitmap
 
+  # Rendering happens in two passes.  The first one (measure) only
+  # records the lines each box paints to, and damages those of boxes that
+  # changed since the last render.  The second one clears the damaged
+  # lines and paints them again; other lines are left untouched.
   RenderState = object
     bgcolor: CellColor
     images: seq[PosBitmap]
     spaces: seq[char] # buffer filled with spaces for padding
     cellSize: Size # size(w = attrs.ppc, h = attrs.ppl)
+    measure: bool # set in the first pass
+    inDamaged: bool # set while measuring descendants of a changed box
+    starty: int # lines painted by the box being measured
+    endy: int
+    height: int # number of lines in the grid
+    damage: seq[bool] # lines to paint in the second pass
+    damaged: seq[int] # lines set in damage, in no particular order
+    positioned: seq[CSSBox] # positioned boxes seen while measuring
+
+  RenderMark = object
+    starty: int
+    endy: int
+    damaged: bool
 
 # Forward declarations
 proc renderBlock(grid: var FlexibleGrid; state: var RenderState;
   box: BlockBox; offset: Offset; pass2 = false)
+proc renderInline(grid: var FlexibleGrid; state: var RenderState;
+  ibox: InlineBox; offset: Offset; bgcolor0 = rgba(0, 0, 0, 0);
+  pass2 = false)
 
 proc findFormatN*(line: FlexibleLine; pos: int; start = 0): int =
   var i = start
@@ -63,7 +85,79 @@ proc insertFormat(line: var FlexibleLine; pos, i: int; format: Format;
     node: Element) =
   line.insertFormat(i, FormatCell(format: format, node: node, pos: pos))
 
-proc toFormat(computed: CSSValues): Format =
+proc sameCells(a, b: FlexibleLine): bool =
+  if a.str != b.str or a.formats.len != b.formats.len:
+    return false
+  for i, it in a.formats.mypairs:
+    if it.format != b.formats[i].format or it.pos != b.formats[i].pos:
+      return false
+  true
+
+proc addDamage(state: var RenderState; starty, endy: int) =
+  if starty < endy:
+    if state.damage.len < endy:
+      state.damage.setLen(endy)
+    for y in starty ..< endy:
+      if not state.damage[y]:
+        state.damage[y] = true
+        state.damaged.add(y)
+
+proc addLines(paint: var BoxPaintState; starty, endy: int) =
+  if starty < endy:
+    if paint.starty < paint.endy:
+      paint.starty = min(paint.starty, starty)
+      paint.endy = max(paint.endy, endy)
+    else:
+      paint.starty = starty
+      paint.endy = endy
+
+# Record that the box being measured paints to lines starty ..< endy.
+proc addLines(state: var RenderState; starty, endy: int) =
+  if starty < endy:
+    if state.starty < state.endy:
+      state.starty = min(state.starty, starty)
+      state.endy = max(state.endy, endy)
+    else:
+      state.starty = starty
+      state.endy = endy
+    state.height = max(state.height, endy)
+
+proc changed(box: CSSBox): bool =
+  if not box.keepRender or box.paint.offset != box.render.offset or
+      box.paint.clipBox != box.render.clipBox:
+    return true
+  return box of BlockBox and box.paint.size != BlockBox(box).state.size
+
+proc enterBox(state: var RenderState; box: CSSBox): RenderMark =
+  result = RenderMark(starty: state.starty, endy: state.endy)
+  if state.measure:
+    if not state.inDamaged and box.changed():
+      # descendants are covered by our damage
+      state.inDamaged = true
+      result.damaged = true
+    state.starty = 0
+    state.endy = 0
+
+proc leaveBox(state: var RenderState; box: CSSBox; mark: RenderMark) =
+  if not state.measure:
+    return
+  if mark.damaged:
+    # repaint both the lines we used to paint, and those we paint now
+    state.addDamage(box.paint.starty, box.paint.endy)
+    state.addDamage(state.starty, state.endy)
+    state.inDamaged = false
+  box.paint = BoxPaintState(
+    offset: box.render.offset,
+    clipBox: box.render.clipBox,
+    starty: state.starty,
+    endy: state.endy
+  )
+  if box of BlockBox:
+    box.paint.size = BlockBox(box).state.size
+  box.keepRender = true
+  state.addLines(mark.starty, mark.endy)
+
+proc toFormat*(computed: CSSValues): Format =
   if computed == nil:
     return Format()
   var flags: set[FormatFlag] = {}
@@ -278,10 +372,10 @@ proc setText(grid: var FlexibleGrid; state: var RenderState; s: string;
     targetX += s.nextUTF8(j).width()
   if i < j:
     let y = (offset.y div state.cellSize.h).toInt
-    # make sure we have line y
-    if grid.len < y + 1:
-      grid.setLen(y + 1)
-    grid[y].setText1(s.toOpenArray(i, j - 1), x, targetX, format, node)
+    if state.measure:
+      state.addLines(y, y + 1)
+    elif state.damage[y]:
+      grid[y].setText1(s.toOpenArray(i, j - 1), x, targetX, format, node)
 
 proc clip(clipBox: ClipBox; state: RenderState; start, send: Offset):
     tuple[start, send: Offset] =
@@ -308,10 +402,14 @@ proc paintBackground(grid: var FlexibleGrid; state: var RenderState;
   let endy = (send.y div state.cellSize.h).toInt()
   if starty >= endy or startx >= endx:
     return
-  if grid.len < endy: # make sure we have line y - 1
-    grid.setLen(endy)
+  if state.measure:
+    state.addLines(starty, endy)
+    return
   var format = initFormat(color, defaultColor, {})
-  for line in grid.toOpenArray(starty, endy - 1).mitems:
+  for y in starty ..< endy:
+    if not state.damage[y]:
+      continue
+    template line: var FlexibleLine = grid[y]
     # Make sure line.width() >= endx
     var hadStr: bool
     var cx: int
@@ -396,6 +494,8 @@ proc renderImage(grid: var FlexibleGrid; state: var RenderState;
     # add Element to background (but don't actually color it)
     grid.paintBackground(state, defaultColor, offset, p2, box.element, 0,
       box.render.clipBox)
+    if not state.measure: # images are collected in the first pass
+      return
     let x = (offset.x div state.cellSize.w).toInt
     let y = (offset.y div state.cellSize.h).toInt
     let offx = (offset.x - x.toLUnit * state.cellSize.w).toInt
@@ -410,18 +510,9 @@ proc renderImage(grid: var FlexibleGrid; state: var RenderState;
       bmp: bmp
     ))
 
-proc renderInline(grid: var FlexibleGrid; state: var RenderState;
-    ibox: InlineBox; offset: Offset; bgcolor0 = rgba(0, 0, 0, 0);
-    pass2 = false) =
-  let clipBox = if ibox.parent != nil:
-    ibox.parent.render.clipBox
-  else:
-    DefaultClipBox
-  ibox.render = BoxRenderState(
-    offset: offset + ibox.state.startOffset,
-    clipBox: clipBox,
-    rendered: true
-  )
+proc renderInline0(grid: var FlexibleGrid; state: var RenderState;
+    ibox: InlineBox; offset: Offset; bgcolor0: ARGBColor; pass2: bool) =
+  let clipBox = ibox.render.clipBox
   let bgcolor = ibox.computed{"background-color"}
   var bgcolor0 = bgcolor0
   if bgcolor.t == cctCell:
@@ -452,6 +543,26 @@ proc renderInline(grid: var FlexibleGrid; state: var RenderState;
       else:
         grid.renderBlock(state, BlockBox(child), offset)
 
+proc renderInline(grid: var FlexibleGrid; state: var RenderState;
+    ibox: InlineBox; offset: Offset; bgcolor0 = rgba(0, 0, 0, 0);
+    pass2 = false) =
+  let clipBox = if ibox.parent != nil:
+    ibox.parent.render.clipBox
+  else:
+    DefaultClipBox
+  ibox.render = BoxRenderState(
+    offset: offset + ibox.state.startOffset,
+    clipBox: clipBox,
+    rendered: true
+  )
+  if ibox.positioned and not pass2:
+    # only paints the background, as part of the parent
+    grid.renderInline0(state, ibox, offset, bgcolor0, pass2)
+  else:
+    let mark = state.enterBox(ibox)
+    grid.renderInline0(state, ibox, offset, bgcolor0, pass2)
+    state.leaveBox(ibox, mark)
+
 proc inheritClipBox(box: BlockBox; parent: CSSBox; state: RenderState) =
   if parent == nil:
     box.render.clipBox = DefaultClipBox
@@ -583,6 +694,7 @@ proc renderBlock(grid: var FlexibleGrid; state: var RenderState;
     box.render.offset = offset
     box.render.rendered = true
     box.inheritClipBox(box.parent, state)
+  let mark = state.enterBox(box)
   let opacity = box.computed{"opacity"}
   if box.computed{"visibility"} == VisibilityVisible and opacity != 0:
     grid.renderImage(state, box, offset)
@@ -616,10 +728,13 @@ proc renderBlock(grid: var FlexibleGrid; state: var RenderState;
   if opacity != 0: #TODO this isn't right...
     if box.render.clipBox.start < box.render.clipBox.send:
       for child in box.children:
+        if child.deferred:
+          break # so are the rest
         if child of InlineBox:
           grid.renderInline(state, InlineBox(child), offset)
         else:
           grid.renderBlock(state, BlockBox(child), offset)
+  state.leaveBox(box, mark)
 
 # This function exists to support another insane CSS construct: negative
 # z-index.
@@ -695,6 +810,10 @@ proc resolveBlockOffset(box: CSSBox; state: RenderState): Offset =
 
 proc renderPositioned(grid: var FlexibleGrid; state: var RenderState;
     box: CSSBox) =
+  if box.isDeferred():
+    return # not laid out
+  if state.measure:
+    state.positioned.add(box)
   let offset = box.resolveBlockOffset(state)
   if box of BlockBox:
     grid.renderBlock(state, BlockBox(box), offset, pass2 = true)
@@ -716,15 +835,74 @@ proc renderStack(grid: var FlexibleGrid; state: var RenderState;
   for it in stack.children.toOpenArray(i, stack.children.high):
     grid.renderStack(state, it)
 
+# Render the box tree into grid, which holds the output of the previous
+# render (if any).  Unless full is set, only lines painted by boxes that
+# changed since then are repainted.
+# On return, damage holds the lines that have changed, in ascending order.
 proc render*(grid: var FlexibleGrid; bgcolor: var CellColor; stack: StackItem;
-    attrs: WindowAttributes; images: var seq[PosBitmap]) =
-  grid.setLen(0)
+    attrs: WindowAttributes; images: var seq[PosBitmap];
+    damage: var seq[int]; full: bool) =
   var state = RenderState(
     bgcolor: defaultColor,
     cellSize: size(w = attrs.ppc.toLUnit(), h = attrs.ppl.toLUnit()),
+    measure: true
   )
   grid.renderStack(state, stack)
+  # Positioned boxes are not painted as part of their ancestors, but if an
+  # ancestor changes then they may move or go away as well.
+  for box in state.positioned:
+    var it = box.parent
+    while it != nil:
+      it.paint.addLines(box.paint.starty, box.paint.endy)
+      it = it.parent
+  let oldLen = grid.len
+  let height = state.height
+  if full or state.bgcolor != bgcolor:
+    state.addDamage(0, height)
+  else:
+    state.addDamage(oldLen, height)
+  state.damage.setLen(height)
+  # Only look at the damaged lines, so that a small change in a long
+  # document stays cheap.
+  state.damaged.sort()
+  while state.damaged.len > 0 and state.damaged[^1] >= height:
+    state.damaged.setLen(state.damaged.len - 1)
   bgcolor = state.bgcolor
   images = move(state.images)
+  var old: seq[FlexibleLine] = @[]
+  for y in state.damaged:
+    if y >= oldLen:
+      break
+    old.add(move(grid[y]))
+  grid.setLen(height)
+  if old.len > 0 or oldLen < height:
+    state.measure = false
+    state.bgcolor = defaultColor
+    grid.renderStack(state, stack)
+  damage.setLen(0)
+  for i, y in state.damaged.mypairs:
+    if i >= old.len or not grid[y].sameCells(old[i]):
+      damage.add(y)
+
+# Returns true if text appended to the end of box can be painted without
+# rendering the tree again, i.e. if nothing that box or its ancestors
+# paint would grow with it.
+proc canAppendText*(box: BlockBox): bool =
+  if box.render.clipBox != DefaultClipBox:
+    return false
+  var it = CSSBox(box)
+  while it != nil:
+    let computed = it.computed
+    if computed{"opacity"} == 0 or computed{"background-image"} != nil or
+        computed{"background-color"}.cellColor() != defaultColor and
+        not computed{"-cha-bgcolor-is-canvas"}:
+      return false
+    if it of BlockBox:
+      for span in BlockBox(it).input.border:
+        if span.start notin BorderStyleNoneHidden or
+            span.send notin BorderStyleNoneHidden:
+          return false
+    it = it.parent
+  true
 
 {.pop.} # raises: []
@@ -1,6 +1,9 @@
 {.push raises: [].}
 
+import std/hashes
+
 import chame/tags
+import config/conftypes
 import css/cssparser
 import css/cssvalues
 import css/mediaquery
@@ -9,13 +12,19 @@ import html/script
 import monoucha/jsref
 import types/opt
 import types/url
+import types/winattrs
 import utils/tabutil
 
 type
-  CSSRuleDef* = ref object
+  # The selectors and declarations of a rule.  Copies of a cached sheet
+  # share these; the rest of CSSRuleDef belongs to one sheet.
+  CSSRuleBody* = ref object
     sels*: SelectorList
     vals*: array[CSSImportantFlag, seq[CSSComputedEntry]]
     vars*: array[CSSImportantFlag, seq[CSSVariable]]
+
+  CSSRuleDef* = ref object
+    body*: CSSRuleBody
     # Absolute position in the stylesheet; used for sorting rules after
     # retrieval from the cache.
     # Top 32 bits: sheet id; bottom 32 bits: rule id.
@@ -49,7 +58,7 @@ type
     prev*: CSSStylesheet
     next*: CSSStylesheet
     media*: string # media attr
-    toks: seq[CSSToken]
+    src: string
     baseLayer: CAtomTraced
     origin: CSSOrigin
     disabled*: bool # whether or not we have disabled attr etc.
@@ -84,12 +93,32 @@ type
     attr: CAtom
     t: SelectorHashType
 
+  # The result of parsing src with the other fields as input.
+  ParsedSheet = ref object
+    h: Hash
+    src: string
+    base: string
+    origin: CSSOrigin
+    layer: CAtomTraced
+    attrs: WindowAttributes
+    scripting: ScriptingMode
+    headless: HeadlessMode
+    contentType: CAtomTraced
+    s: StyleState
+
 # Forward declarations
 proc getSelectorIds(hashes: var SelectorHashes; sel: Selector): bool
 proc addRule(sheet: CSSStylesheet; rule: CSSQualifiedRule; layer: CAtomTraced)
 proc addAtRule(sheet: CSSStylesheet; atrule: CSSAtRule; base: URL;
   layer: CAtomTraced): Opt[void]
 
+# Recently parsed stylesheets, most recently used first.  Documents that
+# parse the same sheet again (e.g. the UA sheet after a charset switch, or
+# the same sheet linked twice) share its rule bodies instead.
+var parsedSheets {.global.}: seq[ParsedSheet]
+
+const ParsedSheetsMax = 8
+
 proc newCSSRuleMap*(quirks: bool): CSSRuleMap =
   CSSRuleMap(quirks: quirks)
 
@@ -229,7 +258,7 @@ proc getSelectorIds(hashes: var SelectorHashes; sel: Selector): bool =
     return false
 
 proc add(sheet: CSSRuleMap; rule: CSSRuleDef) =
-  for cxsel in rule.sels:
+  for cxsel in rule.body.sels:
     var hashes = SelectorHashes()
     hashes.getSelectorIds(cxsel)
     if hashes.id != CAtomNull:
@@ -294,7 +323,7 @@ proc addRule(sheet: CSSStylesheet; rule: CSSQualifiedRule;
     layer: CAtomTraced) =
   if rule.sels.len > 0:
     var ruleDef = CSSRuleDef(
-      sels: move(rule.sels),
+      body: CSSRuleBody(sels: move(rule.sels)),
       idx: sheet.s.len,
       origin: sheet.origin,
       layer: layer.dupTrace()
@@ -303,14 +332,14 @@ proc addRule(sheet: CSSStylesheet; rule: CSSQualifiedRule;
       let f = decl.f
       case decl.t
       of cdtVariable:
-        ruleDef.vars[f].add(CSSVariable(
+        ruleDef.body.vars[f].add(CSSVariable(
           name: decl.v,
           items: parseDeclWithVar1(decl.value)
         ))
       of cdtNestedRule:
         sheet.s.add(ruleDef)
         ruleDef = CSSRuleDef(
-          sels: ruleDef.sels,
+          body: CSSRuleBody(sels: ruleDef.body.sels),
           idx: sheet.s.len,
           origin: sheet.origin,
           layer: layer.dupTrace()
@@ -319,9 +348,9 @@ proc addRule(sheet: CSSStylesheet; rule: CSSQualifiedRule;
       of cdtProperty:
         if decl.hasVar:
           if entry := parseDeclWithVar(decl.p, decl.value):
-            ruleDef.vals[f].add(entry)
+            ruleDef.body.vals[f].add(entry)
         else:
-          ruleDef.vals[f].parseComputedValues(decl.p, decl.value,
+          ruleDef.body.vals[f].parseComputedValues(decl.p, decl.value,
             sheet.settings.attrsp[])
     sheet.s.add(ruleDef)
 
@@ -430,23 +459,82 @@ proc addAtRule(sheet: CSSStylesheet; atrule: CSSAtRule; base: URL;
       sheet.s.layers.s.add(names)
   ok()
 
+# Copy s, sharing the bodies of its rules.  The rule defs themselves are
+# copied, because CSSRuleMap.add overwrites their idx and layerId.
+proc clone(s: StyleState): StyleState =
+  result = StyleState(
+    importList: s.importList,
+    idx: s.idx,
+    anonLayerCount: s.anonLayerCount
+  )
+  var def = s.defsHead
+  while def != nil:
+    result.add(CSSRuleDef(
+      body: def.body,
+      idx: def.idx,
+      origin: def.origin,
+      layerId: def.layerId,
+      layer: def.layer.dupTrace()
+    ))
+    def = def.next
+  for it in s.layers.s:
+    result.layers.s.add(it.dup())
+
+proc matches(entry: ParsedSheet; sheet: CSSStylesheet; h: Hash;
+    base: string): bool =
+  let settings = sheet.settings
+  return entry.h == h and entry.origin == sheet.origin and
+    entry.layer.view == sheet.baseLayer.view and
+    entry.attrs == settings.attrsp[] and
+    entry.scripting == settings.scripting and
+    entry.headless == settings.headless and
+    entry.contentType.view == settings.contentType.view and
+    entry.base == base and entry.src == sheet.src
+
+proc parse(sheet: CSSStylesheet; base: URL) =
+  let h = hash(sheet.src)
+  let baseStr = if base != nil: $base else: ""
+  for i in 0 ..< parsedSheets.len:
+    let entry = parsedSheets[i]
+    if entry.matches(sheet, h, baseStr):
+      if i > 0:
+        parsedSheets.delete(i)
+        parsedSheets.insert(entry, 0)
+      sheet.s = entry.s.clone()
+      return
+  var ctx = initCSSParser(sheet.src)
+  sheet.s = StyleState()
+  sheet.addRules(ctx, topLevel = true, base, sheet.baseLayer)
+  let settings = sheet.settings
+  let entry = ParsedSheet(
+    h: h,
+    src: sheet.src,
+    base: baseStr,
+    origin: sheet.origin,
+    layer: sheet.baseLayer.dupTrace(),
+    attrs: settings.attrsp[],
+    scripting: settings.scripting,
+    headless: settings.headless,
+    contentType: settings.contentType.dupTrace(),
+    s: sheet.s.clone()
+  )
+  if parsedSheets.len >= ParsedSheetsMax:
+    parsedSheets.setLen(ParsedSheetsMax - 1)
+  parsedSheets.insert(entry, 0)
+
 proc parseStylesheet*(iq: string; base: URL; settings: ptr EnvironmentSettings;
     origin: CSSOrigin; layer: CAtomTraced): CSSStylesheet =
-  var ctx = initCSSParser(iq)
   let sheet = CSSStylesheet(
     settings: settings,
     origin: origin,
+    src: iq,
     baseLayer: layer.dupTrace(),
     applies: true
   )
-  sheet.addRules(ctx, topLevel = true, base, layer)
-  sheet.toks = move(ctx.toks)
+  sheet.parse(base)
   return sheet
 
 proc windowChange*(sheet: CSSStylesheet; base: URL) =
-  var ctx = initCSSParserSink(sheet.toks)
-  sheet.s = StyleState()
-  sheet.addRules(ctx, topLevel = true, base, sheet.baseLayer)
-  sheet.toks = move(ctx.toks)
+  sheet.parse(base)
 
 {.pop.} # raises: []
@@ -134,6 +134,8 @@ type
     window*: Window #TODO weak?
     expiry: int64
     loading: bool
+    prioritized: bool # loader has been told that the image is visible
+    url: URL # for prioritizeImage
     shared*: seq[HTMLImageElement]
     bmp: NetworkBitmap
     cacheId: int
@@ -681,6 +683,7 @@ type
   HTMLImageElementObj {.pure, final.} = object of HTMLElementObj
     bitmap*: NetworkBitmap
     fetchStarted: bool
+    pending: CachedURLImage # the load we are waiting for, if any
 
   HTMLVideoElement* = JSRef[HTMLVideoElementObj]
 
@@ -1672,7 +1675,7 @@ proc loadSheet(window: Window; this: SheetElement; url: URL; charset: Charset;
     i: i,
     finish: finish
   )
-  window.corsFetch(newRequest(url), loadSheet0, env)
+  window.corsFetch(newRequest(url, priority = rpStyle), loadSheet0, env)
 
 proc loadSheet(window: Window; this: SheetElement; url: URL;
     finish: LoadSheetFinish) =
@@ -1829,30 +1832,37 @@ proc loadImageFromCache(window: Window; image: HTMLImageElement; surl: string):
     return true
   if cachedURL.loading:
     cachedURL.shared.add(image)
+    image.pending = cachedURL
     return true
   false
 
+proc imageURL(window: Window; image: HTMLImageElement): URL =
+  let src = image.asElement.attr(satSrc)
+  if src == "":
+    return nil
+  let url = parseURL(src, window.document.url).get(nil)
+  if url == nil:
+    return nil
+  if window.document.url.schemeType == stHttps and url.schemeType == stHttp:
+    # mixed content :/
+    #TODO maybe do this in loader?
+    url.setProtocol("https")
+  url
+
 proc loadImage*(window: Window; image: HTMLImageElement) =
   if not window.settings.images:
     if image.bitmap != nil:
       image.asElement.invalidate()
       image.bitmap = nil
     image.fetchStarted = false
+    image.pending = nil
     return
   if image.fetchStarted:
     return
   image.fetchStarted = true
-  let src = image.asElement.attr(satSrc)
-  if src == "":
-    return
-  let url0 = parseURL(src, window.document.url)
-  if url0.isErr:
+  let url = window.imageURL(image)
+  if url == nil:
     return
-  let url = url0.get
-  if window.document.url.schemeType == stHttps and url.schemeType == stHttp:
-    # mixed content :/
-    #TODO maybe do this in loader?
-    url.setProtocol("https")
   var surl = $url
   if window.loadImageFromCache(image, surl):
     return
@@ -1862,14 +1872,30 @@ proc loadImage*(window: Window; image: HTMLImageElement) =
     window: window,
     expiry: -1,
     loading: true,
+    url: url,
     shared: @[image]
   )
+  image.pending = cachedURL
   window.imageURLCache.put(cachedURL)
   let headers = newHeaders(hgRequest, {"Accept": "*/*"})
   inc window.remoteImageNum
-  let request = newRequest(url, headers = headers)
+  let request = newRequest(url, headers = headers, priority = rpImage)
   window.corsFetch(request, loadImage0, cachedURL)
 
+# Called when image is in view, so that the loader starts it before
+# images that are not.
+# This runs for every image in the window on each getLines, so it only
+# looks at the load the image was attached to, without parsing its URL.
+proc prioritizeImage*(window: Window; image: HTMLImageElement) =
+  let cachedURL = image.pending
+  if cachedURL == nil or cachedURL.prioritized:
+    return
+  if not cachedURL.loading:
+    image.pending = nil
+    return
+  cachedURL.prioritized = true
+  window.loader.setPriority(cachedURL.url, rpVisibleImage)
+
 proc loadSVGFinish(opaque: RootRef; response: Response) =
   let env = CachedSVG(opaque)
   let window = move(env.window)
@@ -4164,10 +4190,31 @@ proc reflectEvent(document: Document; target: EventTarget;
     JS_FreeValue(ctx, res)
     JS_FreeValue(ctx, fun)
 
+const UASheet = staticRead"res/ua.css"
+const QuirksSheet = staticRead"res/quirk.css"
+
+proc preparseSheets*(attrs: WindowAttributes; scripting: ScriptingMode;
+    headless: HeadlessMode; contentType, userStyle: string) =
+  ## Parse the UA, quirks and user sheets as a window with these settings
+  ## would.  Processes forked after this find them in the parsed sheet
+  ## cache, and do not have to parse them again.
+  var attrs = attrs
+  var settings = EnvironmentSettings(
+    attrsp: addr attrs,
+    scriptAttrsp: addr attrs,
+    scripting: scripting,
+    headless: headless,
+    contentType: contentType.toAtomTrace()
+  )
+  for it in [UASheet, QuirksSheet]:
+    discard parseStylesheet(it, URL(nil), addr settings, coUserAgent,
+      CAtomNullTraced)
+  discard parseStylesheet(userStyle, URL(nil), addr settings, coUser,
+    CAtomNullTraced)
+
 proc applyUASheet*(document: Document) =
-  const ua = staticRead"res/ua.css"
-  let sheet = parseStylesheet(ua, URL(nil), addr document.window.settings,
-    coUserAgent, CAtomNullTraced)
+  let sheet = parseStylesheet(UASheet, URL(nil),
+    addr document.window.settings, coUserAgent, CAtomNullTraced)
   document.uaSheetsHead = sheet
   if document.documentElement != nil:
     document.documentElement.invalidate()
@@ -4175,9 +4222,8 @@ proc applyUASheet*(document: Document) =
 proc applyQuirksSheet*(document: Document) =
   if document.window == nil:
     return
-  const quirks = staticRead"res/quirk.css"
-  let sheet = parseStylesheet(quirks, URL(nil), addr document.window.settings,
-    coUserAgent, CAtomNullTraced)
+  let sheet = parseStylesheet(QuirksSheet, URL(nil),
+    addr document.window.settings, coUserAgent, CAtomNullTraced)
   document.uaSheetsHead.next = sheet
   sheet.prev = document.uaSheetsHead
   if document.documentElement != nil:
@@ -8153,6 +8199,9 @@ proc fetchClassicScript(element: HTMLScriptElement; url: URL;
     return Response(nil)
   let window = element.asNode.document.window
   let request = createPotentialCORSRequest(url, rdScript, cors)
+  if element.parserDocument == nil or element.asElement.attrb(satAsync) or
+      element.asElement.attrb(satDefer):
+    request.priority = rpAsyncScript
   request.client = window.settings
   return window.loader.doRequest(request)
 
@@ -8291,7 +8340,8 @@ proc fetchSingleModule(element: HTMLScriptElement; url: URL;
     url,
     referrer = referrer,
     destination = destination,
-    mode = mode
+    mode = mode,
+    priority = rpAsyncScript # modules never block the parser
   )
   #TODO set up module script request
   #TODO performFetch
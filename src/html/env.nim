@@ -1099,20 +1099,27 @@ proc addScripting*(window: Window; ctx: JSContext): Opt[void] =
     JS_SetGlobalExotic(ctx, addr globalExotic)
   ok()
 
-proc newWindow*(rt: JSRuntime; scripting: ScriptingMode;
-    images, styling, autofocus: bool; headless: HeadlessMode;
-    attrsp: ptr WindowAttributes; loader: FileLoader; url: URL;
-    urandom: PosixStream; imageTypes: MimeTypesImages;
-    userAgent, referrer, contentType: string): Window =
-  let console = newConsole(cast[ChaFile](stderr))
-  let ctx = if scripting != smFalse:
+# Create the JS context for a buffer's window.  This is separate from
+# newWindow so that the fork server can do it before it knows the URL.
+proc newWindowContext*(rt: JSRuntime; scripting: bool): JSContext =
+  let ctx = if scripting:
     rt.newJSContext()
   else:
     rt.newDummyContext()
   if ctx.addWindowModule().isErr:
+    let console = newConsole(cast[ChaFile](stderr))
     console.error("failed to initialize window")
     console.writeException(ctx)
     quit(1)
+  ctx
+
+# ctx must come from newWindowContext(rt, scripting != smFalse).
+proc newWindow*(ctx: JSContext; scripting: ScriptingMode;
+    images, styling, autofocus: bool; headless: HeadlessMode;
+    attrsp: ptr WindowAttributes; loader: FileLoader; url: URL;
+    urandom: PosixStream; imageTypes: MimeTypesImages;
+    userAgent, referrer, contentType: string): Window =
+  let console = newConsole(cast[ChaFile](stderr))
   #TODO OOM
   let window = jsNew WindowObj(
     console: console,
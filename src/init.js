@@ -587,6 +587,20 @@ Pager.prototype.isearchForward = async function(reverse = false) {
                         const [x, y, w] = await iface[fun](re, cx, cy, wrap, 1);
                         if (this.isearchIter === iter)
                             buffer.onMatch(x, y, w, false);
+                        if (this.isearchIter === iter && y >= 0) {
+                            /* highlight the other matches on the screen too */
+                            const y1 = buffer.fromy;
+                            const y2 = y1 + buffer.height - 1;
+                            const matches =
+                                await iface.findAllMatches(re, y1, y2);
+                            if (this.isearchIter === iter) {
+                                for (const [mx, my, mw] of matches) {
+                                    if (mw > 0 && (mx != x || my != y))
+                                        iface.addSearchHighlight(mx, my,
+                                            mx + mw - 1, my);
+                                }
+                            }
+                        }
                     }
                 }
             }
@@ -854,7 +868,11 @@ Pager.prototype.reload = function() {
     const old = this.buffer;
     if (!old)
         return;
-    const buffer = this.gotoURL(old.url, {
+    /* revalidate cached responses */
+    const request = new Request(old.url, {
+        headers: {"Cache-Control": "no-cache"}
+    });
+    const buffer = this.gotoURL(request, {
         contentType: old.init.contentType,
         replace: old,
         history: old.init.history,
@@ -1973,8 +1991,8 @@ const ReTextStart = /\S/gu;
                         pager.bufferIface != this.iface)
                         pager.setVisibleBuffer(this);
                     this.#setVisible();
-                    await this.iface.onReshape();
-                    await this.iface.requestLines(true);
+                    if (await this.iface.onReshape())
+                        await this.iface.requestLines(true);
                 }
             })();
         }
@@ -2278,6 +2296,15 @@ const ReTextStart = /\S/gu;
         return this.iface.findNextMatch(regex, x, y, wrap, n);
     }
 
+    /* public */ findAllMatches(regex, y1 = this.fromy,
+                                y2 = this.fromy + this.height - 1) {
+        return this.iface.findAllMatches(regex, y1, y2);
+    }
+
+    /* public */ countMatches(regex) {
+        return this.iface.countMatches(regex);
+    }
+
     /* private */ startSelection(t, mouse, x1 = undefined) {
         const iface = this.iface;
         if (iface == null)
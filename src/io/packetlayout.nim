@@ -0,0 +1,48 @@
+# Compile-time layout checks for packet serialization.
+#
+# A type is "flat" if the generic swrite would produce exactly its
+# in-memory representation: it consists of numbers, bools, chars, sets
+# and (arrays of) such, with no padding in between.  Enums are not flat,
+# because we send them as int.
+#
+# Flat values can be copied into and out of packets in one go, which is
+# what the generic object, array and seq overloads do for them.  Since
+# the bytes are the same either way, this does not affect the wire
+# format.
+
+{.push raises: [].}
+
+import std/macros
+
+proc flatExpr(t: NimNode): NimNode =
+  case t.typeKind
+  of ntyBool, ntyChar, ntyInt, ntyInt8, ntyInt16, ntyInt32, ntyInt64,
+      ntyUInt, ntyUInt8, ntyUInt16, ntyUInt32, ntyUInt64, ntyFloat,
+      ntyFloat32, ntyFloat64, ntySet:
+    return newLit(true)
+  of ntyDistinct:
+    return flatExpr(t.getTypeImpl()[0])
+  of ntyArray:
+    return flatExpr(t.getTypeImpl()[2])
+  of ntyObject:
+    let impl = t.getTypeImpl()
+    if impl.kind != nnkObjectTy or impl[1].kind != nnkEmpty:
+      return newLit(false) # inherited
+    var size: NimNode = newLit(0)
+    var res: NimNode = newLit(true)
+    for def in impl[2]:
+      if def.kind != nnkIdentDefs:
+        return newLit(false) # object variant
+      let ft = def[^2]
+      let flat = flatExpr(ft)
+      for i in 0 ..< def.len - 2:
+        size = quote do: `size` + sizeof(`ft`)
+      res = quote do: `res` and `flat`
+    return quote do: `res` and sizeof(`t`) == `size`
+  else:
+    return newLit(false)
+
+macro isFlat*(T: typedesc): bool =
+  return flatExpr(T.getTypeInst()[1])
+
+{.pop.} # raises: []
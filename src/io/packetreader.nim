@@ -4,6 +4,7 @@ import std/posix
 import std/tables
 
 import io/dynstream
+import io/packetlayout
 import types/color
 import types/opt
 
@@ -13,6 +14,12 @@ type
     bufIdx: int
     fds: seq[cint]
 
+  # A string or seq[char] in the packet, read without copying.  Only
+  # valid as long as the reader is.
+  PacketView* = object
+    p: ptr UncheckedArray[char]
+    len*: int
+
   PartialPacketReader* = object
     idx: int
     numFds: int
@@ -56,6 +63,10 @@ proc initReader*(stream: PosixStream; r: var PacketReader; len, nfds: int): bool
       return false
   true
 
+# Read a packet that is already in memory, minus the length fields.
+proc initPacketReader*(buffer: sink seq[uint8]): PacketReader =
+  return PacketReader(buffer: buffer)
+
 proc initPacketReader*(stream: PosixStream; r: var PacketReader): bool =
   var len {.noinit.}: array[2, int]
   if stream.readLoop(addr len[0], sizeof(len)).isErr:
@@ -159,7 +170,7 @@ proc sread*[T](r: var PacketReader; s: var set[T]) =
 proc sread*(r: var PacketReader; s: var string) =
   var len {.noinit.}: int
   r.sread(len)
-  s = newString(len)
+  s.setLen(len) # reuses the capacity of s
   if len > 0:
     r.readData(addr s[0], len)
 
@@ -177,30 +188,53 @@ proc sread*(r: var PacketReader; tup: var tuple) =
     r.sread(f)
 
 proc sread*[I; T](r: var PacketReader; a: var array[I, T]) =
-  for x in a.mitems:
-    r.sread(x)
+  when isFlat(T):
+    r.readData(addr a, sizeof(a))
+  else:
+    for x in a.mitems:
+      r.sread(x)
 
 proc sread*(r: var PacketReader; s: var seq[char]) =
   var len {.noinit.}: int
   r.sread(len)
-  s = newSeq[char](len)
+  s.setLen(len)
   if len > 0:
     r.readData(addr s[0], s.len)
 
 proc sread*[T](r: var PacketReader; s: var seq[T]) =
   var len {.noinit.}: int
   r.sread(len)
-  s = newSeq[T](len)
-  for x in s.mitems:
-    r.sread(x)
+  when isFlat(T):
+    s.setLen(len)
+    if len > 0:
+      r.readData(addr s[0], len * sizeof(T))
+  else:
+    s = newSeq[T](len)
+    for x in s.mitems:
+      r.sread(x)
+
+proc sread*(r: var PacketReader; v: var PacketView) =
+  var len {.noinit.}: int
+  r.sread(len)
+  assert r.bufIdx + len <= r.buffer.len
+  v = PacketView(len: len)
+  if len > 0:
+    v.p = cast[ptr UncheckedArray[char]](addr r.buffer[r.bufIdx])
+    r.bufIdx += len
+
+template toOpenArray*(v: PacketView): openArray[char] =
+  v.p.toOpenArray(0, v.len - 1)
 
 proc sread*[U; V](r: var PacketReader; t: var Table[U, V]) {.error.} =
   discard
 
 proc sread*(r: var PacketReader; obj: var object) =
-  obj = default(typeof(obj))
-  for f in obj.fields:
-    r.sread(f)
+  when isFlat(typeof(obj)):
+    r.readData(addr obj, sizeof(obj))
+  else:
+    obj = default(typeof(obj))
+    for f in obj.fields:
+      r.sread(f)
 
 proc sread*(r: var PacketReader; obj: var ref object) =
   var n: bool
@@ -11,6 +11,7 @@ import std/posix
 import std/tables
 
 import io/dynstream
+import io/packetlayout
 import types/color
 import types/opt
 
@@ -187,8 +188,11 @@ proc swrite*(w: var PacketWriter; tup: tuple) =
     w.swrite(f)
 
 proc swrite*[I, T](w: var PacketWriter; a: array[I, T]) =
-  for x in a:
-    w.swrite(x)
+  when isFlat(T):
+    w.writeData(unsafeAddr a, sizeof(a))
+  else:
+    for x in a:
+      w.swrite(x)
 
 proc swrite*(w: var PacketWriter; s: openArray[char]) =
   w.swrite(s.len)
@@ -197,15 +201,22 @@ proc swrite*(w: var PacketWriter; s: openArray[char]) =
 
 proc swrite*[T](w: var PacketWriter; s: openArray[T]) =
   w.swrite(s.len)
-  for x in s:
-    w.swrite(x)
+  when isFlat(T):
+    if s.len > 0:
+      w.writeData(unsafeAddr s[0], s.len * sizeof(T))
+  else:
+    for x in s:
+      w.swrite(x)
 
 proc swrite*[U, V](w: var PacketWriter; t: Table[U, V]) {.error.} =
   discard
 
 proc swrite*(w: var PacketWriter; obj: object) =
-  for f in obj.fields:
-    w.swrite(f)
+  when isFlat(typeof(obj)):
+    w.writeData(unsafeAddr obj, sizeof(obj))
+  else:
+    for f in obj.fields:
+      w.swrite(f)
 
 proc swrite*(w: var PacketWriter; obj: ref object) =
   w.swrite(obj != nil)
@@ -0,0 +1,143 @@
+# Single-producer, single-consumer byte ring in shared memory.
+#
+# The loader uses this to pass response bodies to buffers.  Instead of
+# pushing every page through a pipe, it copies the data into the ring,
+# and only writes to the pipe to wake up the reader if the latter is
+# waiting for data.  In turn, the reader only signals the writer
+# (through an eventfd) if the writer is waiting for room.
+
+{.push raises: [].}
+
+import std/posix
+
+import io/dynstream
+import utils/myposix
+
+export HasSharedRing
+
+const RingSize = 1 shl 18 # must be a power of two
+const RingHeaderSize = 64 # keeps the data cache-line aligned
+const RingMapSize = RingHeaderSize + RingSize
+
+type
+  RingHeader = object
+    head: uint64 # bytes written so far; only advanced by the writer
+    tail: uint64 # bytes read so far; only advanced by the reader
+    readerWaiting: uint32
+    writerWaiting: uint32
+
+  SharedRing* = ref object
+    header: ptr RingHeader
+    data: ptr UncheckedArray[uint8]
+    wake*: PosixStream # eventfd through which the reader wakes the writer
+
+proc mapRing(fd: cint; wake: PosixStream): SharedRing =
+  let p = mmap(nil, RingMapSize, PROT_READ or PROT_WRITE, MAP_SHARED, fd, 0)
+  if p == MAP_FAILED:
+    return nil
+  let data = cast[pointer](cast[uint](p) + RingHeaderSize)
+  return SharedRing(
+    header: cast[ptr RingHeader](p),
+    data: cast[ptr UncheckedArray[uint8]](data),
+    wake: wake
+  )
+
+# Create a ring on the writer side.  On success, memfd must be passed to
+# the reader along with a duplicate of ring.wake.
+proc newSharedRing*(memfd: var cint): SharedRing =
+  when HasSharedRing:
+    memfd = memfdCreate("cha-ring")
+    if memfd < 0:
+      return nil
+    let efd = eventfdCreate()
+    if efd < 0:
+      discard close(memfd)
+      return nil
+    let ring = if ftruncate(memfd, RingMapSize) == 0:
+      mapRing(memfd, newPosixStream(efd))
+    else:
+      nil
+    if ring == nil:
+      discard close(memfd)
+      discard close(efd)
+      return nil
+    ring.header.readerWaiting = 1 # the reader starts out waiting
+    return ring
+  else:
+    return nil
+
+# Map a ring received from the writer.  memfd is closed.
+proc openSharedRing*(memfd, efd: cint): SharedRing =
+  let ring = mapRing(memfd, newPosixStream(efd))
+  discard close(memfd)
+  if ring == nil:
+    discard close(efd)
+  return ring
+
+proc unmap*(ring: SharedRing) =
+  discard munmap(ring.header, RingMapSize)
+  ring.header = nil
+  ring.data = nil
+
+# Copy at most len bytes from p into the ring, and return the number of
+# bytes copied.  wake is set if the reader must be woken up.
+proc write*(ring: SharedRing; p: pointer; len: int; wake: var bool): int =
+  let h = ring.header
+  let head = h.head
+  let tail = atomicLoadN(addr h.tail, ATOMIC_ACQUIRE)
+  let n = min(len, RingSize - int(head - tail))
+  if n > 0:
+    let off = int(head and uint64(RingSize - 1))
+    let n1 = min(n, RingSize - off)
+    copyMem(addr ring.data[off], p, n1)
+    if n1 < n:
+      let src = cast[ptr UncheckedArray[uint8]](p)
+      copyMem(addr ring.data[0], addr src[n1], n - n1)
+    atomicStoreN(addr h.head, head + uint64(n), ATOMIC_SEQ_CST)
+    if atomicExchangeN(addr h.readerWaiting, 0u32, ATOMIC_SEQ_CST) != 0:
+      wake = true
+  return n
+
+# Called by the writer when the ring is full.  Returns false if the
+# reader has made room in the meantime; otherwise, the reader wakes us
+# through the eventfd once it does.
+proc waitWriter*(ring: SharedRing): bool =
+  let h = ring.header
+  atomicStoreN(addr h.writerWaiting, 1u32, ATOMIC_SEQ_CST)
+  if h.head - atomicLoadN(addr h.tail, ATOMIC_SEQ_CST) < RingSize:
+    atomicStoreN(addr h.writerWaiting, 0u32, ATOMIC_SEQ_CST)
+    return false
+  return true
+
+# Return the contiguous readable part of the ring.  It stays valid
+# until it is consumed.
+proc peek*(ring: SharedRing): tuple[p: ptr UncheckedArray[uint8]; len: int] =
+  let h = ring.header
+  let tail = h.tail
+  let head = atomicLoadN(addr h.head, ATOMIC_ACQUIRE)
+  let off = int(tail and uint64(RingSize - 1))
+  let len = min(int(head - tail), RingSize - off)
+  return (cast[ptr UncheckedArray[uint8]](addr ring.data[off]), len)
+
+# Free the first n readable bytes, and wake the writer if it is waiting
+# for room.
+proc consume*(ring: SharedRing; n: int) =
+  if n > 0:
+    let h = ring.header
+    atomicStoreN(addr h.tail, h.tail + uint64(n), ATOMIC_SEQ_CST)
+    if atomicExchangeN(addr h.writerWaiting, 0u32, ATOMIC_SEQ_CST) != 0:
+      var one = 1u64
+      discard ring.wake.write(addr one, sizeof(one))
+
+# Called by the reader when the ring is empty.  Returns false if data
+# has arrived in the meantime; otherwise, the writer wakes us through
+# the pipe once it arrives.
+proc waitReader*(ring: SharedRing): bool =
+  let h = ring.header
+  atomicStoreN(addr h.readerWaiting, 1u32, ATOMIC_SEQ_CST)
+  if atomicLoadN(addr h.head, ATOMIC_SEQ_CST) != h.tail:
+    atomicStoreN(addr h.readerWaiting, 0u32, ATOMIC_SEQ_CST)
+    return false
+  return true
+
+{.pop.} # raises: []
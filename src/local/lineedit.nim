@@ -155,12 +155,12 @@ proc generateOutput*(edit: LineEdit; hlcolor: CellColor): FixedGrid =
   result = newFixedGrid(edit.promptw + edit.maxwidth + 1, 1)
   var x = 0
   for u in edit.prompt.points:
-    result[x].str.addUTF8(u)
+    result[x].addText(u)
     x += u.width()
     if x >= result.width: break
   for i in 0 ..< edit.padding:
     if x < result.width:
-      result[x].str = " "
+      result[x].setText(uint32(' '))
       inc x
   var i = edit.shifti
   let selectStart = edit.selectStart
@@ -179,12 +179,11 @@ proc generateOutput*(edit: LineEdit; hlcolor: CellColor): FixedGrid =
       break
     if not edit.hide:
       if u.isControlChar():
-        result[x].str = u.controlToVisual()
+        result[x].setControl(u)
       else:
-        for j in pi ..< i:
-          result[x].str &= edit.text[j]
+        result[x].addText(edit.text.toOpenArray(pi, i - 1))
     else:
-      result[x].str &= '*'
+      result[x].addText(uint32('*'))
     result[x].format = format
     x += w
 
@@ -171,6 +171,18 @@ proc surfaceSize(pager: Pager; t: SurfaceType): tuple[w, h: int] =
   of stDisplay: return (pager.bufWidth, pager.bufHeight)
   of stStatus: return (pager.attrs.width, 1)
 
+# The window attributes buffers see: the screen minus the status line.
+# (The fork server preparses sheets with these too, so that they match
+# the cached ones.)
+proc bufferAttrs(pager: Pager): WindowAttributes =
+  result = pager.attrs
+  result.height -= 1
+  result.heightPx -= result.ppl
+
+# The user style sheet of buffers, before siteconf adds to it.
+proc bufferUserStyle(pager: Pager): string =
+  return pager.config{"userStyle"} & '\n'
+
 proc clear(pager: Pager; t: SurfaceType) =
   let (w, h) = pager.surfaceSize(t)
   pager.surfaces[t] = Surface(
@@ -536,6 +548,8 @@ proc run*(pager: Pager; pages: openArray[JSValue]; contentType: string;
   if sr.isErr:
     return
   pager.attrs = pager.term.attrs
+  pager.forkserver.warmSheetCache(pager.bufferAttrs, pager.config{"scripting"},
+    pager.config{"headless"}, pager.bufferUserStyle)
   for st in SurfaceType:
     pager.clear(st)
   pager.addConsole2(istream != nil)
@@ -577,20 +591,19 @@ proc writeStatusMessage(status: var Surface; str: string; format = Format();
     if u.isControlChar():
       if u == uint32('\t'):
         while w > 0:
-          status.grid[x].str = " "
+          status.grid[x].setText(uint32(' '))
           status.grid[x].format = format
           inc x
           dec w
         continue
-      status.grid[x].str = u.controlToVisual()
+      status.grid[x].setControl(u)
     else:
-      status.grid[x].str = u.toUTF8()
+      status.grid[x].setText(u)
     status.grid[x].format = format
     let nx = x + w
     inc x
     while x < nx: # clear unset cells
-      status.grid[x].str = ""
-      status.grid[x].format = Format()
+      status.grid[x] = FixedCell()
       inc x
   result = x
   while x < e:
@@ -951,6 +964,13 @@ proc needsRedraw(pager: Pager; iface: BufferInterface): bool =
 proc draw(pager: Pager): bool =
   let term = pager.term
   let iface = pager.bufferIface
+  if cellStringsFull():
+    # Drop the cell strings that no grid refers to anymore.
+    startCellStrings()
+    for it in pager.surfaces.mitems:
+      it.grid.cells.keepCellStrings()
+    term.keepCellStrings()
+    finishCellStrings()
   let redraw = pager.needsRedraw(iface)
   if redraw:
     # Note: lack of redraw does not necessarily mean that we send nothing to
@@ -1026,6 +1046,8 @@ proc initBuffer(pager: Pager; bufferConfig: BufferConfig;
     contentType, filterCmd: string; title = ""; redirectDepth = 0;
     flags: set[BufferInitFlag] = {}; charsetStack: seq[Charset] = @[]):
     BufferInit =
+  # top-level documents go before anything their buffers might load
+  request.priority = rpNavigate
   let stream = pager.loader.startRequest(request, loaderConfig)
   if stream == nil:
     pager.alert("failed to start request for " & $request.url)
@@ -1177,7 +1199,7 @@ proc applySiteconf(pager: Pager; url: URL; charsetOverride: Charset;
     cookieJarId: var string; filterCmd: var string): BufferConfig =
   let ctx = pager.jsctx
   result = BufferConfig(
-    userStyle: pager.config{"userStyle"} & '\n',
+    userStyle: pager.bufferUserStyle,
     refererFrom: pager.config{"refererFrom"},
     scripting: pager.config{"scripting"},
     charsets: pager.config{"documentCharset"},
@@ -2238,6 +2260,13 @@ jsClassDef(Pager):
   proc osc52Primary(pager: Pager): bool {.jsfget.} =
     pager.term.osc52Primary
 
+  # Bytes output to the terminal by the last draw, and in total.
+  proc frameBytes(pager: Pager): int {.jsfget.} =
+    pager.term.frameBytes
+
+  proc bytesWritten(pager: Pager): int {.jsfget.} =
+    pager.term.bytesWritten
+
   # The maximum number we are willing to accept.
   # This should be fine for 32-bit signed ints (which precnum currently is).
   const MaxPrecNum = 100000000
@@ -2664,10 +2693,7 @@ jsClassDef(Pager):
       bcrCancel
     else:
       # buffer now actually exists; create a process for it
-      var attrs = pager.attrs
-      # subtract status line height
-      attrs.height -= 1
-      attrs.heightPx -= attrs.ppl
+      let attrs = pager.bufferAttrs
       var url = init.url
       if url.username != "" or url.password != "":
         url = newURL(url)
@@ -2700,9 +2726,12 @@ jsClassDef(Pager):
         # pager ref too.
         discard loader.shareCachedItem(init.cacheId, loader.clientPid)
       var outCacheId = init.cacheId
+      var ring = (memfd: cint(-1), efd: cint(-1))
       if not redirected:
         discard loader.shareCachedItem(init.cacheId, pid)
         if istreamOutputId != -1:
+          if pager.config{"sharedMemoryTransport"}:
+            ring = loader.shareOutput(istreamOutputId)
           loader.resume(istreamOutputId)
       else:
         outCacheId = loader.addCacheFile(init.ostreamOutputId)
@@ -2717,6 +2746,13 @@ jsClassDef(Pager):
         w.sendFd(cstream.fd)
         # pass down ostream
         w.sendFd(ostream.fd)
+        w.swrite(ring.memfd != -1)
+        if ring.memfd != -1:
+          w.sendFd(ring.memfd)
+          w.sendFd(ring.efd)
+      if ring.memfd != -1:
+        discard close(ring.memfd)
+        discard close(ring.efd)
       let iface = pager.addInterface(init, stream, newProcessHandle(pid))
       if iface == nil:
         return JS_ThrowOutOfMemory(ctx)
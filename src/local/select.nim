@@ -117,12 +117,12 @@ proc drawBorders(display: var FixedGrid; sx, ex, sy, ey: int;
     var x = 0
     let yi = y * display.width
     while true:
-      if display[yi + x].str == "":
-        display[yi + x].str = " "
-      let w = display[yi + x].str.width()
+      if display[yi + x].isEmpty:
+        display[yi + x].setText(uint32(' '))
+      let w = display[yi + x].width()
       if x + w > sx:
         while x < sx:
-          display[yi + x].str = " "
+          display[yi + x].setText(uint32(' '))
           inc x
         break
       x += w
@@ -132,30 +132,34 @@ proc drawBorders(display: var FixedGrid; sx, ex, sy, ey: int;
   let bl = if downmore: bdcVerticalBarLeft else: bdcCornerBottomLeft
   let br = if downmore: bdcVerticalBarRight else: bdcCornerBottomRight
   const fmt = Format()
-  display[sy * display.width + sx].str = $tl
-  display[sy * display.width + ex].str = $tr
-  display[ey * display.width + sx].str = $bl
-  display[ey * display.width + ex].str = $br
+  display[sy * display.width + sx].setText($tl)
+  display[sy * display.width + ex].setText($tr)
+  display[ey * display.width + sx].setText($bl)
+  display[ey * display.width + ex].setText($br)
   display[sy * display.width + sx].format = fmt
   display[sy * display.width + ex].format = fmt
   display[ey * display.width + sx].format = fmt
   display[ey * display.width + ex].format = fmt
   # Draw top, bottom borders.
-  let ups = if upmore: " " else: $bdcHorizontalBarTop
-  let downs = if downmore: " " else: $bdcHorizontalBarBottom
+  var upc = FixedCell(text: uint32(' '))
+  var downc = FixedCell(text: uint32(' '))
+  if not upmore:
+    upc.setText($bdcHorizontalBarTop)
+  if not downmore:
+    downc.setText($bdcHorizontalBarBottom)
   for x in sx + 1 .. ex - 1:
-    display[sy * display.width + x].str = ups
-    display[ey * display.width + x].str = downs
+    display[sy * display.width + x].text = upc.text
+    display[ey * display.width + x].text = downc.text
     display[sy * display.width + x].format = fmt
     display[ey * display.width + x].format = fmt
   if upmore:
-    display[sy * display.width + sx + (ex - sx) div 2].str = ":"
+    display[sy * display.width + sx + (ex - sx) div 2].setText(uint32(':'))
   if downmore:
-    display[ey * display.width + sx + (ex - sx) div 2].str = ":"
+    display[ey * display.width + sx + (ex - sx) div 2].setText(uint32(':'))
   # Draw left, right borders.
   for y in sy + 1 .. ey - 1:
-    display[y * display.width + sx].str = $bdcVerticalBarLeft
-    display[y * display.width + ex].str = $bdcVerticalBarRight
+    display[y * display.width + sx].setText($bdcVerticalBarLeft)
+    display[y * display.width + ex].setText($bdcVerticalBarRight)
     display[y * display.width + sx].format = fmt
     display[y * display.width + ex].format = fmt
 
@@ -200,23 +204,21 @@ proc drawSelect*(select: Select; display: var FixedGrid) =
       let nx = x + uw
       if nx > ex:
         break
-      display[dls + x].str = ""
       if u.isControlChar():
-        display[dls + x].str &= u.controlToVisual()
+        display[dls + x].setControl(u)
       else:
-        for l in pj ..< j:
-          display[dls + x].str &= select.options[i].s[l]
+        display[dls + x].setText(select.options[i].s.toOpenArray(pj, j - 1))
       display[dls + x].format = format
       if x == sx:
         # do not reverse the position of the cursor
         display[dls + x].format.excl(ffReverse)
       inc x
       while x < nx:
-        display[dls + x].str = ""
+        display[dls + x].text = 0
         display[dls + x].format = format
         inc x
     while x < ex:
-      display[dls + x].str = " "
+      display[dls + x].setText(uint32(' '))
       display[dls + x].format = format
       inc x
 
@@ -112,7 +112,7 @@ type
     n: int # bytes of s already flushed
     next: TerminalPage
 
-  TermdescFlag = enum # 16 bits, 1 free
+  TermdescFlag = enum # 32 bits, 14 free
     tfTitle # can set window title
     tfPreEcma48 # does not support ECMA-48/VT100-like queries (DA1 etc.)
     tfXtermQuery # supports XTerm-like queries (background color etc.)
@@ -129,6 +129,8 @@ type
     tfFlowControl # uses XON/XOFF flow control (usually hardware terminals)
     tfScroll # supports VT100-style scroll (with scroll area)
     tfFastScroll # has SD/SU control sequences
+    tfErase # has ECH (erase character)
+    tfRepeat # has REP (repeat preceding character)
 
   Termdesc = set[TermdescFlag]
 
@@ -142,7 +144,8 @@ type
     canvasImagesHead: CanvasImage
     canvas: seq[FixedCell]
     kittyImagesToClear: seq[uint] # Kitty only; vector of image ids
-    lineDamage: seq[int]
+    lineDamage: seq[int] # first x of each line that may have changed
+    drawn: seq[FixedCell] # what we last painted on the screen
     title: string # current title
     pos: tuple[pid, x, y: int]
     scrollTodo: int # lines to scroll (negative = up, positive = down)
@@ -191,6 +194,10 @@ type
     sixelRegisterNum*: uint16
     kittyId: uint # counter for kitty image (*not* placement) ids.
     colorMap: array[16, RGBColor]
+    lineBuf: seq[FixedCell] # temp buffer for the line being drawn
+    lineEnd: int # start of the part of lineBuf cleared by EL
+    bytesWritten*: int # total bytes queued for output
+    frameBytes*: int # bytes queued by the last draw
 
   QueryState = enum
     qsBackgroundColor, qsForegroundColor, qsXtermAllowedOps, qsXtermWindowOps,
@@ -348,9 +355,13 @@ const StateMap = [
 #
 # Note: we intentionally do not include tfPrimary here, because some poorly
 # written terminals choke on it despite advertising themselves as XTerm.
+#
+# REP is not included either; it is fairly new, and emulators that don't
+# know it print garbage.  So we only set tfRepeat for those we know to
+# handle it.
 const XtermCompatible = {
   tfTitle, tfXtermQuery, tfAltScreen, tfSpecialGraphics, tfMouse,
-  tfBracketedPaste, tfScroll, tfFastScroll
+  tfBracketedPaste, tfScroll, tfFastScroll, tfErase
 }
 
 # This for hardware terminals, *not* VT100-compatible emulators.
@@ -366,28 +377,28 @@ const TrueColorFlag = {tfColor1, tfColor2}
 
 const TermdescMap = [
   ttAdm3a: {tfMargin, tfPreEcma48},
-  ttAlacritty: XtermCompatible + TrueColorFlag,
-  ttContour: XtermCompatible,
+  ttAlacritty: XtermCompatible + TrueColorFlag + {tfRepeat},
+  ttContour: XtermCompatible + {tfRepeat},
   ttDvtm: {tfAltScreen, tfBleedsAPC, tfBracketedPaste} + AnsiColorFlag,
   ttEat: XtermCompatible + TrueColorFlag,
   # eterm bleeds titles.
   ttEterm: {tfXtermQuery, tfBracketedPaste, tfScroll} + AnsiColorFlag,
   ttFbterm: {tfXtermQuery, tfBracketedPaste} + AnsiColorFlag,
-  ttFoot: XtermCompatible,
+  ttFoot: XtermCompatible + {tfRepeat},
   # FreeBSD has code to respond to queries, but it's #if 0'd out :(
   # It has no bracketed paste (duh).
-  ttFreebsd: {tfPreEcma48, tfScroll} + AnsiColorFlag,
-  ttGhostty: XtermCompatible,
+  ttFreebsd: {tfPreEcma48, tfScroll, tfErase} + AnsiColorFlag,
+  ttGhostty: XtermCompatible + {tfRepeat},
   ttIterm2: XtermCompatible,
-  ttKitty: XtermCompatible + TrueColorFlag + {tfPrimary},
+  ttKitty: XtermCompatible + TrueColorFlag + {tfPrimary, tfRepeat},
   ttKonsole: XtermCompatible,
   # Linux accepts true color or eight bit sequences, but as per the
   # man page they are "shoehorned into 16 colors".  This breaks color
   # correction, so we stick to ANSI.
   # It also fails to advertise ANSI color in DA1, so we set it here.
   # Linux has no alt screen, and no paste (let alone bracketed).
-  ttLinux: {tfXtermQuery, tfScroll} + AnsiColorFlag,
-  ttMintty: XtermCompatible + TrueColorFlag,
+  ttLinux: {tfXtermQuery, tfScroll, tfErase} + AnsiColorFlag,
+  ttMintty: XtermCompatible + TrueColorFlag + {tfRepeat},
   ttMlterm: XtermCompatible + TrueColorFlag,
   ttMsTerminal: XtermCompatible + TrueColorFlag,
   ttPutty: XtermCompatible + TrueColorFlag,
@@ -403,7 +414,7 @@ const TermdescMap = [
   ttSyncterm: XtermCompatible + TrueColorFlag + {tfMargin},
   ttTerminology: XtermCompatible + {tfBleedsAPC},
   # Scrolling on tmux destroys images.
-  ttTmux: XtermCompatible + TrueColorFlag - {tfScroll},
+  ttTmux: XtermCompatible + TrueColorFlag + {tfRepeat} - {tfScroll},
   # Direct color in urxvt is not really true color; apparently it
   # just takes the nearest color of the 256 registers and replaces it
   # with the direct color given.  I don't think this is much worse than
@@ -412,13 +423,13 @@ const TermdescMap = [
   ttVertigo: XtermCompatible + TrueColorFlag,
   ttVt100: Vt100Compatible,
   ttVt100Nav: Vt100Compatible,
-  ttVt420: Vt100Compatible + {tfFastScroll},
+  ttVt420: Vt100Compatible + {tfFastScroll, tfErase},
   ttVt52: {tfPreEcma48, tfFlowControl},
-  ttVte: XtermCompatible + TrueColorFlag,
-  ttWezterm: XtermCompatible,
+  ttVte: XtermCompatible + TrueColorFlag + {tfRepeat},
+  ttWezterm: XtermCompatible + {tfRepeat},
   ttWterm: XtermCompatible + TrueColorFlag,
   ttXst: XtermCompatible + TrueColorFlag,
-  ttXterm: XtermCompatible,
+  ttXterm: XtermCompatible + {tfRepeat},
   # yaft supports Sixel, but can't tell us so in DA1.
   ttYaft: XtermCompatible + {tfSixel, tfBleedsAPC} -
     {tfAltScreen, tfFastScroll},
@@ -548,6 +559,7 @@ proc swapFrame(term: Terminal; frameType: FrameType) =
     term.frame.tail = move(term.frames[ftNext].tail)
     swap(term.frame.canvas, term.frames[ot].canvas)
     swap(term.frame.lineDamage, term.frames[ot].lineDamage)
+    swap(term.frame.drawn, term.frames[ot].drawn)
     swap(term.frame.kittyImagesToClear, term.frames[ot].kittyImagesToClear)
     # could swap this too, but that would keep data alive for longer than
     # desirable
@@ -561,6 +573,7 @@ proc swapFrame(term: Terminal; frameType: FrameType) =
     term.frame.tail = nil
     for i in 0 ..< term.frames[ot].canvas.len:
       term.frame.canvas[i] = term.frames[ot].canvas[i]
+      term.frame.drawn[i] = term.frames[ot].drawn[i]
     chaArrayCopy(term.frame.lineDamage, term.frames[ot].lineDamage)
     #TODO we could avoid some allocations here by reusing CanvasImage
     # objects from the frame to be dropped
@@ -589,6 +602,12 @@ proc swapFrame(term: Terminal; frameType: FrameType) =
   term.frame.specialGraphics = term.frames[ot].specialGraphics
   term.frame.cursorHidden = term.frames[ot].cursorHidden
 
+# Move the cells of both frames to a new generation of cell strings.
+proc keepCellStrings*(term: Terminal) =
+  for frame in term.frames.mitems:
+    frame.canvas.keepCellStrings()
+    frame.drawn.keepCellStrings()
+
 # Must be called at the start of draw().
 proc initFrame*(term: Terminal) =
   if term.frame.tail != nil:
@@ -642,6 +661,7 @@ const BufferSize = 4096
 proc write(term: Terminal; s: openArray[char]): Opt[void] =
   if s.len <= 0:
     return ok()
+  term.bytesWritten += s.len
   if s.len <= BufferSize: # merge small writes
     let tail = term.frame.tail
     if tail != nil and tail.a.len + s.len > BufferSize:
@@ -1243,18 +1263,21 @@ proc areadEvent*(term: Terminal): Opt[InputEvent] =
   of eprWindowChange: return ok(InputEvent(t: ietWindowChange))
   of eprRedraw: return ok(InputEvent(t: ietRedraw))
 
+# Last line the cursor can move to with a line feed; on this line, LF
+# scrolls instead.
+proc lastLine(term: Terminal): uint32 =
+  if term.frame.scrollBottom < 0:
+    return uint32(term.attrs.height - 1)
+  return uint32(term.frame.scrollBottom - 1)
+
 proc cursorNextLineBegin(term: Terminal): Opt[void] =
-  let ocursory = term.frame.cursory
-  if term.frame.scrollBottom < 0 and ocursory + 1 < uint32(term.attrs.width) or
-      ocursory < uint32(term.frame.scrollBottom):
+  if term.frame.cursory < term.lastLine():
     inc term.frame.cursory
   term.frame.cursorx = 0
   term.write("\r\n")
 
 proc cursorNextLine*(term: Terminal): Opt[void] =
-  let ocursory = term.frame.cursory
-  if term.frame.scrollBottom < 0 and ocursory + 1 < uint32(term.attrs.width) or
-      ocursory < uint32(term.frame.scrollBottom):
+  if term.frame.cursory < term.lastLine():
     inc term.frame.cursory
   term.write('\n')
 
@@ -1280,6 +1303,19 @@ proc cursorGoto(term: Terminal; x, y: uint32): Opt[void] =
     for u in term.frame.cursory ..< y:
       ?term.cursorNextLine()
     return ok()
+  if term.frame.cursorKnown and term.frame.cursory == y and
+      term.frame.cursorx < uint32(term.attrs.width) and
+      term.termType notin {ttAdm3a, ttVt52}:
+    # Moving on the same line; CUF/CUB is shorter than CUP.
+    # (If cursorx is past the last column, the terminal may be waiting to
+    # wrap, so we can't move relative to it.)
+    let c = if x > term.frame.cursorx: 'C' else: 'D'
+    let n = if x > term.frame.cursorx: x - term.frame.cursorx
+      else: term.frame.cursorx - x
+    term.frame.cursorx = x
+    if n == 1:
+      return term.write(CSI & c)
+    return term.write(CSI & $n & c)
   term.frame.cursorx = x
   term.frame.cursory = y
   term.frame.cursorKnown = true
@@ -1299,6 +1335,7 @@ proc cursorHome(term: Terminal): Opt[void] =
     return term.cursorGoto(0, 0)
   term.frame.cursorx = 0
   term.frame.cursory = 0
+  term.frame.cursorKnown = true
   term.write(CSI & 'H')
 
 proc unsetCursorPos(term: Terminal) =
@@ -1693,35 +1730,219 @@ proc moveLinesUp(term: Terminal; n: int): Opt[void] =
 proc moveLinesDown(term: Terminal; n: int): Opt[void] =
   term.write(CSI & $n & 'T')
 
-proc processCell(term: Terminal; cell: FixedCell; x: int): Opt[void] =
-  if cell.str.len == 0:
-    return ok()
-  # if previous cell was empty, catch up with x
-  let x = uint32(x)
-  while term.frame.cursorx < x:
-    ?term.write(' ')
-    inc term.frame.cursorx
-  ?term.processFormat(cell.format)
-  term.processOutputString(cell.str)
-
-proc drawLine(term: Terminal; sx, y: int): Opt[void] =
-  for x in sx ..< term.attrs.width:
-    ?term.processCell(term.frame.canvas[y * term.attrs.width + x], x)
-  if term.frame.cursorx < uint32(term.attrs.width):
-    ?term.processFormat(Format())
-    ?term.clearEnd()
+# Cell-based repaint.
+#
+# lineBuf is set to what a line should look like on the screen, and then
+# diffed against the cells we last painted there (drawn).  Only changed
+# cells are output, and between changes we either move the cursor or
+# re-print the cells in between, whichever is shorter.  Blank runs may be
+# erased with EL/ECH, and runs of the same ASCII character repeated with
+# REP.
+#
+# drawn may contain two special values: UnknownCell for cells we must
+# repaint regardless (e.g. because an image was painted over them), and
+# WideCell for the cells covered by a double-width character.
+const UnknownCell = FixedCell(text: uint32.high)
+const WideCell = FixedCell(text: uint32.high - 1)
+const BlankCell = FixedCell(text: uint32(' '))
+
+# Make sure the next draw repaints the cells of line y starting from x.
+proc invalidate(term: Terminal; x, y: int) =
+  let si = y * term.attrs.width
+  var x = x
+  while x > 0 and x < term.attrs.width and
+      term.frame.drawn[si + x] == WideCell:
+    dec x
+  term.frame.lineDamage[y] = min(term.frame.lineDamage[y], x)
+  for i in si + x ..< si + term.attrs.width:
+    term.frame.drawn[i] = UnknownCell
+
+# Compute the screen contents of line y into lineBuf.
+# Empty cells are filled with spaces in the format of the preceding cell
+# (or the default format at the start of the line), and the rest of the
+# line after the last non-empty cell is cleared with EL.
+proc computeLine(term: Terminal; y: int) =
+  let w = term.attrs.width
+  let si = y * w
+  var cx = 0
+  var format = Format()
+  for x in 0 ..< w:
+    let cell = term.frame.canvas[si + x]
+    if cell.isEmpty:
+      continue
+    while cx < x:
+      term.lineBuf[cx] = FixedCell(text: uint32(' '), format: format)
+      inc cx
+    if cx >= w:
+      break
+    term.lineBuf[cx] = cell
+    format = cell.format
+    let ex = min(cx + cell.width(), w)
+    for i in cx + 1 ..< ex:
+      term.lineBuf[i] = WideCell
+    cx = max(ex, cx)
+  term.lineEnd = cx
+  for x in cx ..< w:
+    term.lineBuf[x] = FixedCell()
+
+# Return the first cell starting from sx that must be repainted, or
+# width if there is none.
+proc findChange(term: Terminal; sx, y: int): int =
+  let w = term.attrs.width
+  let si = y * w
+  var x = sx
+  while x < w and term.lineBuf[x] == term.frame.drawn[si + x]:
+    inc x
+  if x < w:
+    # we can't print the second half of a double-width char
+    while x > 0 and (term.lineBuf[x] == WideCell or
+        term.frame.drawn[si + x] == WideCell):
+      dec x
+  x
+
+proc digitCount(n: int): int =
+  result = 1
+  var n = n
+  while n >= 10:
+    n = n div 10
+    inc result
+
+# Length of a CSI sequence with a single numeric parameter n, which is
+# omitted if it equals 1.
+proc csiLen(n: int): int =
+  if n == 1:
+    return 3
+  return 3 + digitCount(n)
+
+proc colorSGRLen(c: CellColor): int =
+  case c.t
+  of ctNone: return 5
+  of ctANSI: return if uint8(c.ansi) < 16: 5 else: 10
+  of ctRGB: return 19
+
+# Approximate length of what processFormat outputs to switch from a to b.
+proc formatLen(a, b: Format): int =
+  result = 0
+  if a.flags != b.flags:
+    result += 3 + card((a.flags - b.flags) + (b.flags - a.flags)) * 3
+  if a.fgcolor != b.fgcolor:
+    result += colorSGRLen(b.fgcolor)
+  if a.bgcolor != b.bgcolor:
+    result += colorSGRLen(b.bgcolor)
+
+# Return true if printing the unchanged cells x ..< nx again is shorter
+# than moving the cursor to nx.  Expects the cursor to be at x.
+proc rewriteIsShorter(term: Terminal; x, nx: int): bool =
+  let next = term.lineBuf[nx].format
+  var moveLen = term.frame.format.formatLen(next)
+  if term.termType in {ttAdm3a, ttVt52}:
+    moveLen += 4
+  else:
+    moveLen += csiLen(nx - x)
+  var format = term.frame.format
+  var n = 0
+  for i in x ..< nx:
+    let cell = term.lineBuf[i]
+    if cell == WideCell:
+      continue
+    n += format.formatLen(cell.format)
+    format = cell.format
+    cell.withText s:
+      n += s.len
+    if n >= moveLen:
+      return false
+  n + format.formatLen(next) < moveLen
+
+# Paint the cells of lineBuf that differ from drawn, starting from sx.
+# cy is the line on the screen we paint to, which differs from y while
+# scrolling.
+proc paintLine(term: Terminal; sx, y, cy: int): Opt[void] =
+  let w = term.attrs.width
+  let si = y * w
+  var last = w - 1 # last change
+  while last >= sx and term.lineBuf[last] == term.frame.drawn[si + last]:
+    dec last
+  var x = sx
+  var rewriteTo = 0 # cells before this are re-printed even if unchanged
+  while x <= last:
+    if x >= term.lineEnd:
+      # only blanks from here on
+      ?term.cursorGoto(x, cy)
+      ?term.processFormat(Format())
+      ?term.clearEnd()
+      for i in x ..< w:
+        term.frame.drawn[si + i] = term.lineBuf[i]
+      break
+    let cell = term.lineBuf[x]
+    if x >= rewriteTo and
+        (cell == term.frame.drawn[si + x] or cell == WideCell):
+      var nx = x + 1
+      while nx <= last and nx < term.lineEnd and
+          (term.lineBuf[nx] == term.frame.drawn[si + nx] or
+          term.lineBuf[nx] == WideCell):
+        inc nx
+      if nx > last:
+        break
+      let cursorHere = term.frame.cursorKnown and
+        term.frame.cursorx == uint32(x) and term.frame.cursory == uint32(cy)
+      if nx >= term.lineEnd or not cursorHere or
+          not term.rewriteIsShorter(x, nx):
+        x = nx
+        continue
+      rewriteTo = nx
+    if cell == WideCell:
+      inc x
+      continue
+    ?term.cursorGoto(x, cy)
+    ?term.processFormat(cell.format)
+    var n = max(cell.width(), 1) # number of cells painted
+    let ascii = cell.text in 0x20u32 .. 0x7Eu32
+    let canRepeat = ascii and tfRepeat in term.desc
+    let canErase = cell == BlankCell and tfErase in term.desc
+    if canRepeat or canErase:
+      var m = 1
+      while x + m < term.lineEnd and term.lineBuf[x + m] == cell:
+        inc m
+      var printLen = m
+      if canRepeat:
+        printLen = min(m, 1 + csiLen(m - 1))
+      # ECH does not move the cursor, so count moving it too
+      if canErase and csiLen(m) * 2 < printLen:
+        ?term.write(CSI & $m & 'X')
+        n = m
+      else:
+        cell.withText s:
+          ?term.processOutputString(s)
+        if m > 1 and printLen < m:
+          ?term.write(CSI & $(m - 1) & 'b')
+          term.frame.cursorx += uint32(m - 1)
+          n = m
+    else:
+      cell.withText s:
+        ?term.processOutputString(s)
+    for i in x ..< min(x + n, w):
+      term.frame.drawn[si + i] = term.lineBuf[i]
+    x += n
+  term.frame.lineDamage[y] = w
+  ok()
+
+proc drawLine(term: Terminal; sx, y: int; cy = y): Opt[void] =
+  term.computeLine(y)
+  let x = term.findChange(sx, y)
+  if x < term.attrs.width:
+    return term.paintLine(x, y, cy)
   term.frame.lineDamage[y] = term.attrs.width
   ok()
 
 proc fullDraw(term: Terminal): Opt[void] =
   ?term.hideCursor()
   ?term.resetScrollArea()
+  ?term.resetFormat()
   ?term.cursorHome()
   ?term.clearDisplay()
-  ?term.resetFormat()
+  for cell in term.frame.drawn.mitems:
+    cell = FixedCell()
   for y in 0 ..< term.attrs.height:
-    if y != 0:
-      ?term.cursorNextLineBegin()
     ?term.drawLine(0, y)
   ok()
 
@@ -1748,13 +1969,13 @@ proc partialDrawScroll(term: Terminal; scroll, scrollBottom: int;
     ?term.cursorHome()
     for i in countdown(0, scroll + 1):
       ?term.cursorPrevLineBegin()
-      ?term.drawLine(0, i - scroll - 1)
+      ?term.drawLine(0, i - scroll - 1, cy = 0)
     return term.cursorLineBegin()
   # scroll down
   ?term.cursorGoto(0, scrollBottom - 1)
   for i in 0 ..< scroll:
     ?term.cursorNextLineBegin()
-    ?term.drawLine(0, scrollBottom - scroll + i)
+    ?term.drawLine(0, scrollBottom - scroll + i, cy = scrollBottom - 1)
   term.cursorHome()
 
 proc partialDraw(term: Terminal; scrollBottom: int; bgcolor: CellColor):
@@ -1764,15 +1985,16 @@ proc partialDraw(term: Terminal; scrollBottom: int; bgcolor: CellColor):
     ?term.hideCursor()
     ?term.partialDrawScroll(scroll, scrollBottom, bgcolor)
   for y in 0 ..< term.attrs.height:
-    # set cx to x of the first change
     let cx = term.frame.lineDamage[y]
-    # w will track the current position on screen
     if cx >= term.attrs.width:
       continue
-    ?term.hideCursor()
-    ?term.resetScrollArea()
-    ?term.cursorGoto(cx, y)
-    ?term.drawLine(cx, y)
+    term.computeLine(y)
+    let x = term.findChange(cx, y)
+    if x < term.attrs.width:
+      ?term.hideCursor()
+      ?term.resetScrollArea()
+      ?term.paintLine(x, y, y)
+    term.frame.lineDamage[y] = term.attrs.width
   ok()
 
 proc writeGrid*(term: Terminal; grid: FixedGrid; x = 0, y = 0) =
@@ -1781,14 +2003,14 @@ proc writeGrid*(term: Terminal; grid: FixedGrid; x = 0, y = 0) =
     for lx in x ..< x + grid.width:
       let i = ly * term.attrs.width + lx
       let cell = grid[(ly - y) * grid.width + (lx - x)]
-      if term.frame.canvas[i].str != "":
+      if not term.frame.canvas[i].isEmpty:
         # if there is a change, we have to start from the last x with
         # a string (otherwise we might overwrite half of a double-width char)
         lastx = lx
       let format = term.reduceFormat(cell.format)
       if format != term.frame.canvas[i].format or
-          cell.str != term.frame.canvas[i].str:
-        term.frame.canvas[i].str = cell.str
+          cell.text != term.frame.canvas[i].text:
+        term.frame.canvas[i].text = cell.text
         term.frame.canvas[i].format = format
         term.frame.lineDamage[ly] = min(term.frame.lineDamage[ly], lastx)
 
@@ -1968,7 +2190,7 @@ proc clearImage(term: Terminal; image: CanvasImage; maxh: int) =
     let ey = min(image.dims.y + h, maxh)
     let x = max(image.dims.x, 0)
     for y in max(image.dims.y, 0) ..< ey:
-      term.frame.lineDamage[y] = min(term.frame.lineDamage[y], x)
+      term.invalidate(x, y)
   of imKitty:
     if image.kittyId != 0:
       term.frame.kittyImagesToClear.add(image.kittyId)
@@ -1998,21 +2220,23 @@ proc checkImageDamage(term: Terminal; image: CanvasImage; maxw, maxh: int) =
       continue
     image.damaged = true
     if od < x:
+      if image.transparent:
+        # text under the image is visible, so repaint it
+        term.invalidate(x, y)
       continue
     # If eypx is less than y * ppl, that means it only partially covers
     # the last line on the screen which it is painted to.  Therefore we must
     # treat it as transparent here.
     # A similar situation arises when od is on the last covered column.
     if image.transparent or eypx < y * ppl or od in mx0 ..< mx:
-      term.frame.lineDamage[y] = x
+      term.invalidate(x, y)
     else:
       var textFound = false
       # damage starts inside an opaque image; skip clear (but only if
       # the damage was not caused by a printing character)
       let si = y * term.attrs.width
       for i in si + od ..< si + term.attrs.width:
-        if term.frame.canvas[i].str.len > 0 and
-            term.frame.canvas[i].str[0] != ' ':
+        if term.frame.canvas[i].isPrinting:
           textFound = true
           break
       if not textFound:
@@ -2260,8 +2484,9 @@ proc scrollUp*(term: Terminal; n, scrollBottom: int) =
       let i = y * term.attrs.width + x
       let j = (y + n) * term.attrs.width + x
       term.frame.canvas[j] = move(term.frame.canvas[i])
+      term.frame.drawn[j] = term.frame.drawn[i]
   for y in 0 ..< n:
-    term.frame.lineDamage[y] = 0
+    term.invalidate(0, y)
   let maxwpx = term.attrs.widthPx
   let maxhpx = scrollBottom * term.attrs.ppl
   let scrolled = term.imageMode == imSixel
@@ -2311,8 +2536,9 @@ proc scrollDown*(term: Terminal; n, scrollBottom: int) =
       let i = y * term.attrs.width + x
       let j = (y - n) * term.attrs.width + x
       term.frame.canvas[j] = move(term.frame.canvas[i])
+      term.frame.drawn[j] = term.frame.drawn[i]
   for y in scrollBottom - n ..< scrollBottom:
-    term.frame.lineDamage[y] = 0
+    term.invalidate(0, y)
   let maxwpx = term.attrs.widthPx
   let maxhpx = scrollBottom * term.attrs.ppl
   let scrolled = term.imageMode == imSixel
@@ -2348,6 +2574,7 @@ proc scrollDown*(term: Terminal; n, scrollBottom: int) =
 
 proc draw*(term: Terminal; redraw, mouse: bool;
     cursorx, cursory, scrollBottom: int; bgcolor: CellColor): Opt[void] =
+  let startBytes = term.bytesWritten
   if redraw:
     if not term.cleared:
       ?term.fullDraw()
@@ -2369,6 +2596,7 @@ proc draw*(term: Terminal; redraw, mouse: bool;
     else:
       ?term.write(ResetSGRMouse)
     term.frame.mouseEnabled = mouse
+  term.frameBytes = term.bytesWritten - startBytes
   term.startFlush()
 
 proc sendOSC52*(term: Terminal; s: string; clipboard = true): Opt[bool] =
@@ -2619,9 +2847,11 @@ proc detectTermAttributes(term: Terminal; windowOnly: bool): Opt[void] =
   ok()
 
 proc initCanvas(term: Terminal) =
+  term.lineBuf = newSeq[FixedCell](term.attrs.width)
   for frame in term.frames.mitems:
     frame.lineDamage = newSeq[int](term.attrs.height)
     frame.canvas = newSeq[FixedCell](term.attrs.width * term.attrs.height)
+    frame.drawn = newSeq[FixedCell](term.attrs.width * term.attrs.height)
     frame.scrollBottom = -1
 
 proc windowChange(term: Terminal) =
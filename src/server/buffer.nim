@@ -8,6 +8,7 @@ import chame/htmlparser
 import chame/tags
 import config/conftypes
 import css/box
+import css/cssparser
 import css/csstree
 import css/cssvalues
 import css/layout
@@ -27,6 +28,7 @@ import io/dynstream
 import io/packetreader
 import io/packetwriter
 import io/poll
+import io/sharedring
 import io/timeout
 import local/select
 import monoucha/fromjs
@@ -55,6 +57,9 @@ import utils/twtstr
 
 type
   InputData {.final.} = ref object of MapData
+    ring: SharedRing # if set, the body is read from here; see readChunk
+    pending: int # bytes of ring returned by the last readChunk
+    eof: bool # stream has been closed by the loader
 
   PagerHandle {.final.} = ref object of MapData
     tasks: array[BufferCommand, int]
@@ -63,6 +68,35 @@ type
     prevHover: Element
     next: PagerHandle
     hoverText: array[HoverType, string]
+    # Lines the pager has cached from the last getLines, and the
+    # generation they were sent at.
+    sentShift: int
+    sentLen: int
+    sentGen: uint32
+    # Lines that changed since the last onReshape response.
+    damage: Slice[int]
+
+  # A text/plain document whose text we paint as it arrives, bypassing
+  # layout.  See appendPlainText.
+  PlainTextState = object
+    element: Element # <plaintext>; nil if not streaming
+    text: Text # the element's only child
+    format: Format
+    pos: int # bytes of text painted so far
+    x: int # width of the current line
+    spaces: int # whitespace after x; only painted if followed by text
+    y: int # current line
+    stale: bool # set if layout has not seen all of the text
+
+  # A 256-bit set of the byte trigrams in a line.
+  TrigramSig = array[4, uint64]
+
+  # Trigram signatures of bc.lines, so that searches can skip lines
+  # without the literal part of the regex.  Built on the first search, and
+  # then kept up to date using lineGen.  See updateSearchIndex.
+  SearchIndex = object
+    sigs: seq[TrigramSig]
+    gen: uint32 # generation in which sigs was last updated
 
   BufferContext {.final.} = ref object of RootObj
     firstBufferRead: bool
@@ -85,11 +119,18 @@ type
     linkHintChars: ref seq[uint32]
     schemes: seq[string]
     lines: FlexibleGrid
+    plain: PlainTextState
+    search: SearchIndex
+    lineGen: seq[uint32] # generation in which each line last changed
+    generation: uint32 # incremented on each reshape
     loader: FileLoader
     navigateUrl: URL # stored when JS tries to navigate
     outputId: int
     clickResult: ClickResult
     rootBox: BlockBox
+    # Layout stops at this line, until the pager asks for lines below it.
+    layoutLimit: int
+    partial: bool # set if layout has skipped boxes below layoutLimit
     window: Window
     luctx: LUContext
     nhints: int
@@ -100,6 +141,7 @@ type
 
 # Forward declarations
 proc click(bc: BufferContext; clickable: Element): ClickResult
+proc layoutAll(bc: BufferContext)
 proc submitForm(bc: BufferContext; form: HTMLFormElement;
   submitter: HTMLElement; jsSubmitCall = false): Request
 
@@ -372,6 +414,9 @@ proc findNextLink(bc: BufferContext; handle: PagerHandle;
         link = fl
       inc i
     i = 0
+  if bc.partial:
+    bc.layoutAll()
+    return bc.findNextLink(handle, cursorx, cursory, n)
   return (-1, -1)
 
 proc findNextParagraph(bc: BufferContext; handle: PagerHandle;
@@ -389,12 +434,17 @@ proc findNextParagraph(bc: BufferContext; handle: PagerHandle;
         inc y
       while y < bc.lines.len and not bc.lines[y].str.onlyWhitespace():
         inc y
+    if bc.partial and y >= bc.layoutLimit:
+      # we went past the lines we have laid out
+      bc.layoutAll()
+      return bc.findNextParagraph(handle, cursory, n)
   return y
 
 proc findRevNthLink(bc: BufferContext; handle: PagerHandle; i: int):
     tuple[x, y: int] {.proxy.} =
   if i == 0:
     return (-1, -1)
+  bc.layoutAll()
   var k = 0
   var link: Element
   for y in countdown(bc.lines.high, 0):
@@ -408,6 +458,39 @@ proc findRevNthLink(bc: BufferContext; handle: PagerHandle; i: int):
         link = fl
   return (-1, -1)
 
+# Trigrams are hashed in ASCII lower case, so that the signature works for
+# case-insensitive searches as well.
+proc trigramSig(s: openArray[char]): TrigramSig =
+  for i in 2 ..< s.len:
+    let h = (uint32(s[i - 2].toLowerAscii()) or
+      (uint32(s[i - 1].toLowerAscii()) shl 8) or
+      (uint32(s[i].toLowerAscii()) shl 16)) * 0x9E3779B1u32
+    let bit = int(h shr 24)
+    result[bit shr 6] = result[bit shr 6] or (1u64 shl (bit and 63))
+
+# False if a line with sig cannot contain the string whose signature is
+# mask.
+proc mayContain(sig, mask: TrigramSig): bool =
+  for i, it in mask:
+    if (sig[i] and it) != it:
+      return false
+  true
+
+# Recompute the signatures of lines that changed since the last search.
+proc updateSearchIndex(bc: BufferContext) =
+  let n = bc.search.sigs.len
+  bc.search.sigs.setLen(bc.lines.len)
+  for y, it in bc.search.sigs.mpairs:
+    if y >= n or y >= bc.lineGen.len or bc.lineGen[y] > bc.search.gen:
+      it = bc.lines[y].str.trigramSig()
+  bc.search.gen = bc.generation
+
+# Signature of the literal that each match of regex contains; lines whose
+# signature does not include it cannot match.  (Literals shorter than
+# three bytes have an empty signature, so they do not filter anything.)
+proc searchMask(regex: Regex): TrigramSig =
+  return regex.requiredLiteral().s.trigramSig()
+
 proc findPrevMatch(bc: BufferContext; handle: PagerHandle; regex: Regex;
     x, y, endy: int; wrap: bool; n: int): BufferMatch {.proxy.} =
   if n <= 0 or x < 0 or y < 0 or y >= bc.lines.len:
@@ -416,21 +499,26 @@ proc findPrevMatch(bc: BufferContext; handle: PagerHandle; regex: Regex;
   var y = y
   var b = bc.cursorBytes(y, x)
   var first = true
+  let mask = regex.searchMask()
+  bc.updateSearchIndex()
   while true:
     if y < 0:
       if not wrap:
         break
+      bc.layoutAll()
+      bc.updateSearchIndex()
       y = bc.lines.high
     let s = bc.lines[y].str
     if b < 0:
       b = s.len
-    let cap = regex.matchLast(s.toOpenArray(0, b - 1), 0)
-    if cap.s >= 0:
-      let x = s.width(0, cap.s)
-      let w = s.toOpenArray(cap.s, cap.e - 1).width()
-      dec n
-      if n == 0:
-        return BufferMatch(x: x, y: y, w: w)
+    if bc.search.sigs[y].mayContain(mask):
+      let cap = regex.matchLast(s.toOpenArray(0, b - 1), 0)
+      if cap.s >= 0:
+        let x = s.width(0, cap.s)
+        let w = s.toOpenArray(cap.s, cap.e - 1).width()
+        dec n
+        if n == 0:
+          return BufferMatch(x: x, y: y, w: w)
     if y == endy and not first:
       break
     first = false
@@ -446,19 +534,25 @@ proc findNextMatch(bc: BufferContext; handle: PagerHandle; regex: Regex;
   var n = n
   var b = bc.cursorBytes(y, cursorx + 1)
   var first = true
+  let mask = regex.searchMask()
+  bc.updateSearchIndex()
   while true:
+    if bc.partial and y >= bc.layoutLimit:
+      bc.layoutAll()
+      bc.updateSearchIndex()
     if y >= bc.lines.len:
       if not wrap:
         break
       y = 0
     let s = bc.lines[y].str
-    let cap = regex.matchFirst(s, b)
-    if cap.s >= 0:
-      let x = s.width(0, cap.s)
-      let w = s.toOpenArray(cap.s, cap.e - 1).width()
-      dec n
-      if n == 0:
-        return BufferMatch(x: x, y: y, w: w)
+    if bc.search.sigs[y].mayContain(mask):
+      let cap = regex.matchFirst(s, b)
+      if cap.s >= 0:
+        let x = s.width(0, cap.s)
+        let w = s.toOpenArray(cap.s, cap.e - 1).width()
+        dec n
+        if n == 0:
+          return BufferMatch(x: x, y: y, w: w)
     b = 0
     if y == endy and not first:
       break
@@ -466,6 +560,31 @@ proc findNextMatch(bc: BufferContext; handle: PagerHandle; regex: Regex;
     inc y
   BufferMatch(x: -1, y: -1)
 
+# Return the matches of regex on the lines in slice, so that the pager can
+# highlight them.
+proc findAllMatches(bc: BufferContext; handle: PagerHandle; regex: Regex;
+    slice: Slice[int]): seq[BufferMatch] {.proxy.} =
+  result = @[]
+  bc.layoutTo(slice.b)
+  for y in max(slice.a, 0) .. min(slice.b, bc.lines.high):
+    let s = bc.lines[y].str
+    for cap in regex.matchAll(s):
+      let x = s.width(0, cap.s)
+      let w = s.toOpenArray(cap.s, cap.e - 1).width()
+      result.add(BufferMatch(x: x, y: y, w: w))
+
+# Count the matches of regex in the whole document.
+proc countMatches(bc: BufferContext; handle: PagerHandle; regex: Regex): int
+    {.proxy.} =
+  result = 0
+  bc.layoutAll()
+  bc.updateSearchIndex()
+  let mask = regex.searchMask()
+  for y, sig in bc.search.sigs.mypairs:
+    if sig.mayContain(mask):
+      for cap in regex.matchAll(bc.lines[y].str):
+        inc result
+
 proc gotoAnchor(bc: BufferContext; handle: PagerHandle; anchor: string;
     autofocus, target: bool): GotoAnchorResult {.proxy.} =
   if bc.document == nil:
@@ -492,6 +611,9 @@ proc gotoAnchor(bc: BufferContext; handle: PagerHandle; anchor: string;
       let res = bc.click(autofocus)
       if res.t in ClickResultReadLine:
         focus = res
+  if element != nil and element.box != nil and
+      CSSBox(element.box).isDeferred():
+    bc.layoutAll()
   if element == nil or element.box == nil:
     return GotoAnchorResult(x: -1, y: -1)
   let offset = CSSBox(element.box).render.offset
@@ -534,34 +656,232 @@ proc resolveLoad(bc: BufferContext; handle: PagerHandle; n, len: uint64) =
   handle.reportedLoad = res
   handle.resolveTask(bcLoad, res)
 
+# Returns the number of lines, and the range of lines that changed since
+# the previous onReshape response.
+proc takeReshapeResult(handle: PagerHandle; bc: BufferContext):
+    tuple[numLines: int; damage: Slice[int]] =
+  result = (bc.lines.len, handle.damage)
+  handle.damage = 0 .. -1
+
+# Add first .. last to the lines each handle must refetch.
+proc addDamage(bc: BufferContext; first, last: int) =
+  for handle in bc.handles:
+    if handle.damage.len > 0:
+      handle.damage = min(handle.damage.a, first) .. max(handle.damage.b, last)
+    else:
+      handle.damage = first .. last
+
+proc notifyReshape(bc: BufferContext) =
+  for handle in bc.handles:
+    if handle.hasTask(bcOnReshape):
+      handle.resolveTask(bcOnReshape, handle.takeReshapeResult(bc))
+    else:
+      handle.onReshapeImmediately = true
+
+# Stamp lines that changed in the last render (damage, in ascending order)
+# with the current generation, so that getLinesCmd only sends those to the
+# pager.
+proc updateLineGen(bc: BufferContext; damage: openArray[int];
+    images: bool) =
+  bc.lineGen.setLen(bc.lines.len)
+  for y in damage:
+    bc.lineGen[y] = bc.generation
+  var first = -1
+  var last = -1
+  if damage.len > 0:
+    first = damage[0]
+    last = damage[^1]
+  # Images are not part of the lines, so we do not know which lines they
+  # overlap; just let the pager refetch everything.
+  if images:
+    first = 0
+    last = int.high
+  if first != -1:
+    bc.addDamage(first, last)
+
+# Paint the text appended to <plaintext> since the last call, without
+# running layout.  This must produce the same cells as layout & render do
+# for a "white-space: pre" block, which is what initPlainText checks for.
+# If paint is false, then only the position of the text's end is updated.
+proc appendPlainText(bc: BufferContext; paint = true) =
+  template plain: untyped = bc.plain
+  template line: untyped = bc.lines[plain.y]
+  let data = plain.text.data
+  let element = plain.element
+  var first = -1
+  var i = plain.pos
+  while i < data.s.len:
+    let pi = i
+    var u = data.s.nextUTF8(i)
+    var w = 0
+    var filter = false
+    if u < 0x80:
+      case char(u)
+      of '\n':
+        inc plain.y
+        plain.x = 0
+        plain.spaces = 0
+        continue
+      of '\t':
+        let x = plain.x + plain.spaces
+        w = ((x + 8) and not 7) - x
+        u = tabPUAPoint(w)
+        filter = true
+      of ' ', '\r', '\f':
+        inc plain.spaces
+        continue
+      else:
+        w = u.width()
+    elif bc.luctx.isEnclosingMark(u) or bc.luctx.isNonspacingMark(u) or
+        bc.luctx.isFormat(u) or u == 0xAD:
+      continue
+    else:
+      # filter out surrogates & chars placed in our PUA range
+      if u in 0xD800u32 .. 0xDFFFu32 or u in TabPUARange:
+        u = 0xFFFD
+        filter = true
+      w = u.width()
+    if paint:
+      if bc.lines.len <= plain.y:
+        bc.lines.setLen(plain.y + 1)
+      if first == -1:
+        first = plain.y
+      if plain.spaces > 0 and line.formats.len > 0 and
+          plain.format != initFormat():
+        # padding is not part of the text
+        line.formats.add(FormatCell(format: initFormat(), pos: plain.x))
+      for j in 0 ..< plain.spaces:
+        line.str &= ' '
+      plain.x += plain.spaces
+      plain.spaces = 0
+      if line.formats.len == 0 or line.formats[^1].node != element or
+          line.formats[^1].format != plain.format:
+        line.formats.add(FormatCell(format: plain.format, node: element,
+          pos: plain.x))
+      if filter:
+        line.str.addUTF8(u)
+      else:
+        line.str &= data.s.toOpenArray(pi, i - 1)
+    else:
+      plain.x += plain.spaces
+      plain.spaces = 0
+    plain.x += w
+  plain.pos = data.s.len
+  if first != -1:
+    plain.stale = true
+    inc bc.generation
+    bc.lineGen.setLen(bc.lines.len)
+    for y in first ..< bc.lines.len:
+      bc.lineGen[y] = bc.generation
+    bc.addDamage(first, bc.lines.high)
+    bc.notifyReshape()
+
+# Check whether text appended to a text/plain document can be painted
+# directly.  This is true of the default style, but user styles may
+# change it in arbitrary ways; in that case, we just run layout each time.
+proc initPlainText(bc: BufferContext) =
+  bc.plain = PlainTextState()
+  if bc.ishtml:
+    return
+  let element = bc.document.findFirst(ttPlaintext)
+  if element == nil or element.box == nil or
+      not (CSSBox(element.box) of BlockBox):
+    return
+  let text = element.asNode.firstChild as Text
+  if text == nil or text.asNode != element.asNode.lastChild:
+    return
+  let box = BlockBox(element.box)
+  for child in box.children:
+    if child.pseudo != peNone:
+      return
+  let computed = box.computed
+  if box.positioned or box.render.offset.x != 0'lu or
+      computed{"white-space"} != WhiteSpacePre or
+      computed{"text-transform"} != TextTransformNone or
+      computed{"visibility"} != VisibilityVisible or
+      not computed{"padding-left"}.isZero or
+      not computed{"padding-top"}.isZero or
+      not box.canAppendText():
+    return
+  bc.plain = PlainTextState(
+    element: element,
+    text: text,
+    format: computed.toFormat(),
+    y: (box.render.offset.y div bc.attrs.ppl.toLUnit()).toInt()
+  )
+  bc.appendPlainText(paint = false)
+
 proc maybeReshape(bc: BufferContext; suppressFouc = false) =
   let document = bc.document
   if document == nil or not document.invalid:
     return # not parsed yet, or no change between previous layout
+  if bc.plain.stale:
+    # layout has not seen the text we painted in appendPlainText
+    bc.plain.element.invalidate()
   let rootElement = document.documentElement
-  if rootElement == nil:
-    # lost all elements (e.g. document.documentElement.remove() called)
-    bc.lines.setLen(0)
-  else:
+  var damage: seq[int] = @[]
+  let hadImages = bc.images.len > 0
+  inc bc.generation
+  if rootElement != nil:
     let (stack, fixedHead) = rootElement.buildTree(bc.rootBox,
       bc.config.markLinks, bc.nhints, bc.linkHintChars)
+    # a new root box has nothing in common with the previous render
+    let full = stack.box != bc.rootBox
+    let ppl = bc.attrs.ppl.toLUnit()
+    let limit = if bc.layoutLimit == int.high:
+      LUnit.high
+    else:
+      bc.layoutLimit.toLUnit() * ppl
     bc.rootBox = BlockBox(stack.box)
-    bc.rootBox.layout(bc.attrs, fixedHead, bc.luctx)
-    bc.lines.render(bc.bgcolor, stack, bc.attrs, bc.images)
+    bc.partial = bc.rootBox.layout(bc.attrs, fixedHead, bc.luctx, limit)
+    bc.lines.render(bc.bgcolor, stack, bc.attrs, bc.images, damage, full)
+    if bc.partial:
+      # Pad the lines to the estimated height of the document, so that
+      # the pager can scroll to the boxes we skipped.
+      let height = (bc.rootBox.state.size.h div ppl).toInt()
+      if bc.lines.len < height:
+        let len = bc.lines.len
+        bc.lines.setLen(height)
+        for y in len ..< height:
+          damage.add(y)
+  else:
+    # we lost all elements (e.g. document.documentElement.remove() called)
+    bc.lines.setLen(0)
+    bc.images.setLen(0)
+    bc.partial = false
+  bc.updateLineGen(damage, hadImages or bc.images.len > 0)
+  bc.initPlainText()
   # We don't want a FOUC on automatic reshape, but we still want to allow
   # the user to override this and interact with the page (useful if e.g. a
   # sheet really doesn't want to load).
   if not suppressFouc or bc.window.loadedSheetNum == bc.window.remoteSheetNum:
-    for handle in bc.handles:
-      if handle.hasTask(bcOnReshape):
-        handle.resolveTask(bcOnReshape)
-      else:
-        handle.onReshapeImmediately = true
+    bc.notifyReshape()
   document.invalid = false
 
+# Lay out the document up to line y, if we have not done so yet.
+proc layoutTo(bc: BufferContext; y: int) =
+  if bc.partial and y >= bc.layoutLimit:
+    bc.layoutLimit = if y == int.high: y else: y + bc.attrs.height * 5
+    if bc.document != nil:
+      bc.document.invalid = true
+      bc.maybeReshape()
+    else:
+      bc.partial = false
+
+# Lay out the whole document.  Needed by anything that looks at lines
+# outside the pager's window.
+proc layoutAll(bc: BufferContext) =
+  bc.layoutTo(int.high)
+  # nothing is deferred with an unbounded limit; callers rely on this to
+  # stop recursing
+  assert not bc.partial
+
 proc ensureLayout(bc: RootRef; element: Element) =
   let bc = BufferContext(bc)
   bc.maybeReshape(suppressFouc = true)
+  if element != nil and element.box != nil and
+      CSSBox(element.box).isDeferred():
+    bc.layoutAll()
 
 proc processData0(bc: BufferContext; data: UnsafeSlice): bool =
   if bc.ishtml:
@@ -582,7 +902,10 @@ proc processData0(bc: BufferContext; data: UnsafeSlice): bool =
         let text = bc.document.newText($data)
         if text != nil:
           plaintext.asParentNode.append(bc.window.jsctx, text.asNode)
-      plaintext.asElement.invalidate()
+      if bc.plain.element == plaintext.asElement and bc.plain.text == lastText:
+        bc.appendPlainText()
+      else:
+        plaintext.asElement.invalidate()
   true
 
 proc canSwitch(bc: BufferContext): bool {.inline.} =
@@ -595,6 +918,7 @@ proc initDecoder(bc: BufferContext) =
   bc.ctx = initTextDecoderContext(bc.charset, demFatal, BufferSize)
 
 proc switchCharset(bc: BufferContext) =
+  bc.plain = PlainTextState()
   bc.charset = bc.charsetStack.pop()
   bc.initDecoder()
   bc.htmlParser.restart(bc.charset)
@@ -672,6 +996,39 @@ proc updateHover(bc: BufferContext; handle: PagerHandle;
   handle.prevHover = thisNode
   move(hover)
 
+proc close(data: InputData) =
+  data.stream.sclose()
+  if data.ring != nil:
+    data.ring.unmap()
+    data.ring.wake.sclose()
+    data.ring = nil
+
+# Read the next chunk of the page into iq, or point p to it in the shared
+# ring.  Either way, p is valid until the next call.
+# With a ring, the stream only carries wakeups and EOF, so we drain it
+# until the ring has data, and tell the loader to poke us before waiting.
+proc readChunk(data: InputData; iq: var array[BufferSize, uint8];
+    p: var ptr UncheckedArray[uint8]): int =
+  let ring = data.ring
+  if ring == nil:
+    p = cast[ptr UncheckedArray[uint8]](addr iq[0])
+    return data.stream.read(iq)
+  ring.consume(data.pending)
+  data.pending = 0
+  while true:
+    let (rp, len) = ring.peek()
+    if len > 0:
+      p = rp
+      data.pending = len
+      return len
+    if data.eof:
+      return 0
+    let n = data.stream.read(iq)
+    if n == 0:
+      data.eof = true
+    elif n < 0 and ring.waitReader():
+      return -1
+
 proc rewind(bc: BufferContext; data: InputData; offset: uint64): bool =
   let url = parseURL0("cache:" & $bc.cacheId & "?" & $offset)
   let response = bc.loader.doRequest(newRequest(url))
@@ -679,7 +1036,7 @@ proc rewind(bc: BufferContext; data: InputData; offset: uint64): bool =
     return false
   bc.loader.resume(response.outputId)
   bc.loader.unregister(data)
-  data.stream.sclose()
+  data.close()
   response.stream.setBlocking(false)
   let data = InputData(stream: response.stream)
   bc.loader.register(data, POLLIN)
@@ -687,7 +1044,7 @@ proc rewind(bc: BufferContext; data: InputData; offset: uint64): bool =
   return true
 
 proc addPagerHandle(bc: BufferContext; stream: PosixStream) =
-  let handle = PagerHandle(stream: stream)
+  let handle = PagerHandle(stream: stream, damage: 0 .. int.high)
   bc.loader.put(handle)
   bc.loader.pollData.register(stream.fd, POLLIN)
   var it = bc.handlesHead
@@ -741,7 +1098,7 @@ proc finishLoad(bc: BufferContext; data: InputData) =
   bc.loader.removeCachedItem(bc.cacheId)
   bc.cacheId = -1
   bc.outputId = -1
-  data.stream.sclose()
+  data.close()
 
 proc headlessMustWait(bc: BufferContext): bool =
   return bc.config.scripting != smFalse and
@@ -849,15 +1206,16 @@ proc onload(bc: BufferContext; data: InputData) =
     return
   var reprocess = false
   var iq {.noinit.}: array[BufferSize, uint8]
+  var p: ptr UncheckedArray[uint8] = nil
   var n = 0
   while true:
     if not reprocess:
-      n = data.stream.read(iq)
+      n = data.readChunk(iq, p)
       if n < 0:
         break
       bc.bytesRead += uint64(n)
     if n != 0:
-      if not bc.processData(iq.toOpenArray(0, n - 1)):
+      if not bc.processData(p.toOpenArray(0, n - 1)):
         if not bc.firstBufferRead:
           reprocess = true
           continue
@@ -917,6 +1275,8 @@ proc windowChange(bc: BufferContext; handle: PagerHandle;
   let ppl = attrs.ppl.toLUnit()
   let dx = x - (offset.x div ppc).toInt()
   let dy = y - (offset.y div ppl).toInt()
+  if bc.attrs.ppc != attrs.ppc or bc.attrs.ppl != attrs.ppl:
+    bc.rootBox = nil # cell size changed; render everything again
   bc.attrs = attrs
   bc.window.windowChange()
   bc.maybeReshape()
@@ -934,12 +1294,14 @@ proc cancel(bc: BufferContext; handle: PagerHandle) {.proxy.} =
     if it of PagerHandle:
       continue
     bc.loader.unregister(it)
-    it.stream.sclose()
     if it of InputData:
+      InputData(it).close()
       bc.loader.removeCachedItem(bc.cacheId)
       bc.cacheId = -1
       bc.outputId = -1
       bc.htmlParser.finish()
+    else:
+      it.stream.sclose()
   bc.document.readyState = rsInteractive
   bc.state = bsLoaded
   bc.maybeReshape()
@@ -1495,9 +1857,22 @@ proc swrite(w: var PacketWriter; x: FlexibleLine) =
 proc getLinesCmd(bc: BufferContext; handle: PagerHandle; r: var PacketReader;
     packetid: int): CommandResult =
   var slice: Slice[int]
+  var resend: bool
   r.sread(slice)
+  r.sread(resend)
+  if resend: # the pager lost track of the lines we sent
+    handle.sentLen = 0
+  bc.layoutTo(if slice.b < 0: int.high else: slice.b)
   if slice.b < 0 or slice.b > bc.lines.high:
     slice.b = bc.lines.high
+  if bc.config.images and
+      bc.window.loadedImageNum < bc.window.remoteImageNum:
+    # Images that are still loading show their alt text; make sure the
+    # ones the user is looking at are fetched first.
+    for y in max(slice.a, 0) .. slice.b:
+      for it in bc.lines[y].formats:
+        if it.node of HTMLImageElement:
+          bc.window.prioritizeImage(HTMLImageElement(it.node))
   handle.stream.withPacketWriterReturnEOF w:
     w.swrite(packetid)
     w.swrite(slice.a) # lineShift
@@ -1505,7 +1880,14 @@ proc getLinesCmd(bc: BufferContext; handle: PagerHandle; r: var PacketReader;
     w.swrite(bc.bgcolor) # bgcolor
     w.swrite(slice.len) # lines.len
     for y in slice: # lines.data
-      w.swrite(bc.lines[y])
+      # Lines the pager got in the previous response and that have not
+      # changed since are only flagged as cached; on scrolling, this
+      # leaves just the lines that came into view.
+      let cached = y - handle.sentShift in 0 ..< handle.sentLen and
+        bc.lineGen[y] <= handle.sentGen
+      w.swrite(cached)
+      if not cached:
+        w.swrite(bc.lines[y])
     var images: seq[PosBitmap]
     if bc.config.images:
       let ppl = bc.attrs.ppl
@@ -1515,6 +1897,43 @@ proc getLinesCmd(bc: BufferContext; handle: PagerHandle; r: var PacketReader;
             image.y <= slice.b and ey >= slice.a:
           images.add(image)
     w.swrite(images) # images
+  handle.sentShift = slice.a
+  handle.sentLen = slice.len
+  handle.sentGen = bc.generation
+  cmdrDone
+
+# Roughly how much line data we put in one dumpLines packet.
+const DumpPacketSize = 65536
+
+# Stream a range of lines to the pager for dump mode.  Unlike getLines,
+# this responds with as many packets as needed, so that the pager does
+# not have to ask for each screen separately.  The last packet has no
+# lines.
+proc dumpLinesCmd(bc: BufferContext; handle: PagerHandle;
+    r: var PacketReader; packetid: int): CommandResult =
+  var slice: Slice[int]
+  r.sread(slice)
+  bc.layoutTo(if slice.b < 0: int.high else: slice.b)
+  if slice.b < 0 or slice.b > bc.lines.high:
+    slice.b = bc.lines.high
+  var y = max(slice.a, 0)
+  while true:
+    var size = 0
+    var ey = y
+    while ey <= slice.b and size < DumpPacketSize:
+      size += bc.lines[ey].str.len +
+        bc.lines[ey].formats.len * sizeof(SimpleFormatCell)
+      inc ey
+    handle.stream.withPacketWriterReturnEOF w:
+      w.swrite(packetid)
+      w.swrite(bc.lines.len) # numLines
+      w.swrite(bc.bgcolor) # bgcolor
+      w.swrite(ey - y) # lines.len
+      for i in y ..< ey: # lines.data
+        w.swrite(bc.lines[i])
+    if y == ey:
+      break
+    y = ey
   cmdrDone
 
 proc getSelectionText(bc: BufferContext; handle: PagerHandle;
@@ -1560,15 +1979,17 @@ proc getLinks(bc: BufferContext; handle: PagerHandle): seq[string] {.proxy.} =
         else:
           result.add(element.attr(satHref))
 
-proc onReshape(bc: BufferContext; handle: PagerHandle) {.proxy: pfTask.} =
+proc onReshape(bc: BufferContext; handle: PagerHandle):
+    tuple[numLines: int; damage: Slice[int]] {.proxy: pfTask.} =
   if handle.onReshapeImmediately:
     # We got a reshape before the container even asked us for the event.
     # This variable prevents the race that would otherwise occur if
     # the buffer were to be reshaped between two onReshape requests.
     handle.onReshapeImmediately = false
-    return
+    return handle.takeReshapeResult(bc)
   assert handle.tasks[bcOnReshape] == 0
   bc.savetask = true
+  return (0, 0 .. -1)
 
 proc markURL(bc: BufferContext; handle: PagerHandle) {.proxy.} =
   if bc.document == nil:
@@ -1728,6 +2149,9 @@ const ProxyMap = [
   bcClick: clickCmd,
   bcClone: cloneCmd,
   bcContextMenu: contextMenuCmd,
+  bcCountMatches: countMatchesCmd,
+  bcDumpLines: dumpLinesCmd,
+  bcFindAllMatches: findAllMatchesCmd,
   bcFindNextLink: findNextLinkCmd,
   bcFindNextMatch: findNextMatchCmd,
   bcFindNextParagraph: findNextParagraphCmd,
@@ -1838,9 +2262,10 @@ proc runBuffer(bc: BufferContext) =
         bc.maybeReshape(suppressFouc = true)
         bc.checkJobs = false
 
-proc launchBuffer*(rt: JSRuntime; config: BufferConfig; url: sink URL;
+proc launchBuffer*(jsctx: JSContext; config: BufferConfig; url: sink URL;
     attrs: WindowAttributes; ishtml: bool; charsetStack: seq[Charset];
-    loader: FileLoader; pstream, istream, urandom: PosixStream; cacheId: int;
+    loader: FileLoader; pstream, istream, urandom: PosixStream;
+    ring: SharedRing; cacheId: int;
     contentType: string; linkHintChars: sink seq[uint32];
     schemes: sink seq[string]) =
   let confidence = if config.charsetOverride == csUnknown:
@@ -1860,12 +2285,13 @@ proc launchBuffer*(rt: JSRuntime; config: BufferConfig; url: sink URL;
       cacheId: cacheId,
       outputId: -1,
       luctx: LUContext(),
-      schemes: schemes
+      schemes: schemes,
+      layoutLimit: if config.headless != hmFalse: int.high else: attrs.height * 5
     )
     bc.linkHintChars = new(seq[uint32])
     bc.linkHintChars[] = linkHintChars
     bc.window = newWindow(
-      rt,
+      jsctx,
       config.scripting,
       config.images,
       config.styling,
@@ -1883,7 +2309,7 @@ proc launchBuffer*(rt: JSRuntime; config: BufferConfig; url: sink URL;
     bc.window.bc = bc
     bc.charset = bc.charsetStack.pop()
     istream.setBlocking(false)
-    bc.loader.put(InputData(stream: istream))
+    bc.loader.put(InputData(stream: istream, ring: ring))
     bc.loader.pollData.register(istream.fd, POLLIN)
     bc.addPagerHandle(pstream)
     bc.initDecoder()
@@ -45,6 +45,9 @@ type
     bcClick = "click"
     bcClone = "clone"
     bcContextMenu = "contextMenu"
+    bcCountMatches = "countMatches"
+    bcDumpLines = "dumpLines"
+    bcFindAllMatches = "findAllMatches"
     bcFindNextLink = "findNextLink"
     bcFindNextMatch = "findNextMatch"
     bcFindNextParagraph = "findNextParagraph"
@@ -262,6 +265,7 @@ type
     partialReader: PartialPacketReader
     lines: SimpleFlexibleGrid
     lineShift: int
+    linesLost: bool # set if getLines must not assume we have any lines
     numLines*: int
     pos: CursorState
     highlights: seq[Highlight]
@@ -892,6 +896,30 @@ proc addPromise[T](ctx: JSContext; iface: BufferInterface): JSValue =
 proc addEmptyPromise(ctx: JSContext; iface: BufferInterface): JSValue =
   return ctx.addPromise(iface, nil)
 
+proc getOnReshape(ctx: JSContext; iface: BufferInterface;
+    r: var PacketReader): JSValue =
+  var numLines: int
+  var damage: Slice[int]
+  r.sread(numLines)
+  r.sread(damage)
+  let slice = iface.lineWindow
+  let changed = numLines != iface.numLines or
+    damage.a <= slice.b and slice.a <= damage.b
+  return ctx.toJS(changed)
+
+proc getMatches(ctx: JSContext; iface: BufferInterface;
+    r: var PacketReader): JSValue =
+  var matches: seq[BufferMatch]
+  r.sread(matches)
+  var vals = newSeqOfCap[JSValue](matches.len)
+  for it in matches:
+    let val = ctx.toJS(it)
+    if JS_IsException(val):
+      ctx.freeValues(vals)
+      return JS_EXCEPTION
+    vals.add(val)
+  return ctx.newArrayFrom(vals)
+
 iterator ilines(iface: BufferInterface; slice: Slice[int]):
     lent SimpleFlexibleLine {.inline.} =
   for y in slice:
@@ -978,16 +1006,47 @@ proc clone*(iface: BufferInterface; newurl: URL; pstreamFd: cint): Opt[void] =
   iface.addPromise(nil)
   ok()
 
+# Read the response to bcGetLines.  Lines we already have are only
+# flagged by the buffer, so we move them over from the previous window.
+# Returns true if the window has changed.
+proc readLines(iface: BufferInterface; r: var PacketReader): bool =
+  var lineShift: int
+  var n: int
+  r.sread(lineShift)
+  r.sread(iface.numLines)
+  r.sread(iface.bgcolor)
+  r.sread(n)
+  var changed = lineShift != iface.lineShift or n != iface.lines.len
+  var lines = newSeq[SimpleFlexibleLine](n)
+  for i, line in lines.mpairs:
+    var cached: bool
+    r.sread(cached)
+    let j = lineShift + i - iface.lineShift
+    if not cached:
+      r.sread(line)
+      changed = true
+    elif j in 0 ..< iface.lines.len:
+      line = move(iface.lines[j])
+    else:
+      # We do not have the line the buffer thinks we have; leave it empty,
+      # and ask for all lines again.
+      iface.linesLost = true
+      changed = true
+  iface.lines = move(lines)
+  iface.lineShift = lineShift
+  # we cannot tell if images have changed, so assume they did
+  let hadImages = iface.images.len > 0
+  r.sread(iface.images)
+  changed or hadImages or iface.images.len > 0
+
 proc getLinesFromStream(ctx: JSContext; iface: BufferInterface;
     r: var PacketReader): JSValue =
   iface.gotLines = true
   let oldBgcolor = iface.bgcolor
   let oldNumLines = iface.numLines
-  r.sread(iface.lineShift)
-  r.sread(iface.numLines)
-  r.sread(iface.bgcolor)
-  r.sread(iface.lines)
-  r.sread(iface.images)
+  let changed = iface.readLines(r)
+  if iface.linesLost:
+    iface.requestLinesFast(force = true)
   if iface.pos.setx >= 0:
     iface.setCursorX(iface.pos.setx, iface.pos.setxrefresh, iface.pos.setxsave)
   if oldNumLines != iface.numLines:
@@ -1017,7 +1076,8 @@ proc getLinesFromStream(ctx: JSContext; iface: BufferInterface;
       iface.refreshStatus = true
       iface.init.flags.excl(bifTailOnLoad)
   let slice = iface.lineShift ..< iface.lineShift + iface.lines.len
-  if slice.b >= iface.fromy and slice.a <= iface.fromy + iface.init.height or
+  if changed and slice.b >= iface.fromy and
+      slice.a <= iface.fromy + iface.init.height or
       oldBgcolor != iface.bgcolor:
     iface.queueDraw()
   return JS_UNDEFINED
@@ -1029,8 +1089,10 @@ proc requestLinesFast*(iface: BufferInterface; force = false) =
   iface.requestedLines = slice
   iface.withPacketWriter bcGetLines, w:
     w.swrite(slice)
+    w.swrite(iface.linesLost)
   do:
     return
+  iface.linesLost = false
   iface.addPromise(getLinesFromStream)
 
 # dump mode
@@ -1049,32 +1111,31 @@ proc requestLinesSync*(ctx: JSContext; iface: BufferInterface;
     let res = ctx.handleCommand(iface)
     if res != irOk:
       return res
-  var slice = 0 .. 23
-  while true:
-    let packetid = iface.packetid
-    iface.withPacketWriterSync bcGetLines, w:
-      w.swrite(slice)
-    do:
-      return irEOF
-    inc iface.packetid
+  let packetid = iface.packetid
+  iface.withPacketWriterSync bcDumpLines, w:
+    w.swrite(0 .. int.high)
+  do:
+    return irEOF
+  inc iface.packetid
+  # the buffer streams the lines until a packet with no lines
+  var formats: seq[SimpleFormatCell] = @[]
+  var n = 1
+  while n > 0:
     iface.stream.withPacketReader r:
       var packetid2: int
       r.sread(packetid2)
       assert packetid == packetid2
-      r.sread(iface.lineShift)
       r.sread(iface.numLines)
       r.sread(iface.bgcolor)
-      r.sread(iface.lines)
-      r.sread(iface.images)
+      r.sread(n)
+      for i in 0 ..< n:
+        var str: PacketView
+        r.sread(str)
+        r.sread(formats)
+        if handle(opaque, iface, str.toOpenArray(), formats).isErr:
+          return irEOF
     do:
       return irEOF
-    for line in iface.lines:
-      if handle(opaque, iface, line.str, line.formats).isErr:
-        return irEOF
-    if iface.numLines <= slice.b:
-      break
-    slice.a += 24
-    slice.b += 24
   if iface.init.config.markLinks:
     # avoid coloring link markers
     iface.bgcolor = defaultColor
@@ -1382,6 +1443,31 @@ jsClassPublicDef(BufferInterface):
       w.swrite(cursory)
     return addPromise[bool](ctx, iface)
 
+  # Returns the [x, y, w] of each match between y1 and y2.
+  proc findAllMatches(ctx: JSContext; iface: BufferInterface; re: JSValueConst;
+      y1, y2: int): JSValue {.jsfunc.} =
+    var bytecodeLen: cint
+    let p = JS_GetRegExpBytecode(ctx, re, bytecodeLen)
+    if p == nil:
+      return JS_EXCEPTION
+    let regex = bytecodeToRegex(cast[REBytecode](p), bytecodeLen)
+    ctx.withPacketWriter iface, bcFindAllMatches, w:
+      w.swrite(regex)
+      w.swrite(y1 .. y2)
+    return ctx.addPromise(iface, getMatches)
+
+  # Returns the number of matches in the whole document.
+  proc countMatches(ctx: JSContext; iface: BufferInterface; re: JSValueConst):
+      JSValue {.jsfunc.} =
+    var bytecodeLen: cint
+    let p = JS_GetRegExpBytecode(ctx, re, bytecodeLen)
+    if p == nil:
+      return JS_EXCEPTION
+    let regex = bytecodeToRegex(cast[REBytecode](p), bytecodeLen)
+    ctx.withPacketWriter iface, bcCountMatches, w:
+      w.swrite(regex)
+    return addPromise[int](ctx, iface)
+
   proc findNextLink(ctx: JSContext; iface: BufferInterface; x, y, n: int): JSValue
       {.jsfunc.} =
     ctx.withPacketWriter iface, bcFindNextLink, w:
@@ -1519,6 +1605,8 @@ jsClassPublicDef(BufferInterface):
     iface.requestedLines = slice
     ctx.withPacketWriter iface, bcGetLines, w:
       w.swrite(slice)
+      w.swrite(iface.linesLost)
+    iface.linesLost = false
     return ctx.addPromise(iface, getLinesFromStream)
 
   proc getSelectionText(ctx: JSContext; iface: BufferInterface;
@@ -1559,10 +1647,11 @@ jsClassPublicDef(BufferInterface):
       discard
     return addEmptyPromise(ctx, iface)
 
+  # Resolves to true if the lines we display may have changed.
   proc onReshape(ctx: JSContext; iface: BufferInterface): JSValue {.jsfunc.} =
     ctx.withPacketWriter iface, bcOnReshape, w:
       discard
-    return addEmptyPromise(ctx, iface)
+    return ctx.addPromise(iface, getOnReshape)
 
   proc readCanceled(ctx: JSContext; iface: BufferInterface): JSValue
       {.jsfunc.} =
@@ -1797,14 +1886,13 @@ proc setFormat(cell: var FixedCell; cf: SimpleFormatCell; bgcolor: CellColor) =
   if bgcolor != defaultColor and cell.format.bgcolor == defaultColor:
     cell.format.bgcolor = bgcolor
 
-proc setText(cell: var FixedCell; u: uint32; i, pi, uw: int;
-    s: openArray[char]) =
+proc setText(cell: var FixedCell; u: uint32; uw: int) =
   if u.isControlChar():
-    cell.str = u.controlToVisual()
+    cell.setControl(u)
   elif u in TabPUARange:
-    cell.str = ' '.repeat(uw)
+    cell.setSpaces(uw)
   else:
-    cell.str = s.toOpenArray(pi, i - 1).substr()
+    cell.setText(u)
 
 proc drawLines*(iface: BufferInterface; display: var FixedGrid;
     hlcolor: CellColor) =
@@ -1826,14 +1914,13 @@ proc drawLines*(iface: BufferInterface; display: var FixedGrid;
     var nf = line.findNextFormat(w)
     var k = 0
     while k < w - iface.pos.fromx:
-      display[dls + k] = FixedCell(str: " ")
+      display[dls + k] = FixedCell(text: uint32(' '))
       display[dls + k].setFormat(cf, bgcolor)
       inc k
     let startw = w # save this for later
     # Now fill in the visible part of the row.
     while i < line.str.len:
       let pw = w
-      let pi = i
       let u = line.str.nextUTF8(i)
       let uw = u.width()
       w += uw
@@ -1842,7 +1929,7 @@ proc drawLines*(iface: BufferInterface; display: var FixedGrid;
       if nf.pos != -1 and nf.pos <= pw:
         cf = nf
         nf = line.findNextFormat(pw)
-      display[dls + k].setText(u, i, pi, uw, line.str)
+      display[dls + k].setText(u, uw)
       display[dls + k].setFormat(cf, bgcolor)
       inc k
       for i in 1 ..< uw:
@@ -1852,7 +1939,7 @@ proc drawLines*(iface: BufferInterface; display: var FixedGrid;
       # Fill the screen if bgcolor is not default.
       let format = initFormat(bgcolor, defaultColor, {})
       for cell in display.mline(by, k):
-        cell = FixedCell(str: " ", format: format)
+        cell = FixedCell(text: uint32(' '), format: format)
     else:
       for cell in display.mline(by, k):
         cell = FixedCell()
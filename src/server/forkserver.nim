@@ -4,13 +4,17 @@ import std/os
 import std/posix
 
 import config/config
+import config/conftypes
 import config/mailcap
 import encoding/charset
+import html/dom
+import html/env
 import io/chafile
 import io/dynstream
 import io/packetreader
 import io/packetwriter
 import io/poll
+import io/sharedring
 import monoucha/jsref
 import monoucha/quickjs
 import server/buffer
@@ -33,12 +37,35 @@ type
     estream*: PosixStream
     westream*: PosixStream
 
+  ForkServerCommand = enum
+    fcForkBuffer, fcWarmSheets
+
+  BufferRequest = object
+    config: BufferConfig
+    url: URL
+    attrs: WindowAttributes
+    ishtml: bool
+    charsetStack: seq[Charset]
+    contentType: string
+
+  # A buffer process forked in advance, with its JS context already
+  # created.  It waits on stream for a BufferRequest and the pager's fd.
+  Zygote = object
+    pid: int
+    stream: PosixStream
+    scripting: bool
+
   ForkServerContext = object
     stream: PosixStream
     loaderStream: PosixStream
     pollData: PollData
     linkHintChars: seq[uint32]
     schemes: seq[string]
+    zygotes: seq[Zygote]
+    preforkBuffers: int
+    zygoteScripting: bool # kind of JS context the next zygote gets
+    lastRequest: BufferRequest # for warmSheetCache
+    hasLastRequest: bool
 
 proc loadConfig*(forkserver: ForkServer; config: Config;
     warnings: var seq[string]): int =
@@ -53,6 +80,11 @@ proc loadConfig*(forkserver: ForkServer; config: Config;
       dataDir: config.dataDir,
       bookmark: config{"bookmark"},
       maxNetConnections: config{"maxNetConnections"},
+      maxKeepAlivePerHost: config{"maxKeepAlivePerHost"},
+      keepAliveTimeout: config{"keepAliveTimeout"},
+      residentAdapters: config{"residentAdapters"},
+      httpCacheSize: config{"httpCacheSize"},
+      downloadSegments: config{"downloadSegments"},
     ))
     # client config for pager
     w.swrite(LoaderClientConfig(
@@ -62,6 +94,7 @@ proc loadConfig*(forkserver: ForkServer; config: Config;
     ))
     w.swrite(config{"urimethodmap"})
     w.swrite(config{"autoBrowsecap"})
+    w.swrite(config{"preforkBuffers"})
   do:
     return -1
   var process = -1
@@ -80,12 +113,15 @@ proc forkBuffer*(forkserver: ForkServer; config: BufferConfig; url: URL;
     return (-1, nil)
   var fail = false
   forkserver.stream.withPacketWriter w:
-    w.swrite(config)
-    w.swrite(url)
-    w.swrite(attrs)
-    w.swrite(ishtml)
-    w.swrite(charsetStack)
-    w.swrite(contentType)
+    w.swrite(fcForkBuffer)
+    w.swrite(BufferRequest(
+      config: config,
+      url: url,
+      attrs: attrs,
+      ishtml: ishtml,
+      charsetStack: charsetStack,
+      contentType: contentType
+    ))
     w.sendFd(sv[1])
   do:
     fail = true
@@ -98,6 +134,19 @@ proc forkBuffer*(forkserver: ForkServer; config: BufferConfig; url: URL;
     return (-1, nil)
   return (bufferPid, newPosixStream(sv[0]))
 
+# Ask the fork server to parse the sheets that buffers with these
+# settings need, and to replace its zygotes with ones that have them.
+proc warmSheetCache*(forkserver: ForkServer; attrs: WindowAttributes;
+    scripting: ScriptingMode; headless: HeadlessMode; userStyle: string) =
+  forkserver.stream.withPacketWriter w:
+    w.swrite(fcWarmSheets)
+    w.swrite(attrs)
+    w.swrite(scripting)
+    w.swrite(headless)
+    w.swrite(userStyle)
+  do:
+    discard
+
 when defined(nimUseStrictDefs):
   template myProveInit(x: untyped): untyped =
     {.warning[ProveInit]:off.}:
@@ -133,56 +182,181 @@ proc forkLoader(ctx: var ForkServerContext; rt: JSRuntime;
     loaderStream.sclose()
     return (int(pid), newPosixStream(sv[0]))
 
+# Close the fork server's fds in a new buffer process.
+proc closeForkServerFds(ctx: var ForkServerContext) =
+  ctx.stream.sclose()
+  ctx.loaderStream.sclose()
+  for zygote in ctx.zygotes:
+    zygote.stream.sclose()
+  ctx.zygotes.setLen(0)
+
+proc setupBufferStdout() =
+  let stdout = cast[ChaFile](stdout)
+  discard stdout.flush()
+  discard dup2(STDERR_FILENO, STDOUT_FILENO) # QJS logs errors to stdout
+  setbuf(stdout, nil)
+
+proc startBuffer(ctx: var ForkServerContext; jsctx: JSContext;
+    req: sink BufferRequest; fd: cint; urandom: PosixStream) =
+  setBufferProcessTitle(req.url)
+  let pid = getCurrentProcessId()
+  let pstream = newPosixStream(fd)
+  var cacheId: int
+  var loaderStream: PosixStream
+  var istream: PosixStream
+  var ring: SharedRing = nil
+  pstream.withPacketReader r:
+    r.sread(cacheId)
+    loaderStream = newPosixStream(r.recvFd())
+    istream = newPosixStream(r.recvFd())
+    var hasRing: bool
+    r.sread(hasRing)
+    if hasRing:
+      let memfd = r.recvFd()
+      let efd = r.recvFd()
+      ring = openSharedRing(memfd, efd)
+      if ring == nil:
+        quit(1)
+  do: # EOF in pager; give up
+    quit(1)
+  let loader = newFileLoader(pid, loaderStream)
+  # SIGPIPE remains ignored, because we don't want the buffer to signal
+  # just because the pager unregistered it (this can also happen when a
+  # buffer is cloned)
+  enterBufferSandbox()
+  launchBuffer(jsctx, req.config, req.url, req.attrs, req.ishtml,
+    req.charsetStack, loader, pstream, istream, urandom, ring, cacheId,
+    req.contentType, move(ctx.linkHintChars), move(ctx.schemes))
+  doAssert false
+
+# Fork a buffer process that waits for a BufferRequest.
+# Zygotes only enter the sandbox once they get the request, because
+# they must still set the process title; they do not touch any
+# untrusted data before that point.
+proc forkZygote(ctx: var ForkServerContext; rt: JSRuntime) =
+  var sv {.noinit.}: array[2, cint]
+  if socketpairCloexec(sv) != 0:
+    return
+  let scripting = ctx.zygoteScripting
+  stderr.flushFile()
+  let pid = fork()
+  if pid == 0:
+    # child process
+    discard close(sv[0])
+    ctx.closeForkServerFds()
+    setProcessTitle("cha buffer")
+    let urandom = newPosixStream("/dev/urandom", O_RDONLY, 0)
+    setupBufferStdout()
+    let jsctx = rt.newWindowContext(scripting)
+    let stream = newPosixStream(sv[1])
+    var req: BufferRequest
+    var fd = cint(-1)
+    stream.withPacketReader r:
+      r.sread(req)
+      fd = r.recvFd()
+    do: # fork server exited or dropped us
+      quit(0)
+    stream.sclose()
+    ctx.startBuffer(jsctx, req, fd, urandom)
+  discard close(sv[1])
+  if pid == -1:
+    discard close(sv[0])
+    return
+  ctx.zygotes.add(Zygote(
+    pid: int(pid),
+    stream: newPosixStream(sv[0]),
+    scripting: scripting
+  ))
+
+proc fillZygotes(ctx: var ForkServerContext; rt: JSRuntime) =
+  while ctx.zygotes.len < ctx.preforkBuffers:
+    let len = ctx.zygotes.len
+    ctx.forkZygote(rt)
+    if ctx.zygotes.len == len: # fork failed; try again next time
+      break
+
+# Pass req to a zygote with the right kind of JS context.
+# Returns the zygote's PID, or -1 if there is none.
+proc useZygote(ctx: var ForkServerContext; req: BufferRequest; fd: cint):
+    int =
+  let scripting = req.config.scripting != smFalse
+  # Subsequent zygotes get the kind that was requested last.
+  ctx.zygoteScripting = scripting
+  var i = 0
+  while i < ctx.zygotes.len and ctx.zygotes[i].scripting != scripting:
+    inc i
+  if i == ctx.zygotes.len:
+    if i > 0:
+      # Make room for one of the right kind.
+      ctx.zygotes[0].stream.sclose()
+      ctx.zygotes.delete(0)
+    return -1
+  let zygote = ctx.zygotes[i]
+  ctx.zygotes.delete(i)
+  let fd2 = dup(fd)
+  if fd2 == -1:
+    zygote.stream.sclose()
+    return -1
+  var res = zygote.pid
+  zygote.stream.withPacketWriter w:
+    w.swrite(req)
+    w.sendFd(fd2)
+  do: # died in the meantime
+    res = -1
+  zygote.stream.sclose()
+  return res
+
 proc forkBuffer(ctx: var ForkServerContext; r: var PacketReader;
     rt: JSRuntime): int =
-  var config: BufferConfig
-  var url: URL
-  var attrs: WindowAttributes
-  var ishtml: bool
-  var charsetStack: seq[Charset]
-  var contentType: string
-  r.sread(config)
-  r.sread(url)
-  r.sread(attrs)
-  r.sread(ishtml)
-  r.sread(charsetStack)
-  r.sread(contentType)
+  var req: BufferRequest
+  r.sread(req)
   let fd = r.recvFd()
+  ctx.lastRequest = req
+  ctx.hasLastRequest = true
+  let zpid = ctx.useZygote(req, fd)
+  if zpid != -1:
+    discard close(fd)
+    return zpid
   stderr.flushFile()
   let pid = fork()
   if pid == 0:
     # child process
-    ctx.stream.sclose()
-    ctx.loaderStream.sclose()
-    setBufferProcessTitle(url)
-    let pid = getCurrentProcessId()
+    ctx.closeForkServerFds()
     let urandom = newPosixStream("/dev/urandom", O_RDONLY, 0)
-    let pstream = newPosixStream(fd)
-    var cacheId: int
-    var loaderStream: PosixStream
-    var istream: PosixStream
-    pstream.withPacketReader r:
-      r.sread(cacheId)
-      loaderStream = newPosixStream(r.recvFd())
-      istream = newPosixStream(r.recvFd())
-    do: # EOF in pager; give up
-      quit(1)
-    let loader = newFileLoader(pid, loaderStream)
-    let stdout = cast[ChaFile](stdout)
-    discard stdout.flush()
-    discard dup2(STDERR_FILENO, STDOUT_FILENO) # QJS logs errors to stdout
-    setbuf(stdout, nil)
-    # SIGPIPE remains ignored, because we don't want the buffer to signal
-    # just because the pager unregistered it (this can also happen when a
-    # buffer is cloned)
-    enterBufferSandbox()
-    launchBuffer(rt, config, url, attrs, ishtml, charsetStack, loader, pstream,
-      istream, urandom, cacheId, contentType, move(ctx.linkHintChars),
-      move(ctx.schemes))
-    doAssert false
+    setupBufferStdout()
+    let jsctx = rt.newWindowContext(req.config.scripting != smFalse)
+    ctx.startBuffer(jsctx, req, fd, urandom)
   discard close(fd)
   return pid
 
+# Parse the stylesheets that the last buffer needed before forking
+# zygotes, so that the next buffer with the same settings inherits them.
+proc warmSheetCache(ctx: var ForkServerContext) =
+  if ctx.hasLastRequest:
+    let req = addr ctx.lastRequest
+    preparseSheets(req.attrs, req.config.scripting, req.config.headless,
+      req.contentType, req.config.userStyle)
+    ctx.hasLastRequest = false
+
+# Zygotes forked before the pager knew its window size did not get the
+# parsed sheets, so parse them now and fork new zygotes.
+proc warmSheetCache(ctx: var ForkServerContext; r: var PacketReader;
+    rt: JSRuntime) =
+  var attrs: WindowAttributes
+  var scripting: ScriptingMode
+  var headless: HeadlessMode
+  var userStyle: string
+  r.sread(attrs)
+  r.sread(scripting)
+  r.sread(headless)
+  r.sread(userStyle)
+  preparseSheets(attrs, scripting, headless, "text/html", userStyle)
+  ctx.zygoteScripting = scripting != smFalse
+  for zygote in ctx.zygotes:
+    zygote.stream.sclose()
+  ctx.zygotes.setLen(0)
+  ctx.fillZygotes(rt)
+
 proc forkCGI(ctx: var ForkServerContext; r: var PacketReader): int {.noinit.} =
   var hasIstream: bool
   r.sread(hasIstream)
@@ -192,6 +366,13 @@ proc forkCGI(ctx: var ForkServerContext; r: var PacketReader): int {.noinit.} =
   var hasOstreamOut2: bool
   r.sread(hasOstreamOut2)
   let ostreamOut2 = if hasOstreamOut2: newPosixStream(r.recvFd()) else: nil
+  # extra sockets for the adapter, whose numbers are passed in the
+  # environment variables named in fdEnv (e.g. CHA_KEEPALIVE_FD)
+  var fdEnv: seq[string]
+  r.sread(fdEnv)
+  var fds: seq[PosixStream] = @[]
+  for it in fdEnv:
+    fds.add(newPosixStream(r.recvFd()))
   var env: seq[tuple[name, value: string]]
   var argv: seq[string]
   var cmd: string
@@ -200,8 +381,7 @@ proc forkCGI(ctx: var ForkServerContext; r: var PacketReader): int {.noinit.} =
   r.sread(cmd)
   let pid = fork()
   if pid == 0: # child
-    ctx.stream.sclose()
-    ctx.loaderStream.sclose()
+    ctx.closeForkServerFds()
     # we leave stderr open, so it can be seen in the browser console
     if istream != nil:
       istream.moveFd(STDIN_FILENO)
@@ -218,6 +398,8 @@ proc forkCGI(ctx: var ForkServerContext; r: var PacketReader): int {.noinit.} =
       "Cha-Control: ConnectionError InternalError failed to execute CGI script"
     let stdout = cast[ChaFile](stdout)
     env.add(("SCRIPT_FILENAME", cmd))
+    for i, it in fdEnv:
+      env.add((it, $fds[i].fd))
     for it in env:
       if twtstr.setEnv(it.name, it.value).isErr:
         discard stdout.writeLine(ExecErrorMsg & " failed to set env vars")
@@ -243,6 +425,8 @@ proc forkCGI(ctx: var ForkServerContext; r: var PacketReader): int {.noinit.} =
     ostream.sclose()
     if ostreamOut2 != nil:
       ostreamOut2.sclose()
+    for it in fds:
+      it.sclose()
     return pid
 
 proc setupForkServerEnv(config: LoaderConfig): Opt[void] =
@@ -258,6 +442,7 @@ proc setupForkServerEnv(config: LoaderConfig): Opt[void] =
   ?twtstr.setEnv("CHA_DIR", config.configDir)
   ?twtstr.setEnv("CHA_DATA_DIR", config.dataDir)
   ?twtstr.setEnv("CHA_BOOKMARK", config.bookmark)
+  ?twtstr.setEnv("CHA_HTTP_CACHE_SIZE", $config.httpCacheSize)
   ok()
 
 const DefaultBrowsecap = """
@@ -297,12 +482,15 @@ proc runForkServer*(controlStream, loaderStream: PosixStream; pagerPid: int;
     var linkHintChars: string
     var urimethodmapPaths: seq[string]
     var autoBrowsecapPath: string
+    var preforkBuffers: int32
     r.sread(isCJKAmbiguous)
     r.sread(linkHintChars)
     r.sread(config)
     r.sread(clientConfig)
     r.sread(urimethodmapPaths)
     r.sread(autoBrowsecapPath)
+    r.sread(preforkBuffers)
+    ctx.preforkBuffers = max(int(preforkBuffers), 0)
     ctx.linkHintChars = linkHintChars.toPoints()
     # for CGI
     if setupForkServerEnv(config).isErr:
@@ -337,20 +525,32 @@ proc runForkServer*(controlStream, loaderStream: PosixStream; pagerPid: int;
     quit(1)
   ctx.pollData.register(ctx.stream.fd, POLLIN)
   ctx.pollData.register(ctx.loaderStream.fd, POLLIN)
+  ctx.fillZygotes(rt)
   block mainLoop:
     while true:
       ctx.pollData.poll(-1)
       for event in ctx.pollData.events:
         if (event.revents and POLLIN) != 0:
           if event.fd == ctx.stream.fd:
+            var cmd: ForkServerCommand
             ctx.stream.withPacketReader r:
-              let pid = ctx.forkBuffer(r, rt)
-              ctx.stream.withPacketWriter w:
-                w.swrite(pid)
-              do:
-                break mainLoop # EOF
+              r.sread(cmd)
+              case cmd
+              of fcForkBuffer:
+                let pid = ctx.forkBuffer(r, rt)
+                ctx.stream.withPacketWriter w:
+                  w.swrite(pid)
+                do:
+                  break mainLoop # EOF
+              of fcWarmSheets:
+                ctx.warmSheetCache(r, rt)
             do:
               break mainLoop # EOF
+            if cmd == fcForkBuffer:
+              # Replace the zygote we used, now that the pager has its
+              # PID.
+              ctx.warmSheetCache()
+              ctx.fillZygotes(rt)
           elif event.fd == ctx.loaderStream.fd:
             ctx.loaderStream.withPacketReader r:
               let pid = ctx.forkCGI(r)
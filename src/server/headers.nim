@@ -300,6 +300,11 @@ proc `[]=`*(this: Headers; name, value: string) =
   this.removeAll(name, n)
   this.add(name, value, n)
 
+proc `[]=`*(list: var HeaderList; name, value: string) =
+  let n = list.lowerBound(name)
+  list.removeAll(name, n)
+  list.insert((name, value), n)
+
 proc `[]`*(this: Headers; name: string): var string =
   let n = this.lowerBound(name)
   return this.list[n].value
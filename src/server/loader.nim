@@ -36,17 +36,20 @@ import io/dynstream
 import io/packetreader
 import io/packetwriter
 import io/poll
+import io/sharedring
 import monoucha/jsbind
 import monoucha/jsref
 import monoucha/quickjs
 import server/connectionerror
 import server/headers
 import server/loaderiface
+import server/pendingqueue
 import server/request
 import types/blob
 import types/formdata
 import types/opt
 import types/url
+import utils/myposix
 import utils/twtstr
 
 # Try to make it a SmallChunk.
@@ -54,6 +57,7 @@ import utils/twtstr
 # (See system/alloc.nim for details.)
 #TODO measure this on 32-bit too, we get a few more bytes there
 const LoaderBufferPageSize = 4016 # 4096 - 64 - 16
+const ZeroCopyChunkSize = 1 shl 20
 
 # Override posix.Time
 type Time = times.Time
@@ -70,6 +74,13 @@ type
     page: seq[uint8]
     next: LoaderBuffer
 
+  # How to move data from an InputHandle to its output when there is
+  # exactly one output and nothing is queued for it.
+  ZeroCopyMode = enum
+    zcmNone # always go through LoaderBuffers
+    zcmSplice # input is a pipe
+    zcmSendfile # input is a regular file
+
   LoaderHandle = ref object of RootObj
     registered: bool # track registered state
     stream: PosixStream # input/output stream depending on type
@@ -87,6 +98,8 @@ type
     startTime: Time # time when download of the body was started
     connectionOwner: ClientHandle # set if the handle counts in numConnections
     lastBuffer: LoaderBuffer # tail of buffer linked list
+    zeroCopy: ZeroCopyMode
+    rangeSource: RangeSource # set for navigations that may be segmented
 
   OutputHandle {.final.} = ref object of LoaderHandle
     parent: InputHandle
@@ -95,9 +108,52 @@ type
     owner: ClientHandle
     outputId: int
     istreamAtEnd: bool
-    suspended: bool
+    suspended: bool # suspended by the client
+    ringFull: bool # ring has no room left; wait for readRingWake
     dead: bool
     bytesSent: uint64
+    segment: DownloadSegment # set if writing a range of a download
+    ring: SharedRing # if set, the body goes here; stream only wakes the reader
+    wakeHandle: RingWakeHandle # registered while ring is set
+
+  # An idle HTTP connection, returned by an adapter after it has read a
+  # complete response.  It stays registered for POLLIN so that we notice
+  # if the server closes it while it is in the pool.
+  PooledConnection {.final.} = ref object of LoaderHandle
+    key: string # scheme, host, port and proxy of the connection
+    idleSince: Time
+
+  # Loader end of the socket through which an HTTP adapter receives an
+  # idle connection, and sends it back once it is done with it.
+  KeepAliveHandle {.final.} = ref object of LoaderHandle
+    key: string
+
+  # Loader end of the socket through which a TLS adapter receives a
+  # session to resume, and sends back the session tickets it gets.
+  TLSSessionHandle {.final.} = ref object of LoaderHandle
+    key: string
+    gotResult: bool # whether the adapter reported the handshake result
+
+  # Control socket of a resident adapter, which forks a child for each
+  # request we send it instead of being executed anew (see cgiMain in
+  # lcgi).  Besides requests, the adapter only ever sends us the PID of
+  # the child, so POLLIN outside of loadCGI means that it has exited.
+  ResidentWorker {.final.} = ref object of LoaderHandle
+    cmd: string
+    lastUsed: Time
+
+  # eventfd through which a buffer tells us that it has made room in the
+  # shared ring of output.
+  RingWakeHandle {.final.} = ref object of LoaderHandle
+    output: OutputHandle
+
+  # Connection state that an adapter may share with others through the
+  # loader.
+  ConnReuse = object
+    key: string # scheme, host, port and proxy
+    keepAlive: bool # pool idle connections (plain HTTP)
+    takeIdle: bool # may take an idle connection (idempotent requests only)
+    tlsSession: bool # resume TLS sessions (HTTPS, Gemini)
 
   HandleParserState = enum
     hpsBeforeLines, hpsAfterFirstLine, hpsControlDone
@@ -124,7 +180,11 @@ type
     cmd: string
     env: seq[EnvVar]
     argv: seq[string]
-    next: PendingRequest
+    reuse: ConnReuse
+    # exported for PendingQueue
+    priority*: RequestPriority
+    ticket*: uint64
+    next*: PendingRequest
 
   ClientHandle {.final.} = ref object of LoaderHandle
     pid: int
@@ -139,8 +199,7 @@ type
     numConnections: int
     # Requests that will only be sent once numConnections no longer exceeds
     # maxNetConnections.
-    pendingHead: PendingRequest
-    pendingTail: PendingRequest
+    pending: PendingQueue[PendingRequest]
 
   DownloadItem = ref object
     escapedPath: string
@@ -149,6 +208,36 @@ type
     sent: uint64
     contentLen: uint64
     startTime: Time
+    # The rest is only used by segmented downloads.
+    file: PosixStream # target file; nil once finished or stopped
+    source: RangeSource
+    segments: seq[DownloadSegment]
+    statePath: string
+    lastSaved: Time
+    failed: bool
+
+  # The request of a navigation, kept so that the download of its
+  # response may be split into ranged requests.
+  RangeSource = ref object
+    request: RawRequest
+    config: LoaderClientConfig
+    client: ClientHandle
+    credentials: bool
+    resource: bool
+    rangeable: bool # Accept-Ranges is bytes and the length is known
+    validator: string # strong ETag or Last-Modified
+
+  # A byte range of a segmented download, fetched by its own request
+  # and written at its offset into the target file.
+  DownloadSegment = ref object
+    start: uint64
+    offset: uint64 # next byte to write
+    endOff: uint64 # one past the last byte of the range
+    output: OutputHandle # nil if not connected
+    connStart: uint64 # offset at the time output was connected
+    connTime: Time
+    retries: int
+    refused: bool # the server did not honor our Range header
 
   LoaderContext = object
     pid: int
@@ -174,6 +263,19 @@ type
     cookieStream: InputHandle
     pendingConnections: seq[ClientHandle]
     browsecap: Mailcap
+    # Idle connections, ordered from least to most recently returned.
+    connPool: seq[PooledConnection]
+    # Pooled connections, keep-alive and TLS session channels, and
+    # resident workers to close at the end of this iteration.
+    unregPool: seq[LoaderHandle]
+    # Serialized TLS sessions, ordered from least to most recently stored.
+    tlsSessions: seq[tuple[key, session: string]]
+    tlsSessionHits: int
+    tlsSessionMisses: int
+    # Resident adapters, ordered from least to most recently used.
+    workers: seq[ResidentWorker]
+    # Directory of the adapters that may be kept resident.
+    residentDir: string
 
   LoaderConfig* = object
     cgiDir*: seq[string]
@@ -183,6 +285,11 @@ type
     dataDir*: string
     bookmark*: string
     maxNetConnections*: int
+    maxKeepAlivePerHost*: int
+    keepAliveTimeout*: int # in seconds
+    residentAdapters*: bool
+    httpCacheSize*: int # in megabytes
+    downloadSegments*: int
 
   PushBufferResult = enum
     pbrDone, pbrUnregister
@@ -193,7 +300,8 @@ type
 # Forward declarations
 proc loadCGI(ctx: var LoaderContext; client: ClientHandle; handle: InputHandle;
   body: var RequestBody; config: LoaderClientConfig; cmd: var string;
-  env: var seq[EnvVar]; argv: openArray[string]; tocache, canThrottle: bool)
+  env: var seq[EnvVar]; argv: openArray[string]; reuse: ConnReuse;
+  priority: RequestPriority; tocache, canThrottle: bool)
 proc pushBuffer(ctx: var LoaderContext; handle: InputHandle;
   buffer: LoaderBuffer; ignoreSuspension: bool;
   unregWrite: var seq[OutputHandle])
@@ -304,6 +412,11 @@ proc sendResult(ctx: var LoaderContext; handle: InputHandle; res: int;
   assert handle.rstate == rsBeforeResult
   let output = handle.output
   inc handle.rstate
+  if output.segment != nil: # only the body goes to the file
+    if res != 0:
+      return pbrUnregister
+    inc handle.rstate
+    return pbrDone
   let buffer = bufferFromWriter w:
     w.swrite(res)
     if res == 0: # success
@@ -333,6 +446,19 @@ proc updateCookies(ctx: var LoaderContext; cookieJar: CookieJar;
   if ctx.cookieStream.output.dead:
     ctx.cookieStream = nil
 
+proc initRange(source: RangeSource; headers: openArray[HTTPHeader];
+    contentLen: uint64) =
+  # Ranges of a coded body are ranges of the coded data, which we never
+  # get to see.
+  source.rangeable = contentLen != uint64.high and
+    headers.getFirst("Accept-Ranges").equalsIgnoreCase("bytes") and
+    headers.getFirst("Content-Encoding") == ""
+  let etag = headers.getFirst("ETag")
+  if etag != "" and not etag.startsWith("W/"):
+    source.validator = etag
+  else:
+    source.validator = headers.getFirst("Last-Modified")
+
 proc sendStatus(ctx: var LoaderContext; handle: InputHandle; status: uint16;
     headers: openArray[HTTPHeader]): PushBufferResult =
   assert handle.rstate == rsBeforeStatus
@@ -341,6 +467,19 @@ proc sendStatus(ctx: var LoaderContext; handle: InputHandle; status: uint16;
   handle.startTime = getTime()
   handle.contentLen = parseUInt64(contentLens).get(uint64.high)
   let output = handle.output
+  let segment = output.segment
+  if segment != nil:
+    let prefix = "bytes " & $segment.offset & '-'
+    if status != 206 or
+        not headers.getFirst("Content-Range").startsWith(prefix):
+      segment.refused = true
+      return pbrUnregister
+    return pbrDone
+  if handle.rangeSource != nil:
+    if status == 200:
+      handle.rangeSource.initRange(headers, handle.contentLen)
+    if not handle.rangeSource.rangeable:
+      handle.rangeSource = nil # cannot be split; drop the request copy
   let cookieJar = output.owner.config.cookieJar
   if cookieJar != nil and handle.credentials:
     # Never persist in loader; we save cookies in the pager.
@@ -374,6 +513,54 @@ proc write(ps: PosixStream; buffer: LoaderBuffer; si = 0): int {.inline.} =
   assert len > 0
   return ps.write(addr buffer.page[si], len)
 
+# Copy as much of buffer as fits into the shared ring of output, and
+# poke the reader through the pipe if it is waiting for data.  If the
+# ring fills up, the output waits until the reader wakes us up through
+# the eventfd (see readRingWake).
+proc writeRing(output: OutputHandle; buffer: LoaderBuffer; si: int): int =
+  let ring = output.ring
+  let len = buffer.len - si
+  var n = 0
+  var wake = false
+  while n < len:
+    n += ring.write(addr buffer.page[si + n], len - n, wake)
+    if n < len and ring.waitWriter():
+      output.ringFull = true
+      break
+  if wake:
+    var c = 0u8
+    if output.stream.write(addr c, 1) < 0 and errno == EPIPE:
+      return -1
+    # on EAGAIN, the pipe already holds a wakeup
+  return n
+
+# Like the above, but writes to a shared ring or a segment of a download
+# at its offset.  Data past the end of the segment is dropped.
+proc write(output: OutputHandle; buffer: LoaderBuffer; si = 0): int =
+  if output.ring != nil:
+    return output.writeRing(buffer, si)
+  let segment = output.segment
+  if segment == nil:
+    return output.stream.write(buffer, si)
+  let len = buffer.len - si
+  let n = int(min(uint64(len), segment.endOff - segment.offset))
+  if n > 0:
+    let m = pwrite(output.stream.fd, addr buffer.page[si], n,
+      Off(segment.offset))
+    if m < 0:
+      return -1
+    segment.offset += uint64(m)
+    if m < n:
+      return m
+  return len
+
+# Move pending requests for url to the queue of priority.
+proc setPriority(client: ClientHandle; url: URL; priority: RequestPriority) =
+  let surl = $url
+  client.pending.setPriority(priority, proc(it: PendingRequest): bool =
+    $it.handle.url == surl
+  )
+
 proc iclose(ctx: var LoaderContext; handle: InputHandle) =
   if handle.stream != nil:
     ctx.unset(handle)
@@ -382,7 +569,7 @@ proc iclose(ctx: var LoaderContext; handle: InputHandle) =
   let client = handle.connectionOwner
   if client != nil:
     if client.numConnections == ctx.config.maxNetConnections and
-        client.pendingHead != nil:
+        not client.pending.isEmpty():
       ctx.pendingConnections.add(client)
     dec client.numConnections
     handle.connectionOwner = nil
@@ -391,6 +578,12 @@ proc oclose(ctx: var LoaderContext; output: OutputHandle) =
   ctx.unset(output)
   output.stream.sclose()
   output.stream = nil
+  if output.ring != nil:
+    output.ring.unmap()
+    ctx.unregPool.add(output.wakeHandle)
+    output.wakeHandle.output = nil # break cycle
+    output.wakeHandle = nil
+    output.ring = nil
   output.parent = nil # break cycle
 
 proc close(ctx: var LoaderContext; handle: InputHandle) =
@@ -501,6 +694,206 @@ proc unregister(ctx: var LoaderContext; client: ClientHandle) =
   ctx.pollData.unregister(int(client.stream.fd))
   client.registered = false
 
+proc register(ctx: var LoaderContext; handle: PooledConnection |
+    KeepAliveHandle | TLSSessionHandle | ResidentWorker | RingWakeHandle) =
+  assert not handle.registered
+  ctx.pollData.register(handle.stream.fd, cshort(POLLIN))
+  handle.registered = true
+
+proc unregister(ctx: var LoaderContext; handle: PooledConnection |
+    KeepAliveHandle | TLSSessionHandle | ResidentWorker | RingWakeHandle) =
+  assert handle.registered
+  ctx.pollData.unregister(int(handle.stream.fd))
+  handle.registered = false
+
+# Connection pool for HTTP keep-alive.
+#
+# Adapters cannot share sockets directly, so the loader acts as the
+# owner of all idle connections.  Each adapter that may reuse a
+# connection receives a socket (CHA_KEEPALIVE_FD) through which we send
+# it either an idle connection to the same origin or nothing, and
+# through which it passes the connection back once it has read a
+# complete response.
+proc getKeepAliveKey(url: URL; config: LoaderClientConfig): string =
+  result = url.scheme & "://" & url.hostname & ':' & url.port
+  if config.proxy != nil:
+    result &= ' ' & $config.proxy
+
+proc keepAliveDuration(ctx: LoaderContext): Duration =
+  initDuration(seconds = ctx.config.keepAliveTimeout)
+
+proc dropPooled(ctx: var LoaderContext; i: int) =
+  ctx.unregPool.add(ctx.connPool[i])
+  ctx.connPool.delete(i)
+
+proc dropPooled(ctx: var LoaderContext; conn: PooledConnection) =
+  let i = ctx.connPool.find(conn)
+  if i != -1:
+    ctx.dropPooled(i)
+
+# Close connections that have been idle for too long.
+proc pruneConnPool(ctx: var LoaderContext) =
+  let now = getTime()
+  let timeout = ctx.keepAliveDuration()
+  while ctx.connPool.len > 0 and now - ctx.connPool[0].idleSince >= timeout:
+    ctx.dropPooled(0)
+
+# TLS session cache.
+#
+# Like idle connections, TLS sessions of different adapter processes can
+# only be shared through the loader.  Adapters connecting with TLS
+# receive a socket (CHA_TLS_SESSION_FD) on which we send the last
+# session stored for the same host, if any.  The adapter then reports
+# whether it could resume it, and passes back each new session ticket
+# that the server sends.
+const MaxTLSSessions = 64
+
+proc openTLSSession(ctx: var LoaderContext; key: string): PosixStream =
+  var sv {.noinit.}: array[2, cint]
+  if socketpair(AF_UNIX, SOCK_STREAM, IPPROTO_IP, sv) != 0:
+    return nil
+  let handle = TLSSessionHandle(stream: newPosixStream(sv[0]), key: key)
+  var session = ""
+  for it in ctx.tlsSessions.ritems:
+    if it.key == key:
+      session = it.session
+      break
+  var fail = false
+  handle.stream.withPacketWriter w:
+    w.swrite(session)
+  do:
+    fail = true
+  if fail:
+    handle.stream.sclose()
+    discard close(sv[1])
+    return nil
+  ctx.register(handle)
+  ctx.put(handle)
+  return newPosixStream(sv[1])
+
+proc addTLSSession(ctx: var LoaderContext; key, session: sink string) =
+  for i, it in ctx.tlsSessions.mypairs:
+    if it.key == key:
+      ctx.tlsSessions.delete(i)
+      break
+  if ctx.tlsSessions.len >= MaxTLSSessions:
+    ctx.tlsSessions.delete(0)
+  ctx.tlsSessions.add((key, session))
+
+# Returns false on EOF.
+proc readTLSSession(ctx: var LoaderContext; handle: TLSSessionHandle): bool =
+  result = true
+  handle.stream.withPacketReader r:
+    var isTicket: bool
+    r.sread(isTicket)
+    if isTicket:
+      var session: string
+      r.sread(session)
+      ctx.addTLSSession(handle.key, move(session))
+    else:
+      var reused: bool
+      r.sread(reused)
+      if not handle.gotResult:
+        if reused:
+          inc ctx.tlsSessionHits
+        else:
+          inc ctx.tlsSessionMisses
+        handle.gotResult = true
+  do: # the adapter is done
+    ctx.unregPool.add(handle)
+    result = false
+
+proc dropWorker(ctx: var LoaderContext; worker: ResidentWorker) =
+  let i = ctx.workers.find(worker)
+  if i != -1:
+    ctx.workers.delete(i)
+    ctx.unregPool.add(worker)
+
+# Let resident adapters that have been idle for too long exit.
+proc pruneWorkers(ctx: var LoaderContext) =
+  let now = getTime()
+  let timeout = ctx.keepAliveDuration()
+  while ctx.workers.len > 0 and now - ctx.workers[0].lastUsed >= timeout:
+    ctx.dropWorker(ctx.workers[0])
+
+# Milliseconds until the oldest idle connection or resident adapter
+# expires, or -1 if there are none.
+proc pollTimeout(ctx: LoaderContext): cint =
+  var oldest: Time
+  if ctx.connPool.len > 0:
+    oldest = ctx.connPool[0].idleSince
+    if ctx.workers.len > 0:
+      oldest = min(oldest, ctx.workers[0].lastUsed)
+  elif ctx.workers.len > 0:
+    oldest = ctx.workers[0].lastUsed
+  else:
+    return -1
+  let left = oldest + ctx.keepAliveDuration() - getTime()
+  return cint(clamp(left.inMilliseconds, 0, int64(cint.high)))
+
+proc addPooled(ctx: var LoaderContext; key: string; ps: PosixStream) =
+  let maxIdle = min(ctx.config.maxKeepAlivePerHost,
+    ctx.config.maxNetConnections)
+  var n = 0
+  var oldest = -1
+  for i, it in ctx.connPool.mypairs:
+    if it.key == key:
+      if oldest == -1:
+        oldest = i
+      inc n
+  if n >= maxIdle:
+    if oldest == -1: # maxIdle is 0
+      ps.sclose()
+      return
+    ctx.dropPooled(oldest)
+  let conn = PooledConnection(stream: ps, key: key, idleSince: getTime())
+  ctx.register(conn)
+  ctx.put(conn)
+  ctx.connPool.add(conn)
+
+# Take the most recently used idle connection to key out of the pool.
+proc takePooled(ctx: var LoaderContext; key: string): PooledConnection =
+  ctx.pruneConnPool()
+  for i in countdown(ctx.connPool.high, 0):
+    let conn = ctx.connPool[i]
+    if conn.key == key:
+      ctx.connPool.delete(i)
+      ctx.unregister(conn)
+      ctx.unset(conn)
+      return conn
+  nil
+
+# Set up the keep-alive channel of an HTTP adapter, and return the
+# adapter's end.
+proc openKeepAlive(ctx: var LoaderContext; key: string; reuse: bool):
+    PosixStream =
+  var sv {.noinit.}: array[2, cint]
+  if socketpair(AF_UNIX, SOCK_STREAM, IPPROTO_IP, sv) != 0:
+    return nil
+  let handle = KeepAliveHandle(stream: newPosixStream(sv[0]), key: key)
+  let conn = if reuse: ctx.takePooled(key) else: nil
+  var fail = false
+  handle.stream.withPacketWriter w:
+    w.swrite(conn != nil)
+    if conn != nil:
+      w.sendFd(conn.stream.fd) # closed by the writer
+  do:
+    fail = true
+  if fail:
+    handle.stream.sclose()
+    discard close(sv[1])
+    return nil
+  ctx.register(handle)
+  ctx.put(handle)
+  return newPosixStream(sv[1])
+
+proc readKeepAlive(ctx: var LoaderContext; handle: KeepAliveHandle) =
+  handle.stream.withPacketReader r:
+    ctx.addPooled(handle.key, newPosixStream(r.recvFd()))
+  do: # the adapter exited without returning its connection
+    discard
+  ctx.unregPool.add(handle)
+
 # Either write data to the target output, or append it to the list of
 # buffers to write and register the output in our selector.
 # ignoreSuspension is meant to be used when sending the connection
@@ -519,11 +912,11 @@ proc pushBuffer(ctx: var LoaderContext; handle: InputHandle;
       # do not push to unregWrite candidates
       continue
     if output.currentBuffer == nil:
-      if output.suspended and not ignoreSuspension:
+      if output.ringFull or output.suspended and not ignoreSuspension:
         output.currentBuffer = buffer
         output.currentBufferIdx = 0
       else:
-        var n = output.stream.write(buffer)
+        var n = output.write(buffer)
         if n < 0:
           let e = errno
           if e == EAGAIN or e == EWOULDBLOCK or e == EINTR:
@@ -538,7 +931,8 @@ proc pushBuffer(ctx: var LoaderContext; handle: InputHandle;
         if n < buffer.len:
           output.currentBuffer = buffer
           output.currentBufferIdx = n
-          ctx.register(output)
+          if not output.suspended and not output.ringFull:
+            ctx.register(output)
 
 proc redirectToFile(ctx: var LoaderContext; output: OutputHandle;
     targetPath: string; fileOutput: var OutputHandle; osent: var uint64): bool =
@@ -793,9 +1187,62 @@ proc finishParse(ctx: var LoaderContext; handle: InputHandle) =
 type HandleReadResult = enum
   hrrDone, hrrUnregister, hrrBrokenPipe
 
+type ZeroCopyResult = enum
+  zcrFallback, zcrDone, zcrEOF
+
+proc canZeroCopy(handle: InputHandle): bool =
+  when HasZeroCopy:
+    return handle.zeroCopy != zcmNone and handle.parser == nil and
+      handle.outputs.len == 1 and handle.outputs[0].isEmpty and
+      not handle.outputs[0].dead and handle.outputs[0].segment == nil and
+      handle.outputs[0].ring == nil
+  else:
+    return false
+
+# Fast path of handleRead for a single output that is not waiting on
+# any buffers: let the kernel move the data directly.
+# EAGAIN does not tell us whether the input is empty or the output is
+# full, so in that case we fall back to handleRead, which either finds
+# nothing to read or queues up the data and registers the output.
+proc handleReadZeroCopy(ctx: var LoaderContext; handle: InputHandle;
+    unregWrite: var seq[OutputHandle]): ZeroCopyResult =
+  when HasZeroCopy:
+    let output = handle.outputs[0]
+    let ifd = handle.stream.fd
+    let ofd = output.stream.fd
+    while true:
+      let n = if handle.zeroCopy == zcmSplice:
+        splice(ifd, ofd, ZeroCopyChunkSize)
+      else:
+        sendfile(ifd, ofd, ZeroCopyChunkSize)
+      if n < 0:
+        let e = errno
+        if e == EPIPE: # receiver died
+          output.dead = true
+          unregWrite.add(output)
+          return zcrDone
+        if e != EAGAIN and e != EWOULDBLOCK and e != EINTR:
+          # not supported for this pair of fds
+          handle.zeroCopy = zcmNone
+        return zcrFallback
+      if n == 0:
+        return zcrEOF
+      handle.bytesSeen += uint64(n)
+      output.bytesSent += uint64(n)
+      # nobody is waiting on the buffer chain
+      handle.lastBuffer = nil
+  else:
+    zcrFallback
+
+
 # Called whenever there is more data available to read.
 proc handleRead(ctx: var LoaderContext; handle: InputHandle;
     unregWrite: var seq[OutputHandle]): HandleReadResult =
+  if handle.canZeroCopy():
+    case ctx.handleReadZeroCopy(handle, unregWrite)
+    of zcrFallback: discard
+    of zcrDone: return hrrDone
+    of zcrEOF: return hrrUnregister
   let maxUnregs = unregWrite.len + handle.outputs.len
   while true:
     var buffer = newLoaderBuffer()
@@ -878,7 +1325,7 @@ proc loadStreamRegular(ctx: var LoaderContext;
       cachedHandle.outputs.add(output)
   else:
     for output in handle.outputs:
-      if output.registered or output.suspended:
+      if output.registered or output.suspended or output.ringFull:
         output.parent = nil
         output.istreamAtEnd = true
       else:
@@ -976,6 +1423,7 @@ proc writeBody(ctx: var LoaderContext; ostream, istream2: PosixStream;
       let handle = ctx.newInputHandle(ostream, client,
         parseURL0("cache:/dev/null"), credentials = false, suspended = false)
       handle.stream = istream2
+      handle.zeroCopy = zcmSendfile
       ostream.setBlocking(false)
       ctx.loadStreamRegular(handle, cachedHandle)
       assert handle.stream == nil
@@ -1016,10 +1464,89 @@ proc setupCmd(ctx: LoaderContext; path: string; cmd: var string;
         return ceNone
   ceCGIFileNotFound
 
+# Send a request to execute cmd to stream, which is either the fork
+# server or a resident adapter.  fdEnv lists extra file descriptors to
+# pass to the process, and the environment variables that it receives
+# their numbers in.
+# Returns the PID of the new process, or -1 on failure.
+proc sendCGI(stream, istream, ostreamOut, ostreamOut2: PosixStream;
+    fdEnv: openArray[tuple[name: string; ps: PosixStream]];
+    env: openArray[EnvVar]; argv: openArray[string]; cmd: string): int =
+  var pid = -1
+  stream.withPacketWriter w:
+    w.swrite(istream != nil)
+    if istream != nil:
+      w.sendFd(istream.fd)
+    w.sendFd(ostreamOut.fd)
+    w.swrite(ostreamOut2 != nil)
+    if ostreamOut2 != nil:
+      w.sendFd(ostreamOut2.fd)
+    w.swrite(fdEnv.len)
+    for it in fdEnv:
+      w.swrite(it.name)
+      w.sendFd(it.ps.fd)
+    w.swrite(env)
+    w.swrite(argv)
+    w.swrite(cmd)
+  do:
+    return -1
+  stream.withPacketReader r:
+    r.sread(pid)
+  do:
+    pid = -1
+  pid
+
+# Adapters that implement the resident protocol.
+const ResidentAdapters = ["http", "https", "gemini", "file"]
+
+proc spawnWorker(ctx: var LoaderContext; cmd: string): ResidentWorker =
+  var sv {.noinit.}: array[2, cint]
+  if socketpair(AF_UNIX, SOCK_STREAM, IPPROTO_IP, sv) != 0:
+    return nil
+  # stdout of the worker itself is unused
+  let devnull = newPosixStream("/dev/null", O_WRONLY, 0)
+  if devnull == nil:
+    discard close(sv[0])
+    discard close(sv[1])
+    return nil
+  let control = newPosixStream(sv[1])
+  let pid = ctx.forkStream.sendCGI(nil, devnull, nil,
+    [("CHA_RESIDENT_FD", control)], [], [], cmd)
+  if pid == -1:
+    discard close(sv[0])
+    return nil
+  let worker = ResidentWorker(
+    stream: newPosixStream(sv[0]),
+    cmd: cmd,
+    lastUsed: getTime()
+  )
+  ctx.register(worker)
+  ctx.put(worker)
+  ctx.workers.add(worker)
+  return worker
+
+# Return a resident adapter for cmd, or nil if it must be started
+# through the fork server.
+proc getWorker(ctx: var LoaderContext; cmd: string): ResidentWorker =
+  if not ctx.config.residentAdapters or ctx.residentDir == "" or
+      cmd.parentDir() != ctx.residentDir or
+      cmd.lastPathPart() notin ResidentAdapters:
+    return nil
+  for i, it in ctx.workers.mypairs:
+    if it.cmd == cmd:
+      # keep workers ordered by last use
+      let worker = it
+      ctx.workers.delete(i)
+      ctx.workers.add(worker)
+      worker.lastUsed = getTime()
+      return worker
+  return ctx.spawnWorker(cmd)
+
 proc loadCGIImpl(ctx: var LoaderContext; client: ClientHandle;
     handle: InputHandle; body: var RequestBody; config: LoaderClientConfig;
     cmd: var string; env: var seq[EnvVar]; argv: openArray[string];
-    tocache, canThrottle: bool): ConnectionError =
+    reuse: ConnReuse; priority: RequestPriority; tocache, canThrottle: bool):
+    ConnectionError =
   if canThrottle:
     # Quick hack to throttle the number of simultaneous ongoing
     # connections.
@@ -1035,13 +1562,11 @@ proc loadCGIImpl(ctx: var LoaderContext; client: ClientHandle;
         tocache: tocache,
         argv: @argv,
         cmd: move(cmd),
-        env: move(env)
+        env: move(env),
+        reuse: reuse,
+        priority: priority
       )
-      if client.pendingTail != nil:
-        client.pendingTail.next = pending
-      else:
-        client.pendingHead = pending
-      client.pendingTail = pending
+      client.pending.add(pending)
       return ceNone
     inc client.numConnections
   # Pipe the response body as stdout.
@@ -1091,40 +1616,38 @@ proc loadCGIImpl(ctx: var LoaderContext; client: ClientHandle;
       return ceFailedToSetUpCGI
     istream = newPosixStream(pipefdRead[0])
     ostream = newPosixStream(pipefdRead[1])
-  var pid: int
-  ctx.forkStream.withPacketWriter w:
-    w.swrite(istream != nil)
-    if istream != nil:
-      w.sendFd(istream.fd)
-    w.sendFd(ostreamOut.fd)
-    w.swrite(ostreamOut2 != nil)
-    if ostreamOut2 != nil:
-      w.sendFd(ostreamOut2.fd)
-    w.swrite(env)
-    w.swrite(argv)
-    w.swrite(cmd)
-  do:
-    pid = -1
-  if pid != -1:
-    ctx.forkStream.withPacketReader r:
-      r.sread(pid)
-    do:
-      pid = -1
+  var fdEnv: seq[tuple[name: string; ps: PosixStream]] = @[]
+  if reuse.keepAlive:
+    # child end of the keep-alive channel
+    let keepAlive = ctx.openKeepAlive(reuse.key, reuse.takeIdle)
+    if keepAlive != nil:
+      fdEnv.add(("CHA_KEEPALIVE_FD", keepAlive))
+  if reuse.tlsSession:
+    let tlsSession = ctx.openTLSSession(reuse.key)
+    if tlsSession != nil:
+      fdEnv.add(("CHA_TLS_SESSION_FD", tlsSession))
+  let worker = ctx.getWorker(cmd)
+  let stream = if worker != nil: worker.stream else: ctx.forkStream
+  let pid = stream.sendCGI(istream, ostreamOut, ostreamOut2, fdEnv, env, argv,
+    cmd)
   if pid == -1:
+    if worker != nil: # probably exited; start a new one next time
+      ctx.dropWorker(worker)
     if ostream != nil:
       ostream.sclose()
     return ceFailedToSetUpCGI
   handle.parser = HeaderParser()
   handle.stream = istreamOut
+  handle.zeroCopy = zcmSplice
   ctx.writeBody(ostream, istream2, body, client, outputIn, cachedHandle)
   ceNone
 
 proc loadCGI(ctx: var LoaderContext; client: ClientHandle; handle: InputHandle;
     body: var RequestBody; config: LoaderClientConfig; cmd: var string;
-    env: var seq[EnvVar]; argv: openArray[string];
-    tocache, canThrottle: bool) =
+    env: var seq[EnvVar]; argv: openArray[string]; reuse: ConnReuse;
+    priority: RequestPriority; tocache, canThrottle: bool) =
   let code = ctx.loadCGIImpl(client, handle, body, config, cmd, env, argv,
-    tocache, canThrottle)
+    reuse, priority, tocache, canThrottle)
   if code == ceNone:
     if handle.stream != nil:
       ctx.addFd(handle)
@@ -1154,6 +1677,10 @@ proc loadStream(ctx: var LoaderContext; client: ClientHandle;
   doAssert fstat(ps.fd, stats) != -1
   handle.stream = ps
   client.passedFdMap.del(i)
+  if S_ISFIFO(stats.st_mode):
+    handle.zeroCopy = zcmSplice
+  elif S_ISREG(stats.st_mode):
+    handle.zeroCopy = zcmSendfile
   if S_ISCHR(stats.st_mode) or S_ISREG(stats.st_mode):
     # regular file: e.g. cha <file
     # or character device: e.g. cha </dev/null
@@ -1170,6 +1697,7 @@ proc loadFromCache(ctx: var LoaderContext; client: ClientHandle;
     if startFrom != 0:
       discard ps.seek(startFrom)
     handle.stream = ps
+    handle.zeroCopy = zcmSendfile
     if ps == nil:
       ctx.rejectHandle(handle, ceFileNotInCache)
       client.cacheMap.del(n)
@@ -1186,7 +1714,8 @@ proc loadFromCache(ctx: var LoaderContext; client: ClientHandle;
     ctx.rejectHandle(handle, ceURLNotInCache)
 
 proc finishOutputSend(ctx: var LoaderContext; output: OutputHandle) =
-  if not output.dead and (output.registered or output.suspended):
+  if not output.dead and
+      (output.registered or output.suspended or output.ringFull):
     output.istreamAtEnd = true
   else:
     if output.registered:
@@ -1232,6 +1761,79 @@ proc loadData(ctx: var LoaderContext; handle: InputHandle;
     ctx.loadDataSend(handle, body, ct)
 
 # Download manager. Based on (you guessed it) w3m.
+# Segmented downloads record the ranges they are missing next to the
+# target file, so that an interrupted download can be resumed later.
+const SegmentStateSuffix = ".cha-segments"
+
+# Downloads are only split into segments at least this large.
+const MinSegmentSize = 1u64 shl 20
+
+# Number of times a segment is reconnected without making progress
+# before we give up on the download.
+const MaxSegmentRetries = 3
+
+proc running(dl: DownloadItem): bool =
+  return dl.output != nil or dl.file != nil
+
+proc saveSegments(dl: DownloadItem) =
+  var s = $dl.source.request.url & '\n' & dl.source.validator & '\n' &
+    $dl.contentLen & '\n'
+  for it in dl.segments:
+    if it.offset < it.endOff:
+      s &= $it.offset & ' ' & $it.endOff & '\n'
+  let tmp = dl.statePath & ".tmp"
+  let ps = newPosixStream(tmp, O_CREAT or O_WRONLY or O_TRUNC, 0o600)
+  if ps != nil:
+    let res = ps.writeLoop(s)
+    ps.sclose()
+    if res.isOk:
+      discard rename(cstring(tmp), cstring(dl.statePath))
+  dl.lastSaved = getTime()
+
+# Read back the ranges missing from an earlier attempt at the same
+# download.
+proc loadSegments(dl: DownloadItem): bool =
+  let ps = newPosixStream(dl.statePath)
+  if ps == nil:
+    return false
+  let s = ps.readAll()
+  ps.sclose()
+  let header = [$dl.source.request.url, dl.source.validator, $dl.contentLen]
+  var i = 0
+  for line in s.split('\n'):
+    if i < header.len:
+      if line != header[i]:
+        return false
+    elif line != "":
+      let offset = parseUInt64(line.until(' ')).get(uint64.high)
+      let endOff = parseUInt64(line.after(' ')).get(0)
+      if offset >= endOff or endOff > dl.contentLen:
+        dl.segments.setLen(0)
+        return false
+      dl.segments.add(DownloadSegment(
+        start: offset,
+        offset: offset,
+        endOff: endOff
+      ))
+    inc i
+  return dl.segments.len > 0
+
+# Disconnect all segments, but keep the state file for resuming.
+proc stopSegments(ctx: var LoaderContext; dl: DownloadItem) =
+  for it in dl.segments:
+    if it.output != nil:
+      if it.output.stream != nil:
+        ctx.unregWrite.add(it.output)
+      it.output = nil
+  dl.saveSegments()
+  dl.file.sclose()
+  dl.file = nil
+
+proc segmentedSent(dl: DownloadItem): uint64 =
+  result = dl.contentLen
+  for it in dl.segments:
+    result -= it.endOff - it.offset
+
 proc formatSize(size: uint64): string =
   result = ""
   var size = size
@@ -1262,10 +1864,24 @@ proc formatDuration(dur: Duration): string =
       result &= '0'
     result &= $parts[it]
 
+proc makeProgress(segment: DownloadSegment; i: int; now: Time): string =
+  result = "    #" & $(i + 1) & ": " &
+    convertSize(segment.offset - segment.start) & " / " &
+    convertSize(segment.endOff - segment.start)
+  if segment.offset == segment.endOff:
+    result &= "  done"
+  elif segment.output != nil:
+    let udur = max(uint64((now - segment.connTime).inSeconds()), 1)
+    let rate = (segment.offset - segment.connStart) div udur
+    result &= "  rate " & convertSize(rate) & "/sec"
+  else:
+    result &= "  waiting"
+  result &= '\n'
+
 proc makeProgress(it: DownloadItem; now: Time): string =
   result = it.displayUrl.htmlEscape() & '\n'
   result &= "  -> "
-  if it.output == nil: # linkify path on completion
+  if not it.running: # linkify path on completion
     result &= "<a href=\"file:" & it.escapedPath & "\">" & it.escapedPath &
       "</a>"
   else:
@@ -1275,7 +1891,7 @@ proc makeProgress(it: DownloadItem; now: Time): string =
   result &= $it.contentLen & "></progress>  \n  "
   result &= formatSize(it.sent)
   if it.sent < it.contentLen and
-      (it.contentLen < uint64.high or it.output != nil):
+      (it.contentLen < uint64.high or it.running):
     if it.contentLen < uint64.high and it.contentLen > 0:
       result &= " / " & formatSize(it.contentLen) & " bytes (" &
         $(it.sent * 100 div it.contentLen) & "%)  "
@@ -1293,7 +1909,12 @@ proc makeProgress(it: DownloadItem; now: Time): string =
       result &= "  eta " & formatDuration(eta)
   else:
     result &= " bytes loaded"
+  if it.failed:
+    result &= "  (failed)"
   result &= '\n'
+  if it.running:
+    for i, segment in it.segments:
+      result &= segment.makeProgress(i, now)
 
 type
   DownloadActionType = enum
@@ -1325,6 +1946,8 @@ proc loadDownloads(ctx: var LoaderContext; handle: InputHandle;
       let dl = ctx.downloadList[it.n]
       if dl.output != nil:
         ctx.unregWrite.add(dl.output)
+      if dl.file != nil:
+        ctx.stopSegments(dl)
       ctx.downloadList.del(it.n)
   var body = """
 <!DOCTYPE html>
@@ -1339,14 +1962,18 @@ proc loadDownloads(ctx: var LoaderContext; handle: InputHandle;
   let now = getTime()
   var refresh = false
   for i, it in ctx.downloadList.mpairs:
-    if it.output != nil:
+    if it.segments.len > 0:
+      it.sent = it.segmentedSent()
+      if it.file != nil:
+        refresh = true
+    elif it.output != nil:
       it.sent = it.output.bytesSent
       if it.output.stream == nil:
         it.output = nil
       refresh = true
     body &= it.makeProgress(now)
     body &= "<input type=submit name=stop" & $i
-    if it.output != nil:
+    if it.running:
       body &= " value=STOP"
     else:
       body &= " value=OK"
@@ -1371,6 +1998,14 @@ proc loadCookieStream(ctx: var LoaderContext; handle: InputHandle;
   of pbrUnregister:
     ctx.close(handle)
 
+proc loadNetwork(ctx: var LoaderContext; handle: InputHandle) =
+  let body = "Idle connections: " & $ctx.connPool.len & '\n' &
+    "Resident adapters: " & $ctx.workers.len & '\n' &
+    "TLS sessions: " & $ctx.tlsSessions.len & '\n' &
+    "TLS session hits: " & $ctx.tlsSessionHits & '\n' &
+    "TLS session misses: " & $ctx.tlsSessionMisses & '\n'
+  ctx.loadDataSend(handle, body, "text/plain")
+
 proc loadAbout(ctx: var LoaderContext; handle: InputHandle;
     request: RawRequest) =
   let url = request.url
@@ -1384,6 +2019,8 @@ proc loadAbout(ctx: var LoaderContext; handle: InputHandle;
     ctx.loadDownloads(handle, request)
   of "cookie-stream":
     ctx.loadCookieStream(handle, request)
+  of "network":
+    ctx.loadNetwork(handle)
   of "license":
     const body = staticRead"res/license.md"
     ctx.loadDataSend(handle, body, "text/markdown")
@@ -1483,8 +2120,18 @@ proc loadResource(ctx: var LoaderContext; client: ClientHandle;
           env.add(("MAPPED_URI_PATH", request.url.pathname))
           env.add(("MAPPED_URI_QUERY", request.url.search.substr(1)))
         env.setupEnv(request, contentLen, config)
+        let scheme = request.url.scheme
+        let reuse = ConnReuse(
+          key: request.url.getKeepAliveKey(config),
+          keepAlive: request.url.schemeType == stHttp and
+            ctx.config.maxKeepAlivePerHost > 0,
+          # Only requests that can be safely retried on a fresh
+          # connection may take an idle one.
+          takeIdle: request.httpMethod in {hmGet, hmHead},
+          tlsSession: scheme == "https" or scheme == "gemini"
+        )
         ctx.loadCGI(client, handle, request.body, config, cmd, env, argv,
-          request.tocache, canThrottle)
+          reuse, request.priority, request.tocache, canThrottle)
       else:
         ctx.rejectHandleClose(handle, code)
     else:
@@ -1555,9 +2202,131 @@ proc load(ctx: var LoaderContext; request: var RawRequest;
       ctx.rejectHandle(handle, ceDisallowedURL)
     else:
       request.setupRequestDefaults(config, credentials)
+      # Only navigations can become downloads.
+      if ctx.config.downloadSegments > 1 and request.priority == rpNavigate and
+          ctx.isPrivileged(client) and request.httpMethod == hmGet and
+          request.url.schemeType in {stHttp, stHttps}:
+        let source = RangeSource(
+          request: request,
+          config: config,
+          client: client,
+          credentials: credentials,
+          resource: resource
+        )
+        source.request.unsetToCache()
+        handle.rangeSource = source
       ctx.loadResource(client, config, request, handle, resource)
   cmdrDone
 
+# Connect a segment with a ranged request for the part it is missing.
+proc startSegment(ctx: var LoaderContext; dl: DownloadItem;
+    segment: DownloadSegment): bool =
+  let source = dl.source
+  let client = source.client
+  if client.stream == nil:
+    return false
+  let fd = dup(dl.file.fd)
+  if fd < 0:
+    return false
+  var request = source.request
+  request.headers["Range"] = "bytes=" & $segment.offset & '-' &
+    $(segment.endOff - 1)
+  if source.validator != "":
+    request.headers["If-Range"] = source.validator
+  request.headers["Accept-Encoding"] = "identity"
+  let handle = ctx.newInputHandle(newPosixStream(fd), client, request.url,
+    source.credentials, suspended = false)
+  let output = handle.output
+  output.segment = segment
+  segment.output = output
+  segment.connStart = segment.offset
+  segment.connTime = getTime()
+  ctx.loadResource(client, source.config, request, handle, source.resource)
+  true
+
+# Split the rest of a download that has just been redirected to a file
+# into segments.  The first one stays on the original connection.
+proc splitDownload(ctx: var LoaderContext; dl: DownloadItem;
+    output: OutputHandle) =
+  let start = output.bytesSent
+  if start >= dl.contentLen:
+    return
+  let left = dl.contentLen - start
+  let n = min(uint64(ctx.config.downloadSegments), left div MinSegmentSize)
+  if n < 2:
+    return
+  let fd = dup(output.stream.fd)
+  if fd < 0:
+    return
+  dl.file = newPosixStream(fd)
+  dl.output = nil
+  let size = left div n
+  var offset = start
+  for i in 0 ..< int(n):
+    let endOff = if i == int(n) - 1: dl.contentLen else: offset + size
+    dl.segments.add(DownloadSegment(
+      start: offset,
+      offset: offset,
+      endOff: endOff
+    ))
+    offset = endOff
+  let first = dl.segments[0]
+  first.output = output
+  first.connStart = start
+  first.connTime = getTime()
+  output.segment = first
+  for segment in dl.segments.toOpenArray(1, dl.segments.high):
+    # if this fails, updateDownload retries
+    discard ctx.startSegment(dl, segment)
+  dl.saveSegments()
+
+# Continue an earlier segmented download of the same resource, if its
+# state file matches the response.
+proc resumeDownload(ctx: var LoaderContext; dl: DownloadItem;
+    targetPath: string): bool =
+  if dl.source.validator == "" or not dl.loadSegments():
+    return false
+  let ps = newPosixStream(targetPath, O_WRONLY, 0)
+  if ps == nil:
+    dl.segments.setLen(0)
+    return false
+  dl.file = ps
+  dl.sent = dl.segmentedSent()
+  for segment in dl.segments:
+    discard ctx.startSegment(dl, segment)
+  true
+
+# Reconnect segments that lost their connection, and close the file
+# once all of them are complete.
+proc updateDownload(ctx: var LoaderContext; dl: DownloadItem) =
+  var done = true
+  for segment in dl.segments:
+    let output = segment.output
+    if output != nil and output.stream == nil: # disconnected
+      segment.output = nil
+      if segment.offset > segment.connStart:
+        segment.retries = 0
+    if segment.offset < segment.endOff:
+      done = false
+      if segment.output == nil and not dl.failed:
+        if segment.refused or segment.retries >= MaxSegmentRetries:
+          dl.failed = true
+        else:
+          inc segment.retries
+          if not ctx.startSegment(dl, segment):
+            dl.failed = true
+    elif segment.output != nil: # the rest belongs to the next segment
+      ctx.unregWrite.add(segment.output)
+      segment.output = nil
+  if done:
+    dl.file.sclose()
+    dl.file = nil
+    discard unlink(cstring(dl.statePath))
+  elif dl.failed:
+    ctx.stopSegments(dl)
+  elif getTime() - dl.lastSaved >= initDuration(seconds = 1):
+    dl.saveSegments()
+
 proc loadCmd(ctx: var LoaderContext; client: ClientHandle; r: var PacketReader):
     CommandResult =
   var request: RawRequest
@@ -1649,26 +2418,37 @@ proc redirectToFileCmd(ctx: var LoaderContext; rclient: ClientHandle;
   let output = ctx.findOutput(outputId, rclient)
   var success = false
   if output != nil:
-    var fileOutput: OutputHandle
-    var sent: uint64
-    success = ctx.redirectToFile(output, targetPath, fileOutput, sent)
-    let contentLen = if output.parent != nil:
-      output.parent.contentLen
+    let parent = output.parent
+    let contentLen = if parent != nil:
+      parent.contentLen
     else:
       uint64.high
-    let startTime = if output.parent != nil:
-      output.parent.startTime
+    let startTime = if parent != nil:
+      parent.startTime
     else:
       #TODO ???
       fromUnix(0)
-    ctx.downloadList.add(DownloadItem(
+    let dl = DownloadItem(
       escapedPath: targetPath.htmlEscape(),
-      output: fileOutput,
       displayUrl: displayUrl,
-      sent: sent,
       contentLen: contentLen,
       startTime: startTime
-    ))
+    )
+    if parent != nil and parent.rangeSource != nil:
+      dl.source = parent.rangeSource
+      dl.statePath = targetPath & SegmentStateSuffix
+    if dl.source != nil and ctx.resumeDownload(dl, targetPath):
+      # The segments fetch everything we need, so the original response
+      # is no longer read.
+      ctx.unregWrite.add(output)
+      success = true
+    else:
+      var fileOutput: OutputHandle
+      success = ctx.redirectToFile(output, targetPath, fileOutput, dl.sent)
+      dl.output = fileOutput
+      if fileOutput != nil and dl.source != nil:
+        ctx.splitDownload(dl, fileOutput)
+    ctx.downloadList.add(dl)
   rclient.withPacketWriter w:
     w.swrite(success)
   do:
@@ -1814,6 +2594,16 @@ proc addAuthCmd(ctx: var LoaderContext; rclient: ClientHandle;
     ctx.pagerClient.authMap.add(item)
   cmdrDone
 
+proc setPriorityCmd(ctx: var LoaderContext; rclient: ClientHandle;
+    r: var PacketReader): CommandResult =
+  var url: URL
+  var priority: RequestPriority
+  r.sread(url)
+  r.sread(priority)
+  if url != nil:
+    rclient.setPriority(url, priority)
+  cmdrDone
+
 proc suspendCmd(ctx: var LoaderContext; rclient: ClientHandle;
     r: var PacketReader): CommandResult =
   var ids: seq[int]
@@ -1827,6 +2617,45 @@ proc suspendCmd(ctx: var LoaderContext; rclient: ClientHandle;
         ctx.unregister(output)
   cmdrDone
 
+# Move the body of a suspended output to a shared ring.  This must be
+# called before the output is resumed for the first time, since the
+# body then skips the pipe.
+proc shareOutputCmd(ctx: var LoaderContext; rclient: ClientHandle;
+    r: var PacketReader): CommandResult =
+  var id: int
+  r.sread(id)
+  let output = ctx.findOutput(id, rclient)
+  var memfd = cint(-1)
+  let ring = if output != nil and output.suspended and not output.dead and
+      output.ring == nil and output.segment == nil:
+    newSharedRing(memfd)
+  else:
+    nil
+  var efd = cint(-1)
+  if ring != nil:
+    efd = dup(ring.wake.fd)
+    if efd == -1:
+      ring.unmap()
+      ring.wake.sclose()
+      discard close(memfd)
+    else:
+      let handle = RingWakeHandle(stream: ring.wake, output: output)
+      output.ring = ring
+      output.wakeHandle = handle
+      ctx.put(handle)
+      ctx.register(handle)
+  rclient.withPacketWriter w:
+    w.swrite(efd != -1)
+    if efd != -1:
+      w.sendFd(memfd)
+      w.sendFd(efd)
+  do:
+    return cmdrEOF
+  if efd != -1:
+    discard close(memfd)
+    discard close(efd)
+  cmdrDone
+
 proc resumeCmd(ctx: var LoaderContext; rclient: ClientHandle;
     r: var PacketReader): CommandResult =
   var ids: seq[int]
@@ -1835,7 +2664,7 @@ proc resumeCmd(ctx: var LoaderContext; rclient: ClientHandle;
     let output = ctx.findOutput(id, rclient)
     if output != nil:
       output.suspended = false
-      if not output.isEmpty or output.istreamAtEnd:
+      if not output.ringFull and (not output.isEmpty or output.istreamAtEnd):
         ctx.register(output)
   cmdrDone
 
@@ -1853,14 +2682,16 @@ const CommandMap = [
   lcRemoveCachedItem: removeCachedItemCmd,
   lcRemoveClient: removeClientCmd,
   lcResume: resumeCmd,
+  lcSetPriority: setPriorityCmd,
   lcShareCachedItem: shareCachedItemCmd,
+  lcShareOutput: shareOutputCmd,
   lcSuspend: suspendCmd,
   lcTee: teeCmd,
 ]
 
 const UnprivilegedCommands = {
-  lcAddCacheFile, lcAddPipe, lcLoad, lcRemoveCachedItem, lcResume, lcSuspend,
-  lcTee
+  lcAddCacheFile, lcAddPipe, lcLoad, lcRemoveCachedItem, lcResume,
+  lcSetPriority, lcSuspend, lcTee
 }
 const PrivilegedCommands = {LoaderCommand.low .. LoaderCommand.high} -
   UnprivilegedCommands
@@ -1894,7 +2725,7 @@ proc handleWrite(ctx: var LoaderContext; output: OutputHandle;
     unregWrite: var seq[OutputHandle]) =
   while output.currentBuffer != nil:
     let buffer = output.currentBuffer
-    let n = output.stream.write(buffer, output.currentBufferIdx)
+    let n = output.write(buffer, output.currentBufferIdx)
     if n < 0:
       let e = errno
       if e == EAGAIN or e == EWOULDBLOCK or e == EINTR: # never mind
@@ -1917,6 +2748,19 @@ proc handleWrite(ctx: var LoaderContext; output: OutputHandle;
     else:
       # all buffers sent, no need to select on this output again for now
       ctx.unregister(output)
+  elif output.ringFull: # wait for readRingWake
+    ctx.unregister(output)
+
+# The reader has made room in the shared ring of handle.output.
+proc readRingWake(ctx: var LoaderContext; handle: RingWakeHandle) =
+  var n: uint64
+  discard handle.stream.read(addr n, sizeof(n))
+  let output = handle.output
+  if output != nil and output.ringFull:
+    output.ringFull = false
+    # if the client has suspended the output, resumeCmd registers it
+    if not output.suspended and (not output.isEmpty or output.istreamAtEnd):
+      ctx.register(output)
 
 proc finishCycle(ctx: var LoaderContext) =
   # Unregister handles queued for unregistration.
@@ -1957,33 +2801,73 @@ proc finishCycle(ctx: var LoaderContext) =
       ctx.close(client)
       if fd < ctx.handleMap.len:
         ctx.handleMap[fd] = nil
+  ctx.pruneConnPool()
+  ctx.pruneWorkers()
+  for handle in ctx.unregPool:
+    if handle.stream != nil:
+      if handle of PooledConnection:
+        let conn = PooledConnection(handle)
+        if conn.registered:
+          ctx.unregister(conn)
+      elif handle of KeepAliveHandle:
+        let handle = KeepAliveHandle(handle)
+        if handle.registered:
+          ctx.unregister(handle)
+      elif handle of TLSSessionHandle:
+        let handle = TLSSessionHandle(handle)
+        if handle.registered:
+          ctx.unregister(handle)
+      elif handle of RingWakeHandle:
+        let handle = RingWakeHandle(handle)
+        if handle.registered:
+          ctx.unregister(handle)
+      else:
+        let worker = ResidentWorker(handle)
+        if worker.registered:
+          ctx.unregister(worker)
+      ctx.unset(handle)
+      handle.stream.sclose()
+      handle.stream = nil
   ctx.unregRead.setLen(0)
   ctx.unregWrite.setLen(0)
   ctx.unregClient.setLen(0)
+  ctx.unregPool.setLen(0)
+  for dl in ctx.downloadList:
+    if dl.file != nil:
+      ctx.updateDownload(dl)
   for client in ctx.pendingConnections:
     if client.stream == nil:
       continue
-    while client.pendingHead != nil:
-      if client.numConnections >= ctx.config.maxNetConnections:
+    while client.numConnections < ctx.config.maxNetConnections:
+      let pending = client.pending.pop()
+      if pending == nil:
         break
-      let pending = move(client.pendingHead)
-      client.pendingHead = move(pending.next)
-      if client.pendingHead == nil:
-        client.pendingTail = nil
       ctx.loadCGI(client, pending.handle, pending.body, client.config,
-        pending.cmd, pending.env, pending.argv, pending.tocache,
-        canThrottle = true)
+        pending.cmd, pending.env, pending.argv, pending.reuse,
+        pending.priority, pending.tocache, canThrottle = true)
   ctx.pendingConnections.setLen(0)
 
 proc loaderLoop(ctx: var LoaderContext) =
   while true:
-    ctx.pollData.poll(-1)
+    ctx.pollData.poll(ctx.pollTimeout())
     for event in ctx.pollData.events:
       let efd = int(event.fd)
       if (event.revents and POLLIN) != 0:
         let handle = ctx.handleMap[efd]
         if handle of ClientHandle:
           ctx.readCommand(ClientHandle(handle))
+        elif handle of KeepAliveHandle:
+          ctx.readKeepAlive(KeepAliveHandle(handle))
+        elif handle of TLSSessionHandle:
+          discard ctx.readTLSSession(TLSSessionHandle(handle))
+        elif handle of PooledConnection:
+          # idle connections must not receive anything; the server has
+          # either closed it or is misbehaving
+          ctx.dropPooled(PooledConnection(handle))
+        elif handle of ResidentWorker:
+          ctx.dropWorker(ResidentWorker(handle))
+        elif handle of RingWakeHandle:
+          ctx.readRingWake(RingWakeHandle(handle))
         else:
           let handle = InputHandle(handle)
           case ctx.handleRead(handle, ctx.unregWrite)
@@ -1998,6 +2882,16 @@ proc loaderLoop(ctx: var LoaderContext) =
           ctx.unregRead.add(InputHandle(handle))
         elif handle of OutputHandle: # ostream died
           ctx.unregWrite.add(OutputHandle(handle))
+        elif handle of PooledConnection:
+          ctx.dropPooled(PooledConnection(handle))
+        elif handle of KeepAliveHandle:
+          ctx.unregPool.add(handle)
+        elif handle of TLSSessionHandle:
+          # the adapter has exited, so this cannot block
+          while ctx.readTLSSession(TLSSessionHandle(handle)):
+            discard
+        elif handle of ResidentWorker:
+          ctx.dropWorker(ResidentWorker(handle))
         else: # client died
           assert handle of ClientHandle
           ctx.unregClient.add(ClientHandle(handle))
@@ -2028,6 +2922,9 @@ proc runFileLoader*(rt: JSRuntime; config: LoaderConfig;
   for dir in ctx.config.cgiDir.mitems:
     if dir.len > 0 and dir[^1] != '/':
       dir &= '/'
+  let libexecDir = getEnvEmpty("CHA_LIBEXEC_DIR")
+  if libexecDir != "":
+    ctx.residentDir = libexecDir / "cgi-bin"
   ctx.pagerClient = ClientHandle(
     stream: stream,
     pid: pagerPid,
@@ -79,7 +79,9 @@ type
     lcRemoveCachedItem
     lcRemoveClient
     lcResume
+    lcSetPriority
     lcShareCachedItem
+    lcShareOutput
     lcSuspend
     lcTee
 
@@ -404,8 +406,9 @@ proc getRedirect*(response: Response; request: Request): Request =
       if status == 303 and request.httpMethod notin {hmGet, hmHead} or
           status == 301 or
           status == 302 and request.httpMethod == hmPost:
-        return newRequest(url, hmGet)
-      return newRequest(url, request.httpMethod, body = request.body)
+        return newRequest(url, hmGet, priority = request.priority)
+      return newRequest(url, request.httpMethod, body = request.body,
+        priority = request.priority)
   return Request(nil)
 
 # Sometimes, we can return a value even after the loader crashed.
@@ -560,6 +563,13 @@ proc resume*(loader: FileLoader; outputIds: openArray[int]) =
 proc resume*(loader: FileLoader; outputId: int) =
   loader.resume([outputId])
 
+# Change the priority of requests to url that have not been started yet.
+proc setPriority*(loader: FileLoader; url: URL; priority: RequestPriority) =
+  loader.withPacketWriterFire w:
+    w.swrite(lcSetPriority)
+    w.swrite(url)
+    w.swrite(priority)
+
 proc tee*(loader: FileLoader; sourceId, targetPid: int): (PosixStream, int) =
   loader.withPacketWriter w:
     w.swrite(lcTee)
@@ -752,6 +762,27 @@ proc openCachedItem*(loader: FileLoader; cacheId: int): PosixStream =
     return newPosixStream(fd)
   return nil
 
+# Ask the loader to send the body of a not yet resumed output through a
+# shared ring (see io/sharedring).  On success, returns the ring's memfd
+# and the eventfd through which the reader wakes the loader; otherwise,
+# both are -1.
+proc shareOutput*(loader: FileLoader; outputId: int):
+    tuple[memfd, efd: cint] =
+  loader.withPacketWriter w:
+    w.swrite(lcShareOutput)
+    w.swrite(outputId)
+  do:
+    return (cint(-1), cint(-1))
+  var memfd = cint(-1)
+  var efd = cint(-1)
+  loader.withPacketReaderFire r:
+    var success: bool
+    r.sread(success)
+    if success:
+      memfd = r.recvFd()
+      efd = r.recvFd()
+  return (memfd, efd)
+
 proc passFd*(loader: FileLoader; id: string; fd: cint) =
   loader.withPacketWriterFire w:
     w.swrite(lcPassFd)
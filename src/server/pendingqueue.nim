@@ -0,0 +1,86 @@
+# Per-priority FIFO queues for requests that the loader could not start
+# yet.  T must be a ref type with `priority', `ticket' and `next' fields.
+
+{.push raises: [].}
+
+import server/request
+
+type
+  PendingList[T] = object
+    head: T
+    tail: T
+
+  PendingQueue*[T] = object
+    lists: array[RequestPriority, PendingList[T]]
+    # Number of items popped so far; used for aging.
+    startedNum: uint64
+
+# A pending request moves up one priority level for every
+# PendingAgingStep requests started ahead of it, so that e.g. a page
+# full of images cannot starve its last image forever.
+const PendingAgingStep* = 8u64
+
+proc add[T](list: var PendingList[T]; it: T) =
+  it.next = nil
+  if list.tail != nil:
+    list.tail.next = it
+  else:
+    list.head = it
+  list.tail = it
+
+proc isEmpty*[T](queue: PendingQueue[T]): bool =
+  for list in queue.lists:
+    if list.head != nil:
+      return false
+  true
+
+proc add*[T](queue: var PendingQueue[T]; it: T) =
+  it.ticket = queue.startedNum
+  queue.lists[it.priority].add(it)
+
+proc pop*[T](queue: var PendingQueue[T]): T =
+  var best = RequestPriority.low
+  var bestRank = int.high
+  for priority in RequestPriority:
+    let head = queue.lists[priority].head
+    if head != nil:
+      let age = int((queue.startedNum - head.ticket) div PendingAgingStep)
+      let rank = int(priority) - age
+      if rank < bestRank:
+        best = priority
+        bestRank = rank
+  if bestRank == int.high:
+    return nil
+  let it = queue.lists[best].head
+  queue.lists[best].head = it.next
+  if it.next == nil:
+    queue.lists[best].tail = nil
+  it.next = nil
+  inc queue.startedNum
+  it
+
+# Move items for which match returns true to the list of priority.
+proc setPriority*[T](queue: var PendingQueue[T]; priority: RequestPriority;
+    match: proc(it: T): bool {.raises: [].}) =
+  for it in RequestPriority:
+    if it == priority:
+      continue
+    var prev: T = nil
+    var cur = queue.lists[it].head
+    while cur != nil:
+      let next = cur.next
+      if match(cur):
+        if prev != nil:
+          prev.next = next
+        else:
+          queue.lists[it].head = next
+        if next == nil:
+          queue.lists[it].tail = prev
+        cur.priority = priority
+        # keep the ticket, so that the item does not lose its age
+        queue.lists[priority].add(cur)
+      else:
+        prev = cur
+      cur = next
+
+{.pop.} # raises: []
@@ -41,6 +41,21 @@ type
     caAnonymous = "anonymous"
     caUseCredentials = "use-credentials"
 
+  # Order in which the loader starts throttled requests; highest first.
+  RequestPriority* = enum
+    rpNavigate # top-level documents
+    rpStyle # render-blocking style sheets
+    rpScript # parser-blocking scripts and requests made from JS
+    rpAsyncScript # async, deferred and module scripts
+    rpVisibleImage # images already scrolled into view
+    rpImage # images and fonts
+    rpPrefetch # requests nobody is waiting on yet
+
+  RequestPriorityInit = enum
+    rpiHigh = "high"
+    rpiLow = "low"
+    rpiAuto = "auto"
+
 type
   RequestOriginType* = enum
     rotClient, rotOrigin
@@ -91,6 +106,7 @@ type
     httpMethod*: HttpMethod
     flags: set[RequestFlag]
     credentials*: CredentialsMode
+    priority*: RequestPriority
 
   RequestObj* = object
     # RawRequest
@@ -100,6 +116,7 @@ type
     httpMethod*: HttpMethod
     flags: set[RequestFlag]
     credentials*: CredentialsMode
+    priority*: RequestPriority
     # client-specific
     mode*: RequestMode
     destination*: RequestDestination
@@ -145,6 +162,7 @@ proc swrite*(w: var PacketWriter; o: Request) =
   w.swrite(o.httpMethod)
   w.swrite(o.flags)
   w.swrite(o.credentials)
+  w.swrite(o.priority)
 
 proc sread*(w: var PacketReader; o: var Request) {.
     error: "use RawRequest instead".} =
@@ -157,6 +175,7 @@ proc sread*(r: var PacketReader; o: var RawRequest) =
   r.sread(o.httpMethod)
   r.sread(o.flags)
   r.sread(o.credentials)
+  r.sread(o.priority)
 
 proc contentLength*(body: RequestBody): int =
   case body.t
@@ -168,6 +187,9 @@ proc contentLength*(body: RequestBody): int =
 proc tocache*(this: RawRequest): bool =
   rqfToCache in this.flags
 
+proc unsetToCache*(this: var RawRequest) =
+  this.flags.excl(rqfToCache)
+
 proc urlCredentials*(this: RawRequest): bool =
   rqfUrlCredentials in this.flags
 
@@ -195,7 +217,7 @@ proc newRequest*(url: URL; httpMethod = hmGet; headers = newHeaders(hgRequest);
     body = RequestBody(); hasReferrer = true; referrer = URL(nil);
     tocache = false; credentials = cmSameOrigin; internal = false;
     urlCredentials = false; destination = rdNone; mode = rmNoCors;
-    window = RequestWindow(t: rwtNoWindow)): Request =
+    window = RequestWindow(t: rwtNoWindow); priority = rpScript): Request =
   assert url != nil
   if referrer != nil:
     headers["Referer"] = $referrer
@@ -216,13 +238,15 @@ proc newRequest*(url: URL; httpMethod = hmGet; headers = newHeaders(hgRequest);
     flags: flags,
     credentials: credentials,
     destination: destination,
-    mode: mode
+    mode: mode,
+    priority: priority
   )
 
 proc newRequest*(raw: RawRequest): Request =
   return newRequest(raw.url, raw.httpMethod, newHeaders(hgRequest, raw.headers),
     raw.body, tocache = raw.tocache, credentials = raw.credentials,
-    internal = raw.internal, urlCredentials = raw.urlCredentials)
+    internal = raw.internal, urlCredentials = raw.urlCredentials,
+    priority = raw.priority)
 
 proc newRequest*(s: string; httpMethod = hmGet; headers = newHeaders(hgRequest);
     body = RequestBody(); hasReferrer = true; referrer = URL(nil);
@@ -239,7 +263,12 @@ proc createPotentialCORSRequest*(url: URL; destination: RequestDestination;
   if fallbackFlag and mode == rmNoCors:
     mode = rmSameOrigin
   let credentials = if cors == caAnonymous: cmSameOrigin else: cmInclude
-  return newRequest(url, credentials = credentials, destination = destination, mode = mode)
+  let priority = case destination
+  of rdStyle: rpStyle
+  of rdImage, rdFont, rdAudio, rdTrack: rpImage
+  else: rpScript
+  return newRequest(url, credentials = credentials, destination = destination,
+    mode = mode, priority = priority)
 
 type
   BodyInitType = enum
@@ -267,6 +296,7 @@ type
     credentials {.jsdefault: JS_UNDEFINED.}: JSValueConst
     mode {.jsdefault: JS_UNDEFINED.}: JSValueConst
     window {.jsdefault: JS_UNDEFINED.}: JSValueConst
+    priority {.jsdefault: JS_UNDEFINED.}: JSValueConst
 
 proc fromJS*(ctx: JSContext; val: JSValueConst; res: var BodyInit):
     FromJSResult =
@@ -354,6 +384,14 @@ jsClassDef(Request):
     var mode = rmNoCors
     if not JS_IsUndefined(init.mode):
       ?ctx.fromJS(init.mode, mode)
+    var priority = rpScript
+    if not JS_IsUndefined(init.priority):
+      var priorityInit: RequestPriorityInit
+      ?ctx.fromJS(init.priority, priorityInit)
+      priority = case priorityInit
+      of rpiHigh: rpStyle
+      of rpiLow: rpPrefetch
+      of rpiAuto: rpScript
     let apiBaseURL = ctx.getAPIBaseURLImpl()
     let origin = ctx.getOriginImpl()
     if (var res: Request; ctx.fromJS(resource, res).isOk):
@@ -371,6 +409,8 @@ jsClassDef(Request):
           mode = rmSameOrigin
       if JS_IsUndefined(init.credentials):
         credentials = res.credentials
+      if JS_IsUndefined(init.priority):
+        priority = res.priority
       body = res.body
       window = res.window
     else:
@@ -421,7 +461,8 @@ jsClassDef(Request):
       credentials = credentials,
       mode = mode,
       destination = destination,
-      window = window
+      window = window,
+      priority = priority
     ))
 
 proc addRequestModule*(ctx: JSContext): FromJSResult =
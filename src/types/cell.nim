@@ -1,5 +1,8 @@
+import std/hashes
+
 import types/color
 import utils/strwidth
+import utils/twtstr
 
 type
   FormatFlag* = enum
@@ -26,8 +29,12 @@ type
 
   SimpleFlexibleGrid* = seq[SimpleFlexibleLine]
 
+  # text is 0 for empty cells (e.g. ones covered by a double-width
+  # character), a code point if CellStringBit is not set, or otherwise
+  # an index into the table of interned cell strings.  Either way, two
+  # cells show the same text iff their text is equal.
   FixedCell* = object
-    str*: string
+    text*: uint32
     format*: Format
 
   FixedGrid* = object
@@ -103,8 +110,172 @@ iterator mline*(grid: var FixedGrid; y: int; startx = 0): var FixedCell
 proc newFixedGrid*(w, h: int): FixedGrid =
   return FixedGrid(width: w, height: h, cells: newSeq[FixedCell](w * h))
 
+# Strings that do not fit in a single code point: control character
+# visuals, expanded tabs and grapheme clusters.  The table is shared by
+# all grids, so that cells of different grids (and the terminal's
+# canvas) can be compared without looking at the strings.
+#
+# To keep it from growing forever, the pager starts a new generation
+# between frames once it is full: it passes every live cell to
+# keepCellStrings, which re-interns its string in the new table, and
+# the rest is dropped.
+const CellStringBit = 0x80000000u32
+
+# Minimum number of strings before we start a new generation.
+const CellStringsMin = 1024
+
+type CellStrings = object
+  strs: seq[string]
+  buckets: seq[uint32] # index + 1 into strs, or 0 if empty
+  controls: array[0xA0, uint32] # visuals of control characters
+  spaces: array[TabPUARange.len + 1, uint32] # expanded tabs
+  limit: int # start a new generation at this many strings
+
+var cellStrings {.global.} = CellStrings(limit: CellStringsMin)
+var oldCellStrings {.global.} = CellStrings()
+var cellBuf {.global.} = "" # for withText
+
+proc cellHash(s: openArray[char]): Hash =
+  return hash(s)
+
+proc rehash(cs: var CellStrings) =
+  cs.buckets = newSeq[uint32](max(cs.buckets.len * 2, 64))
+  let mask = cs.buckets.high
+  for i, s in cs.strs:
+    var j = cellHash(s) and mask
+    while cs.buckets[j] != 0:
+      j = (j + 1) and mask
+    cs.buckets[j] = uint32(i + 1)
+
+proc intern(cs: var CellStrings; s: openArray[char]): uint32 =
+  if cs.strs.len * 2 >= cs.buckets.len:
+    cs.rehash()
+  let mask = cs.buckets.high
+  var j = cellHash(s) and mask
+  while (let n = cs.buckets[j]; n != 0):
+    if cs.strs[n - 1] == s:
+      return (n - 1) or CellStringBit
+    j = (j + 1) and mask
+  cs.strs.add(s.substr())
+  cs.buckets[j] = uint32(cs.strs.len)
+  return uint32(cs.strs.high) or CellStringBit
+
+proc isInterned(cell: FixedCell): bool {.inline.} =
+  return (cell.text and CellStringBit) != 0
+
+proc cellStringsFull*(): bool =
+  return cellStrings.strs.len >= cellStrings.limit
+
+proc startCellStrings*() =
+  oldCellStrings = move(cellStrings)
+  cellStrings = CellStrings()
+
+# Move the strings of cells to the new generation.  Ids that were not
+# interned strings (e.g. the terminal's placeholder cells) are left
+# alone.
+proc keepCellStrings*(cells: var openArray[FixedCell]) =
+  for cell in cells.mitems:
+    if cell.isInterned:
+      let i = int(cell.text and not CellStringBit)
+      if i < oldCellStrings.strs.len:
+        cell.text = cellStrings.intern(oldCellStrings.strs[i])
+
+proc finishCellStrings*() =
+  oldCellStrings = CellStrings()
+  cellStrings.limit = max(cellStrings.strs.len * 2, CellStringsMin)
+
+# The text of a cell that is not a single code point.
+proc internedText(cell: FixedCell): lent string =
+  return cellStrings.strs[cell.text and not CellStringBit]
+
+proc isEmpty*(cell: FixedCell): bool {.inline.} =
+  return cell.text == 0
+
+proc setText*(cell: var FixedCell; u: uint32) {.inline.} =
+  cell.text = u
+
+proc setText*(cell: var FixedCell; s: openArray[char]) =
+  var i = 0
+  if s.len == 0:
+    cell.text = 0
+  elif (let u = s.nextUTF8(i); i == s.len):
+    cell.text = u
+  else:
+    cell.text = cellStrings.intern(s)
+
+# Set the text to the visual representation of control character u.
+proc setControl*(cell: var FixedCell; u: uint32) =
+  assert u.isControlChar()
+  let id = cellStrings.controls[int(u)]
+  if id != 0:
+    cell.text = id
+  else:
+    cell.setText(u.controlToVisual())
+    cellStrings.controls[int(u)] = cell.text
+
+# Set the text to n spaces, for tabs that fit in one cell.
+proc setSpaces*(cell: var FixedCell; n: int) =
+  if n <= 1:
+    cell.text = uint32(' ')
+  elif n < cellStrings.spaces.len and cellStrings.spaces[n] != 0:
+    cell.text = cellStrings.spaces[n]
+  else:
+    cell.setText(' '.repeat(n))
+    if n < cellStrings.spaces.len:
+      cellStrings.spaces[n] = cell.text
+
+proc addText*(s: var string; cell: FixedCell) =
+  if cell.isInterned:
+    s &= cell.internedText
+  elif cell.text != 0:
+    s.addUTF8(cell.text)
+
+# Append s to the text of the cell, e.g. to add a combining character.
+proc addText*(cell: var FixedCell; s: openArray[char]) =
+  if cell.text == 0:
+    cell.setText(s)
+  elif s.len > 0:
+    var res = ""
+    res.addText(cell)
+    for c in s:
+      res &= c
+    cell.setText(res)
+
+proc addText*(cell: var FixedCell; u: uint32) =
+  if cell.text == 0:
+    cell.text = u
+  else:
+    var res = ""
+    res.addText(cell)
+    res.addUTF8(u)
+    cell.setText(res)
+
+# Whether the cell starts with a character other than a space.
+proc isPrinting*(cell: FixedCell): bool =
+  if cell.isInterned:
+    return cell.internedText[0] != ' '
+  return cell.text != 0 and cell.text != uint32(' ')
+
 proc width*(cell: FixedCell): int =
-  return cell.str.width()
+  if cell.isInterned:
+    return cell.internedText.width()
+  if cell.text == 0:
+    return 0
+  return cell.text.width()
+
+# Call body with s set to the UTF-8 text of cell, without allocating.
+# body must not call withText itself.
+template withText*(cell: FixedCell; s, body: untyped) =
+  block:
+    let cellp = unsafeAddr cell
+    if cellp[].isInterned:
+      template s: openArray[char] = cellp[].internedText
+      body
+    else:
+      cellBuf.setLen(0)
+      cellBuf.addUTF8(cellp[].text)
+      template s: openArray[char] = cellBuf
+      body
 
 # Get the first format cell after pos, if any.
 proc findFormatN*(line: SimpleFlexibleLine; pos: int): int =
@@ -3,19 +3,27 @@
 import monoucha/libregexp
 import types/opt
 
-when NimMajor < 2:
-  from utils/twtstr import substr
+import utils/twtstr
 
 type
+  RegexLiteral* = object
+    s*: string # in lower case if icase is set
+    icase*: bool # s is matched case-insensitively
+    prefix*: bool # each match starts with s
+
   Regex* = object
     bytecode*: string
+    literal: RegexLiteral # see requiredLiteral
 
   REBytecode* = distinct ptr uint8
 
+proc requiredLiteral(bc: openArray[char]): RegexLiteral
+
 proc bytecodeToRegex*(p: REBytecode; plen: cint): Regex =
   let plen = int(plen)
   let p = cast[ptr UncheckedArray[char]](p)
   result = Regex(bytecode: p.toOpenArray(0, plen - 1).substr())
+  result.literal = result.bytecode.requiredLiteral()
 
 proc compileRegex*(buf: string; flags: LREFlags; regex: var Regex): bool =
   ## Compile a regular expression using QuickJS's libregexp library.
@@ -38,10 +46,137 @@ proc compileRegex*(buf: string; flags: LREFlags; regex: var Regex): bool =
   dealloc(bytecode)
   true
 
+# Opcodes of libregexp-opcode.h that we must know about to find a
+# regex's literals.
+const
+  reopChar = 1u8
+  reopCharI = 2u8
+  reopChar32 = 3u8
+  reopChar32I = 4u8
+  reopDot = 5u8
+  reopNotSpace = 8u8
+  reopLineStart = 9u8
+  reopLineEndM = 12u8
+  reopSaveStart = 19u8
+  reopSaveEnd = 20u8
+  reopSaveReset = 21u8
+  reopWordBoundary = 28u8
+  reopNotWordBoundaryI = 31u8
+  reopRange = 36u8
+  reopRange32 = 38u8
+  reopRange32I = 39u8
+  reHeaderLen = 8
+  reUnstickyPrefixLen = 11 # split_goto_first, any, goto
+
+proc getU16(bc: openArray[char]; i: int): uint32 =
+  return uint32(bc[i]) or (uint32(bc[i + 1]) shl 8)
+
+proc getU32(bc: openArray[char]; i: int): uint32 =
+  return bc.getU16(i) or (bc.getU16(i + 2) shl 16)
+
+proc requiredLiteral(bc: openArray[char]): RegexLiteral =
+  if bc.len < reHeaderLen:
+    return RegexLiteral()
+  let flags = cint(bc.getU16(0)).toLREFlags()
+  let icase = LRE_FLAG_IGNORECASE in flags
+  result = RegexLiteral(icase: icase)
+  var i = reHeaderLen
+  if LRE_FLAG_STICKY notin flags:
+    i += reUnstickyPrefixLen
+  var cur = ""
+  var prefix = true # no unknown character before cur
+  while i < bc.len:
+    let op = uint8(bc[i])
+    var u = 0xFFFFFFFFu32
+    var n = 0
+    case op
+    of reopChar .. reopChar32I:
+      let wide = op >= reopChar32
+      n = if wide: 5 else: 3
+      if i + n > bc.len:
+        break
+      # with the i flag, all characters are emitted as char_i
+      if (op in {reopCharI, reopChar32I}) == icase:
+        u = if wide: bc.getU32(i + 1) else: bc.getU16(i + 1)
+    of reopLineStart .. reopLineEndM, reopWordBoundary .. reopNotWordBoundaryI:
+      # zero-width; the characters around it are still adjacent
+      inc i
+      continue
+    of reopSaveStart, reopSaveEnd:
+      i += 2
+      continue
+    of reopSaveReset:
+      i += 3
+      continue
+    of reopDot .. reopNotSpace:
+      n = 1
+    of reopRange .. reopRange32I:
+      if i + 2 >= bc.len:
+        break
+      let size = if op >= reopRange32: 8 else: 4
+      n = 3 + int(bc.getU16(i + 1)) * size
+    else: # branches, loops, lookarounds, back references or the end
+      break
+    if icase and u != 0xFFFFFFFFu32:
+      # Only ASCII is easy to compare without case.  K and S are also
+      # matched by the Kelvin sign and the long s when case folding, so
+      # we skip those too.
+      if u >= 0x80 or char(u).toLowerAscii() in {'k', 's'}:
+        u = 0xFFFFFFFFu32
+      else:
+        u = uint32(char(u).toLowerAscii())
+    if u != 0xFFFFFFFFu32:
+      cur.addUTF8(u)
+    else:
+      # matches one character that we do not know
+      if cur.len > result.s.len:
+        result.s = move(cur)
+        result.prefix = prefix
+      cur = ""
+      prefix = false
+    i += n
+  if cur.len > result.s.len:
+    result.s = move(cur)
+    result.prefix = prefix
+
+proc requiredLiteral*(regex: Regex): RegexLiteral =
+  ## Return the longest string that every match of `regex` must contain,
+  ## or an empty string if we cannot tell.
+  ##
+  ## Only the part of the bytecode before the first branch is considered.
+  ## The result is UTF-8, like the strings we match against.
+  return regex.literal
+
+# Find the first position from start where lit may start a match.
+proc findLiteral(s: openArray[char]; lit: RegexLiteral; start: int): int =
+  if not lit.icase:
+    return s.find(lit.s, start)
+  # Scan for the first byte in both cases, then compare the rest.
+  let c = lit.s[0]
+  let uc = c.toUpperAscii()
+  let last = s.len - lit.s.len
+  var i = start
+  var lc = -2 # -2: not searched yet; -1: not found
+  var lu = if c == uc: -1 else: -2
+  while i <= last:
+    if lc != -1 and lc < i:
+      lc = s.find(c, i, last)
+    if lu != -1 and lu < i:
+      lu = s.find(uc, i, last)
+    if lc == -1 and lu == -1:
+      break
+    let j = if lc == -1 or lu != -1 and lu < lc: lu else: lc
+    if s.toOpenArray(j + 1, j + lit.s.high).equalsIgnoreCase(
+        lit.s.toOpenArray(1, lit.s.high)):
+      return j
+    i = j + 1
+  return -1
+
 type ExecContext* = object
   bytecode: ptr uint8
   tmp: seq[ptr uint8]
   base: uint
+  literal: ptr RegexLiteral # nil if unknown
 
 proc initContext*(bytecode: REBytecode): ExecContext =
   let bytecode = cast[ptr uint8](bytecode)
@@ -52,7 +187,8 @@ proc initContext*(bytecode: REBytecode): ExecContext =
   )
 
 proc initContext*(regex: Regex): ExecContext =
-  initContext(cast[REBytecode](unsafeAddr regex.bytecode[0]))
+  result = initContext(cast[REBytecode](unsafeAddr regex.bytecode[0]))
+  result.literal = unsafeAddr regex.literal
 
 template ncaps(ctx: ExecContext): cint =
   lre_get_capture_count(ctx.bytecode)
@@ -71,7 +207,10 @@ iterator caps*(ctx: ExecContext): tuple[s, e: int] =
   for i in 0 ..< ctx.ncaps:
     yield ctx.cap(i)
 
-iterator exec*(ctx: var ExecContext; s: openArray[char]; start = 0): cint =
+# If all is true, continue after the first match even if the regex has
+# no global flag.
+iterator exec*(ctx: var ExecContext; s: openArray[char]; start = 0;
+    all = false): cint =
   let L = cint(min(int(cint.high), s.len))
   let pcapture = if ctx.tmp.len > 0: addr ctx.tmp[0] else: nil
   let base = if s.len > 0: cast[ptr uint8](unsafeAddr s[0]) else: nil
@@ -79,9 +218,19 @@ iterator exec*(ctx: var ExecContext; s: openArray[char]; start = 0): cint =
   ctx.base = cast[uint](base)
   var start = cint(min(int(cint.high), start))
   while start < L:
+    if ctx.literal != nil and ctx.literal.s.len > 0:
+      # Skip the interpreter if the literal is not there, and jump to
+      # the literal if matches start with it.  (Sticky regexes only
+      # match at start, so we must not jump.)
+      let i = s.findLiteral(ctx.literal[], start)
+      if i < 0:
+        yield 0
+        break
+      if ctx.literal.prefix and LRE_FLAG_STICKY notin flags:
+        start = cint(i)
     let ret = lre_exec(pcapture, ctx.bytecode, base, start, L, 3, nil)
     yield ret
-    if ret != 1 or LRE_FLAG_GLOBAL notin flags:
+    if ret != 1 or not all and LRE_FLAG_GLOBAL notin flags:
       break
     let pstart = start
     start = cast[cint](ctx.cap(0).e)
@@ -98,6 +247,14 @@ iterator matchCap*(regex: Regex; s: openArray[char]; cap: int; start = 0):
       break
     yield ctx.cap(cap)
 
+iterator matchAll*(regex: Regex; s: openArray[char]): tuple[s, e: int] =
+  ## Yield the bounds of each match in `s`, ignoring the global flag.
+  var ctx = initContext(regex)
+  for ret in ctx.exec(s, all = true):
+    if ret != 1:
+      break
+    yield ctx.cap(0)
+
 proc matchFirst(ctx: var ExecContext; str: openArray[char]; start = 0):
     tuple[s, e: int] =
   for ret in ctx.exec(str, start):
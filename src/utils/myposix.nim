@@ -45,4 +45,66 @@ let SIG_IGN* {.importc, header: "<signal.h>".}: SighandlerT
 proc signal*(signum: cint; handler: SighandlerT): SighandlerT {.
   importc, header: "<signal.h>".}
 
+when defined(linux) or defined(freebsd) or defined(netbsd) or
+    defined(openbsd):
+  let SOCK_CLOEXEC {.importc, header: "<sys/socket.h>", nodecl.}: cint
+
+# socketpair(AF_UNIX, SOCK_STREAM) with both fds closed on exec.
+proc socketpairCloexec*(sv: var array[2, cint]): cint =
+  when declared(SOCK_CLOEXEC):
+    return socketpair(AF_UNIX, SOCK_STREAM or SOCK_CLOEXEC, IPPROTO_IP, sv)
+  else:
+    if socketpair(AF_UNIX, SOCK_STREAM, IPPROTO_IP, sv) != 0:
+      return -1
+    for fd in sv:
+      discard fcntl(fd, F_SETFD, FD_CLOEXEC)
+    return 0
+
+# Kernel-side copying between fds, used by the loader to stream data
+# without going through userspace buffers.
+const HasZeroCopy* = defined(linux)
+
+when HasZeroCopy:
+  # splice is a GNU extension; this only affects our own C file.
+  {.localPassC: "-D_GNU_SOURCE".}
+
+  let SPLICE_F_MOVE {.importc, header: "<fcntl.h>", nodecl.}: cuint
+  let SPLICE_F_NONBLOCK {.importc, header: "<fcntl.h>", nodecl.}: cuint
+
+  proc c_splice(fdIn: cint; offIn: ptr int64; fdOut: cint; offOut: ptr int64;
+    len: csize_t; flags: cuint): int {.importc: "splice",
+    header: "<fcntl.h>".}
+  proc c_sendfile(outFd, inFd: cint; offset: ptr Off; count: csize_t): int {.
+    importc: "sendfile", header: "<sys/sendfile.h>".}
+
+  # Move at most len bytes from the pipe fdIn to fdOut.
+  proc splice*(fdIn, fdOut: cint; len: int): int =
+    return c_splice(fdIn, nil, fdOut, nil, csize_t(len),
+      SPLICE_F_MOVE or SPLICE_F_NONBLOCK)
+
+  # Copy at most len bytes from the current offset of the regular file
+  # fdIn to fdOut, advancing the offset.
+  proc sendfile*(fdIn, fdOut: cint; len: int): int =
+    return c_sendfile(fdOut, fdIn, nil, csize_t(len))
+
+# Anonymous shared memory and event counters, used for passing data
+# between processes without pipes (see io/sharedring).
+const HasSharedRing* = defined(linux)
+
+when HasSharedRing:
+  let MFD_CLOEXEC {.importc, header: "<sys/mman.h>", nodecl.}: cuint
+  let EFD_CLOEXEC {.importc, header: "<sys/eventfd.h>", nodecl.}: cint
+  let EFD_NONBLOCK {.importc, header: "<sys/eventfd.h>", nodecl.}: cint
+
+  proc memfd_create(name: cstring; flags: cuint): cint {.importc,
+    header: "<sys/mman.h>".}
+  proc eventfd(initval: cuint; flags: cint): cint {.importc,
+    header: "<sys/eventfd.h>".}
+
+  proc memfdCreate*(name: cstring): cint =
+    return memfd_create(name, MFD_CLOEXEC)
+
+  proc eventfdCreate*(): cint =
+    return eventfd(0, EFD_CLOEXEC or EFD_NONBLOCK)
+
 {.pop.}
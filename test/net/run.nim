@@ -14,7 +14,18 @@ proc cb(req: Request) {.async.} =
     quit(0)
   var res = ""
   var headers: seq[(string, string)] = @[]
-  if req.url.path == "/headers":
+  if req.url.path == "/revalidate":
+    # the first request is stored in the HTTP cache, the second one
+    # revalidates it
+    headers.add(("ETag", "\"v1\""))
+    headers.add(("Cache-Control", "no-cache"))
+    if req.headers.getOrDefault("If-None-Match") == "\"v1\"":
+      headers.add(("Set-Cookie", "reval=304"))
+      await req.respond(Http304, "", headers.newHttpHeaders())
+      return
+    headers.add(("Set-Cookie", "reval=200"))
+    res = "revalidate"
+  elif req.url.path == "/headers":
     for k, v in req.headers:
       res &= k & ": " & v & '\n'
   else:
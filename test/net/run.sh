@@ -4,6 +4,9 @@ if ! test "$CHA"
 then	test -f ../../cha && CHA=../../cha || CHA=cha
 fi
 
+# start with an empty HTTP cache, so that revalidate.html sees a miss
+rm -rf http-cache
+
 ./run -a | {
 	IFS= read -r port
 	addr="http://localhost:$port"
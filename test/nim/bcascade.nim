@@ -0,0 +1,60 @@
+# Time the dump of pages that stress the cascade:
+#
+# * "framework": a large stylesheet and a deep DOM.  The stylesheet is
+#   modeled on CSS frameworks: thousands of rules with descendant and
+#   child combinators over class names, most of which do not match.
+# * "table": a table with 10000 rows of identical cells.
+#
+# The pages are written to a temporary file, and dumped with the cha
+# binary in $CHA.
+
+import std/os
+import std/osproc
+import std/times
+
+import benchutils
+
+proc makeSheet(): string =
+  result = ""
+  for i in 0 ..< 4000:
+    case i mod 4
+    of 0: result &= ".c" & $i & " .item span"
+    of 1: result &= ".nav-" & $(i mod 97) & " .c" & $i & " > a"
+    of 2: result &= "#id" & $i & " div .c" & $(i mod 50)
+    else: result &= "ul.list-" & $i & " li.c" & $(i mod 50) & " span"
+    result &= " { color: red }\n"
+
+proc makeBody(depth, width: int): string =
+  if depth == 0:
+    return "<span class=c1>text</span>"
+  result = ""
+  for i in 0 ..< width:
+    result &= "<div class=\"item c" & $(depth * width + i) & "\">"
+    result &= makeBody(depth - 1, width)
+    result &= "</div>"
+
+proc makeTable(): string =
+  result = "<table class=list>"
+  for i in 0 ..< 10000:
+    result &= "<tr class=row><td class=cell>" & $i &
+      "<td class=cell>text<td class=cell>text"
+  result &= "</table>"
+
+proc bench(name, html: string) =
+  let cha = getEnv("CHA", "cha")
+  let config = "test/layout/config.toml"
+  let file = getTempDir() / "bcascade.html"
+  writeFile(file, html)
+  benchWith(epochTime, name, 10):
+    let (_, code) = execCmdEx(quoteShellCommand([cha, "-C", config, "-d",
+      file]))
+    doAssert code == 0
+  removeFile(file)
+
+proc main() =
+  bench "framework", "<!DOCTYPE html><style>" & makeSheet() & "</style>" &
+    makeBody(6, 4)
+  bench "table", "<!DOCTYPE html><style>.list td { padding: 0 1ch }" &
+    ".row { color: red }</style>" & makeTable()
+
+main()
@@ -0,0 +1,25 @@
+# Timing helpers shared by the benchmarks (test/nim/b*.nim).
+
+import std/math
+import std/times
+
+# Run body iter times, and print the average, lowest and highest time
+# clock measured.  Benchmarks that wait for child processes must use a
+# wall clock (epochTime) instead of cpuTime.
+template benchWith*(clock: untyped; name: string; iter: int;
+    body: untyped) =
+  var low = float64.high
+  var high = 0f64
+  var times = 0f64
+  for i in 0 ..< iter:
+    let start = clock()
+    body
+    let time = clock() - start
+    low = min(low, time)
+    high = max(high, time)
+    times += time
+  echo name, ": avg ", (times / float64(iter)).round(6), " lowest ",
+    low.round(6), " highest ", high.round(6)
+
+template bench*(name: string; iter: int; body: untyped) =
+  benchWith(cpuTime, name, iter, body)
@@ -0,0 +1,118 @@
+# Compare the flat packet codec with field-by-field serialization, using
+# the data of a getLines response.
+
+import io/packetreader
+import io/packetwriter
+import server/bufferiface
+import types/cell
+
+import benchutils
+
+# The generic object/seq path as it was before flat types were copied
+# in one go.
+proc swriteFields(w: var PacketWriter; x: SomeNumber) =
+  w.swrite(x)
+
+proc swriteFields(w: var PacketWriter; x: object) =
+  for f in x.fields:
+    w.swriteFields(f)
+
+proc swriteFields[T](w: var PacketWriter; s: seq[T]) =
+  w.swrite(s.len)
+  for x in s:
+    w.swriteFields(x)
+
+proc swriteFields(w: var PacketWriter; line: SimpleFlexibleLine) =
+  w.swrite(line.str)
+  w.swriteFields(line.formats)
+
+proc sreadFields(r: var PacketReader; x: var SomeNumber) =
+  r.sread(x)
+
+proc sreadFields(r: var PacketReader; x: var object) =
+  for f in x.fields:
+    r.sreadFields(f)
+
+proc sreadFields[T](r: var PacketReader; s: var seq[T]) =
+  var len: int
+  r.sread(len)
+  s = newSeq[T](len)
+  for x in s.mitems:
+    r.sreadFields(x)
+
+proc sreadFields(r: var PacketReader; line: var SimpleFlexibleLine) =
+  r.sread(line.str)
+  r.sreadFields(line.formats)
+
+proc makeGrid(): SimpleFlexibleGrid =
+  result = @[]
+  for y in 0 ..< 200:
+    var line = SimpleFlexibleLine()
+    for x in 0 ..< 80:
+      line.str.add(char(ord('a') + (x + y) mod 26))
+    for x in countup(0, 79, 8):
+      var format = initFormat(defaultColor, defaultColor, {})
+      if x mod 16 == 0:
+        format.incl(ffBold)
+      line.formats.add(SimpleFormatCell(format: format, pos: x))
+    result.add(line)
+
+proc main() =
+  const Iter = 2000
+  let grid = makeGrid()
+  let matches = newSeq[BufferMatch](1000)
+  # check that both paths produce the same bytes
+  var w1 = initPacketWriter()
+  var w2 = initPacketWriter()
+  w1.swrite(grid)
+  w1.swrite(matches)
+  w2.swrite(grid.len)
+  for line in grid:
+    w2.swriteFields(line)
+  w2.swriteFields(matches)
+  doAssert w1.buffer.toOpenArray(0, w1.bufLen - 1) ==
+    w2.buffer.toOpenArray(0, w2.bufLen - 1)
+  # the reader gets the packet without its length fields; copying it is
+  # part of every read benchmark
+  let packet = w1.buffer[sizeof(int) * 2 ..< w1.bufLen]
+  bench "write, fields", Iter:
+    var w = initPacketWriter()
+    w.swrite(grid.len)
+    for line in grid:
+      w.swriteFields(line)
+    w.swriteFields(matches)
+  bench "write, flat", Iter:
+    var w = initPacketWriter()
+    w.swrite(grid)
+    w.swrite(matches)
+  bench "read, fields", Iter:
+    var r = initPacketReader(packet)
+    var len: int
+    r.sread(len)
+    var grid2 = newSeq[SimpleFlexibleLine](len)
+    for line in grid2.mitems:
+      r.sreadFields(line)
+    var matches2: seq[BufferMatch]
+    r.sreadFields(matches2)
+    doAssert grid2 == grid
+  bench "read, flat", Iter:
+    var r = initPacketReader(packet)
+    var grid2: SimpleFlexibleGrid
+    r.sread(grid2)
+    var matches2: seq[BufferMatch]
+    r.sread(matches2)
+    doAssert grid2 == grid
+  bench "read, flat + views", Iter:
+    var r = initPacketReader(packet)
+    var len: int
+    r.sread(len)
+    var formats: seq[SimpleFormatCell]
+    for i in 0 ..< len:
+      var str: PacketView
+      r.sread(str)
+      r.sread(formats)
+      doAssert str.toOpenArray() == grid[i].str
+    var matches2: seq[BufferMatch]
+    r.sread(matches2)
+
+main()
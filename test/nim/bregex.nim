@@ -0,0 +1,60 @@
+# Compare regex search over a large text with and without the literal
+# prefilter of lrewrap.
+
+import monoucha/libregexp
+import utils/lrewrap
+
+import benchutils
+
+proc makeText(): seq[string] =
+  const words = ["lorem", "ipsum", "dolor", "sit", "amet", "consectetur",
+    "adipiscing", "elit", "sed", "do", "eiusmod", "tempor", "incididunt",
+    "ut", "labore", "et", "dolore", "magna", "aliqua"]
+  result = @[]
+  var x = 1u32
+  for y in 0 ..< 50000:
+    var line = ""
+    while line.len < 80:
+      x = x * 1103515245u32 + 12345u32
+      line &= words[int(x shr 16) mod words.len]
+      line &= ' '
+    if y mod 5000 == 4999:
+      line &= "needle"
+    result.add(line)
+
+# The interpreter alone, as lrewrap ran it before the prefilter.
+proc countPlain(regex: Regex; text: seq[string]): int =
+  let bytecode = cast[ptr uint8](unsafeAddr regex.bytecode[0])
+  var capture = newSeq[ptr uint8](int(lre_get_alloc_count(bytecode)))
+  for s in text:
+    let base = cast[ptr uint8](unsafeAddr s[0])
+    if lre_exec(addr capture[0], bytecode, base, 0, cint(s.len), 3, nil) == 1:
+      inc result
+
+proc countPrefilter(regex: Regex; text: seq[string]): int =
+  for s in text:
+    if regex.match(s):
+      inc result
+
+proc main() =
+  const Iter = 20
+  let text = makeText()
+  let flags = {LRE_FLAG_GLOBAL, LRE_FLAG_UNICODE}
+  let iflags = flags + {LRE_FLAG_IGNORECASE}
+  for (name, pattern, f) in [
+        ("literal", "needle", flags),
+        ("literal, i", "needle", iflags),
+        ("prefix", "dolore m", flags),
+        ("infix", "\\w+ore magna", flags),
+        ("no literal", "[xyz]{2}", flags)
+      ]:
+    var regex: Regex
+    doAssert compileRegex(pattern, f, regex)
+    let n = regex.countPlain(text)
+    doAssert regex.countPrefilter(text) == n
+    bench name & ", interpreter", Iter:
+      doAssert regex.countPlain(text) == n
+    bench name & ", prefilter", Iter:
+      doAssert regex.countPrefilter(text) == n
+
+main()
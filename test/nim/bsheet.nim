@@ -0,0 +1,23 @@
+# Compare the cost of the UA, quirks and user sheets at buffer startup
+# when they are parsed, and when they are found in the parsed sheet
+# cache, as buffers forked after the fork server preparsed them do.
+
+import config/conftypes
+import html/catom
+import html/dom
+import types/winattrs
+
+import benchutils
+
+proc main() =
+  const Iter = 1000
+  initCAtomFactory()
+  var attrs = dummyAttrs
+  bench "parse", Iter:
+    # the window size is part of the key, so this is always a miss
+    inc attrs.widthPx
+    preparseSheets(attrs, smTrue, hmFalse, "text/html", "")
+  bench "cached", Iter:
+    preparseSheets(attrs, smTrue, hmFalse, "text/html", "")
+
+main()
@@ -0,0 +1,32 @@
+import css/cssvalues
+import html/catom
+
+proc testInterned() =
+  initCAtomFactory()
+  let root = rootProperties().atomize()
+  assert rootProperties().atomize() == root, "atomize does not dedupe"
+  let parent = root.copyProperties()
+  parent{"display"} = DisplayBlock
+  parent{"white-space"} = WhiteSpacePre
+  let parent2 = parent.atomize()
+  assert parent2 != root
+  # inherited values are shared, and only include inherited properties
+  let inherited = parent2.inheritedValues()
+  assert parent2.inheritedValues() == inherited
+  assert inherited == parent2.inheritProperties().atomize()
+  assert inherited{"white-space"} == WhiteSpacePre
+  assert inherited{"display"} == DisplayInline
+  # which is its own inherited values
+  assert inherited.inheritedValues() == inherited
+  # copies do not keep the inherited values of the original
+  let copy = parent2.copyProperties()
+  copy{"white-space"} = WhiteSpaceNormal
+  assert copy.inheritedValues(){"white-space"} == WhiteSpaceNormal
+  # split tables are interned too
+  let table = parent2.copyProperties()
+  table{"display"} = DisplayTable
+  let (outer, inner) = table.atomize().splitTable()
+  let (outer2, inner2) = table.atomize().splitTable()
+  assert outer == outer2 and inner == inner2
+
+testInterned()
@@ -0,0 +1,55 @@
+import monoucha/libregexp
+import utils/lrewrap
+
+proc compile(s: string; flags: LREFlags = {}): Regex =
+  doAssert compileRegex(s, flags, result)
+
+proc literal(s: string; flags: LREFlags = {}): RegexLiteral =
+  return compile(s, flags).requiredLiteral()
+
+proc testRequiredLiteral() =
+  assert literal("abc") == RegexLiteral(s: "abc", prefix: true)
+  assert literal("^abc$") == RegexLiteral(s: "abc", prefix: true)
+  assert literal("\\babc") == RegexLiteral(s: "abc", prefix: true)
+  assert literal("a.bcd") == RegexLiteral(s: "bcd")
+  assert literal("ab[xy]c") == RegexLiteral(s: "ab", prefix: true)
+  assert literal("(ab)c").s == "abc"
+  assert literal("a\\bb").s == "ab"
+  assert literal("abc", {LRE_FLAG_STICKY}).s == "abc"
+  assert literal("äöü").s == "äöü"
+  assert literal("x😀y", {LRE_FLAG_UNICODE}).s == "x😀y"
+  # branches end the search
+  assert literal("ab?c").s == "a"
+  assert literal("a|bcd").s == ""
+  assert literal("a*bcd").s == ""
+  # case-insensitive literals are ASCII only, and exclude k and s
+  let flags = {LRE_FLAG_IGNORECASE, LRE_FLAG_UNICODE}
+  assert literal("AbC", flags) == RegexLiteral(s: "abc", icase: true,
+    prefix: true)
+  assert literal("äbcd", flags) == RegexLiteral(s: "bcd", icase: true)
+  assert literal("abskab", flags).s == "ab"
+
+proc testMatch() =
+  assert compile("bcd").matchFirst("abcabcd") == (s: 4, e: 7)
+  assert compile("bcd").matchFirst("abcabc") == (s: -1, e: -1)
+  assert compile("a.cd").matchFirst("abcdaxcd", 1) == (s: 4, e: 8)
+  assert compile("^abc").matchFirst("xabc") == (s: -1, e: -1)
+  assert compile("\\babc").matchFirst("xabc abc") == (s: 5, e: 8)
+  let flags = {LRE_FLAG_IGNORECASE, LRE_FLAG_UNICODE}
+  assert compile("bcd", flags).matchFirst("xBcxbCD") == (s: 4, e: 7)
+  assert compile("sk", flags).matchFirst("\u017F\u212A") == (s: 0, e: 5)
+  # sticky regexes only match at start, even if the literal is further on
+  let sticky = {LRE_FLAG_STICKY}
+  assert compile("foo", sticky).matchFirst("xfoo") == (s: -1, e: -1)
+  assert compile("foo", sticky).matchFirst("xfoo", 1) == (s: 1, e: 4)
+  assert compile("foo", sticky).matchFirst("foo") == (s: 0, e: 3)
+
+proc testMatchAll() =
+  var res: seq[tuple[s, e: int]] = @[]
+  for it in compile("a+").matchAll("baab a"):
+    res.add(it)
+  assert res == @[(s: 1, e: 3), (s: 5, e: 6)]
+
+testRequiredLiteral()
+testMatch()
+testMatchAll()
@@ -0,0 +1,56 @@
+import server/pendingqueue
+import server/request
+
+type Item = ref object
+  name: string
+  priority*: RequestPriority
+  ticket*: uint64
+  next*: Item
+
+proc add(queue: var PendingQueue[Item]; name: string;
+    priority: RequestPriority) =
+  queue.add(Item(name: name, priority: priority))
+
+proc popAll(queue: var PendingQueue[Item]): seq[string] =
+  result = @[]
+  while (let it = queue.pop(); it != nil):
+    result.add(it.name)
+
+proc testOrder() =
+  var queue = PendingQueue[Item]()
+  assert queue.isEmpty()
+  queue.add("prefetch", rpPrefetch)
+  queue.add("image", rpImage)
+  queue.add("async", rpAsyncScript)
+  queue.add("script", rpScript)
+  queue.add("style", rpStyle)
+  queue.add("image2", rpImage)
+  queue.add("navigate", rpNavigate)
+  assert queue.popAll() == @["navigate", "style", "script", "async", "image",
+    "image2", "prefetch"]
+  assert queue.isEmpty()
+
+proc testAging() =
+  var queue = PendingQueue[Item]()
+  queue.add("prefetch", rpPrefetch)
+  queue.add("image", rpImage)
+  # new images keep arriving, but must not starve the prefetch forever
+  var n = 0
+  while queue.pop().name != "prefetch" and n < 100:
+    queue.add("image", rpImage)
+    inc n
+  assert n > 0 and n <= int(PendingAgingStep) * 2, $n
+
+proc testSetPriority() =
+  var queue = PendingQueue[Item]()
+  queue.add("image", rpImage)
+  queue.add("visible", rpImage)
+  queue.add("script", rpAsyncScript)
+  queue.setPriority(rpVisibleImage, proc(it: Item): bool =
+    it.name == "visible"
+  )
+  assert queue.popAll() == @["script", "visible", "image"]
+
+testOrder()
+testAging()
+testSetPriority()
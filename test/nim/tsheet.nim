@@ -0,0 +1,65 @@
+import std/algorithm
+
+import config/conftypes
+import css/cssvalues
+import css/sheet
+import html/catom
+import html/script
+import types/url
+import types/winattrs
+
+proc rules(map: CSSRuleMap; class: string): seq[CSSRuleDef] =
+  result = @[]
+  for it in map.classTable.getAll(class.toAtom()):
+    result.add(it)
+
+proc rules(sheet: CSSStylesheet; class: string): seq[CSSRuleDef] =
+  let map = newCSSRuleMap(quirks = false)
+  map.add(sheet)
+  return map.rules(class)
+
+proc testParsedSheetCache() =
+  initCAtomFactory()
+  var attrs = dummyAttrs
+  var settings = EnvironmentSettings(
+    attrsp: addr attrs,
+    scriptAttrsp: addr attrs,
+    scripting: smFalse,
+    headless: hmFalse,
+    contentType: "text/html".toAtomTrace()
+  )
+  template parse(src: string): CSSStylesheet =
+    parseStylesheet(src, URL(nil), addr settings, coAuthor, CAtomNullTraced)
+  const src = ".a { color: red } .b .a { color: blue }"
+  let sheet1 = parse(src)
+  let rules1 = sheet1.rules("a")
+  assert rules1.len == 2
+  # a hit shares the rule bodies, but not the rules
+  let sheet2 = parse(src)
+  let rules2 = sheet2.rules("a")
+  assert rules2.len == 2
+  for i, it in rules1:
+    assert it.body == rules2[i].body
+    assert it != rules2[i]
+  # the same sheet linked twice, with another one in between
+  let other = parse(".a { color: green }")
+  let map = newCSSRuleMap(quirks = false)
+  map.add(sheet1)
+  map.add(other)
+  map.add(sheet2)
+  var ids: seq[uint64] = @[]
+  for it in map.rules("a"):
+    ids.add(it.idx shr 32)
+  ids.sort()
+  assert ids == @[0u64, 0, 1, 2, 2]
+  for it in rules1:
+    assert it.idx shr 32 == 0
+  for it in rules2:
+    assert it.idx shr 32 == 2
+  # the window size is part of the key, so this is a miss
+  inc attrs.widthPx
+  let rules3 = parse(src).rules("a")
+  assert rules3.len == 2
+  assert rules3[0].body != rules1[0].body
+
+testParsedSheetCache()